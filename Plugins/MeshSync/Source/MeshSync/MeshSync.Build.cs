@@ -1,5 +1,6 @@
 // Copyright 1998-2019 Epic Games, Inc. All Rights Reserved.
 
+using System.IO;
 using UnrealBuildTool;
 
 public class MeshSync : ModuleRules
@@ -40,6 +41,11 @@ public class MeshSync : ModuleRules
 				"SlateCore",
                 "Sockets",
                 "RawMesh",
+                "MeshUtilities",
+                "MeshReductionInterface",
+                "MeshDescription",
+                "MeshDescriptionOperations",
+                "DerivedDataCache",
                 "ImageWrapper",
                 "AssetRegistry",
                 "UnrealEd",
@@ -55,6 +61,15 @@ public class MeshSync : ModuleRules
             }
 			);
 
+        // The reactor polls the native descriptors of its sockets where they are BSD sockets.
+        bool bNativePoll = Target.Platform == UnrealTargetPlatform.Win64 || Target.Platform == UnrealTargetPlatform.Win32 ||
+            Target.Platform == UnrealTargetPlatform.Mac || Target.Platform == UnrealTargetPlatform.Linux;
+        if (bNativePoll)
+        {
+            PrivateIncludePaths.Add(Path.Combine(EngineDirectory, "Source/Runtime/Sockets/Private"));
+        }
+        PrivateDefinitions.Add("MESHSYNC_NATIVE_POLL=" + (bNativePoll ? "1" : "0"));
+
         //if (Target.Type == TargetType.Editor)
         //{
         //    DynamicallyLoadedModuleNames.Add("Settings");
@@ -1,18 +1,41 @@
 // Copyright 1998-2019 Epic Games, Inc. All Rights Reserved.
-#pragma optimize("", off)
 #include "MeshSync.h"
 #include "MeshSyncSettings.h"
-#include "Async.h"
+#include "MeshSyncServer.h"
+#include "MeshSyncCommitQueue.h"
+#include "MeshSyncPreprocess.h"
+#include "MeshSyncAssetIndex.h"
+#include "MeshSyncBenchmark.h"
+#include "MeshSyncCapture.h"
+#include "MeshSyncMaterialResolver.h"
+#include "MeshSyncPalette.h"
+#include "MeshSyncMerge.h"
+#include "MeshSyncStats.h"
 
 #include "HAL/ThreadSafeCounter.h"
 #include "HAL/Runnable.h"
 #include "HAL/RunnableThread.h"
+#include "Misc/IQueuedWork.h"
+#include "Misc/QueuedThreadPool.h"
 #include "Misc/OutputDeviceRedirector.h"
+#include "Misc/Compression.h"
 #include "IPAddress.h"
 
 #include "Sockets.h"
 #include "SocketSubsystem.h"
 
+#if MESHSYNC_NATIVE_POLL
+	#include "BSDSockets/SocketsBSD.h"
+	#if PLATFORM_WINDOWS
+		typedef WSAPOLLFD FMeshSyncPollFd;
+		#define MeshSyncPoll WSAPoll
+	#else
+		#include <poll.h>
+		typedef pollfd FMeshSyncPollFd;
+		#define MeshSyncPoll poll
+	#endif
+#endif
+
 #if WITH_EDITOR
 	#include "ISettingsModule.h"
 	#include "ISettingsSection.h"
@@ -44,251 +67,27 @@
 #define MT_DECOR			TEXT("/MeshSync/Materials/MT_Decor.MT_Decor")
 #define MT_KNOBS			TEXT("/MeshSync/Materials/MT_Knobs.MT_Knobs")
 
-enum class EMeshSyncCommand : uint32 {
-	SendMesh,
-	SendMaterial,
-};
-
-enum class MeshFlag : uint32 {
-	NONE = 0,
-	HAS_INDICES = 1,
-	HAS_UV0 = 2,
-	HAS_UV1 = 4,
-	HAS_NORMAL = 8,
-	HAS_COLOR_0 = 16,
-	HAS_TEX_ID = 32,
-	HAS_INSTANCE_POSITION = 64,
-	HAS_INSTANCE_COLOR0 = 128,
-	HAS_INDICES_UV01_COLOR0_TEXID = (HAS_INDICES | HAS_UV0 | HAS_UV1 | HAS_COLOR_0 | HAS_TEX_ID),
-	HAS_INDICES_INSTANCE_POS_COLOR = (HAS_INDICES | HAS_INSTANCE_POSITION | HAS_INSTANCE_COLOR0)
-};
-
-enum EMaterialMS {
-	MAT_MS_TERRAIN,
-	MAT_MS_DECOR,
-	MAT_MS_KNOBS,
-	MAT_MS_WATER
-};
-
-const uint64_t MagicNumber = 0x64202114f;
-
-struct MeshSyncPayload
-{
-	uint64_t Magic;
-	uint32_t Length;
-	EMeshSyncCommand Command;
-};
-
-static_assert(sizeof(FColor) == 4, "Size of FColor invalid");
-
-class FMeshSyncServer;
-
-class FSyncedMeshDesc
+// Pool work item that drains one connection's frame queue.
+class FMeshSyncFrameWork : public IQueuedWork
 {
 public:
-	FString		Name;
-	FRawMesh	RawMesh;
-	TArray<FString>		MaterialSlots;
-	// Tile ID
-	uint32		TileX;
-	uint32		TileY;
-	uint32		TileZ;
-};
-
-class FMeshSyncConnectionThreaded : public FRunnable {
-public:
-	FMeshSyncConnectionThreaded(FMeshSyncServer* InServer, FSocket* InSocket, FString const& InPackage);
-	~FMeshSyncConnectionThreaded()
-	{
-		WorkerThread->Kill(true);
-		delete WorkerThread;
-		WorkerThread = NULL;
-	}
-
-	virtual bool Init() override
-	{
-		DispProcs.Add(EMeshSyncCommand::SendMesh) = &FMeshSyncConnectionThreaded::ProcessingIncomingMesh;
-		DispProcs.Add(EMeshSyncCommand::SendMaterial) = &FMeshSyncConnectionThreaded::ProcessingIncomingMaterial;
-		return true;
-	}
-
-	bool ReadSizedBuffer(TArray<uint8>& Buffer) {
-		int32 Recved = 0;
-		auto Ret = Socket->Recv(Buffer.GetData(), Buffer.Num(), Recved);
-		return Ret && Recved == Buffer.Num();
-	}
-
-	bool ReadString(FString& Str) {
-		uint32 Length = 0;
-		ReadPrim(Length);
-		if (Length > 0) {
-			char* Buffer = new char[Length + 1];
-			int32 Recved = 0;
-			Socket->Recv((uint8*)Buffer, Length, Recved);
-			Buffer[Length] = 0;
-			Str = ANSI_TO_TCHAR(Buffer);
-			delete[] Buffer;
-		}
-		return true;
-	}
-
-	bool ReadStringList(TArray<FString>& StrList) {
-		uint32 Count = 0;
-		ReadPrim(Count);
-		if (Count > 0) {
-			for (uint32 i = 0; i < Count; i++) {
-				FString ReadStr;
-				ReadString(ReadStr);
-				StrList.Add(ReadStr);
-			}
-		}
-		return true;
-	}
-
-	template <typename T>
-	bool ReadPrim(T& Prim) {
-		int32 Recved = 0;
-		auto Ret = Socket->Recv((uint8*)&Prim, sizeof(T), Recved);
-		return Ret && Recved == sizeof(T);
-	}
-
-	template <typename T>
-	bool ReadArray(TArray<T>& Array) {
-		uint32 Length = 0;
-		ReadPrim(Length);
-		if (Length > 0) {
-			Array.AddUninitialized(Length);
-			int32 Recved = 0;
-			Socket->Recv((uint8*)Array.GetData(), sizeof(T)*Array.Num(), Recved);
-			if (Recved != sizeof(T)*Array.Num())
-				return false;
-		}
-		return true;
-	}
-
-	bool IsAlive() const {
-		if (!IsRunning())
-			return false;
-		return Socket && 
-			Socket->GetConnectionState() == SCS_Connected;
-	}
-
-	bool ProcessingPayload(MeshSyncPayload& Payload);
-	bool Dispatch(EMeshSyncCommand Command, uint32 Length);
-	bool ProcessingIncomingMesh(uint32 Length);
-	bool ProcessingIncomingMaterial(uint32 Length);
-
-	virtual uint32 Run() override
-	{
-		while (!StopRequested.GetValue())
-		{
-			MeshSyncPayload Payload = {};
-			if (!ProcessingPayload(Payload)) {
-				break;
-			}
-			if (!Dispatch(Payload.Command, Payload.Length)) {
-				break;
-			}
-		}
-		return true;
-	}
+	FMeshSyncFrameWork(FMeshSyncConnectionPtr InConnection)
+		: Connection(InConnection)
+	{}
 
-	virtual void Stop() override
+	virtual void DoThreadedWork() override
 	{
-		StopRequested.Set(true);
+		Connection->ProcessFrames();
+		delete this;
 	}
 
-	virtual void Exit() override
+	virtual void Abandon() override
 	{
-		Socket->Close();
-		ISocketSubsystem::Get()->DestroySocket(Socket);
-		Socket = NULL;
-		Running.Set(false);
-	}
-
-	bool IsRunning() const
-	{
-		return (Running.GetValue() != 0);
-	}
-
-	void GetAddress(FInternetAddr& Addr)
-	{
-		Socket->GetAddress(Addr);
-	}
-
-	void GetPeerAddress(FInternetAddr& Addr)
-	{
-		Socket->GetPeerAddress(Addr);
+		delete this;
 	}
 
 private:
-	FSocket* Socket;
-	FThreadSafeCounter StopRequested;
-	FThreadSafeCounter Running;
-	FRunnableThread* WorkerThread;
-	FMeshSyncServer* Server;
-	typedef bool(FMeshSyncConnectionThreaded::*FnProcessing)(uint32 Length);
-	TMap<EMeshSyncCommand, FnProcessing> DispProcs;
-	FString PathPackage;
-};
-
-class FMeshSyncServer : public FRunnable
-{
-public:
-	FMeshSyncServer() {}
-	~FMeshSyncServer();
-
-	void Create(int InPort);
-
-	virtual bool Init() override
-	{
-		return true;
-	}
-
-	void Stop() {
-		StopRequested.Set(1);
-	}
-
-	//void AddMesh(FSyncedMeshDesc const& Desc) {
-	//	FScopeLock ScopeLock(&MeshMutex);
-	//	bool bIsAlreayExists = false;
-	//	Meshes.Add(Desc, &bIsAlreayExists);
-	//	if (bIsAlreayExists) {
-	//		UE_LOG(LogMeshSync, Display, TEXT("%s is already added !"), *Desc.Name);
-	//	}
-	//}
-
-	virtual uint32 Run() override;
-
-	const FString& MainPackage() const { return PathPackage; }
-	const FString& MaterialsPackage() const { return PathPackageMaterials; }
-
-	UMaterialInterface* FindMaterial(FString const& Name);
-	void AddMaterial(FString const& Name, UMaterialInterface* Material);
-
-private:
-	void InitMaterials();
-
-	// Holds the server (listening) socket.
-	FSocket*	Socket;
-	FString		PathPackage;
-	FString		PathPackageMaterials;
-	// Holds the server thread object.
-	FRunnableThread* Thread;
-	// Holds the address that the server is bound to.
-	TSharedPtr<FInternetAddr> ListenAddr;
-	// Holds a flag indicating whether the thread should stop executing
-	FThreadSafeCounter StopRequested;
-	// Is the Listner thread up and running. 
-	FThreadSafeCounter Running;
-	TArray<FMeshSyncConnectionThreaded*> Connections;
-	TMap<FString, UMaterialInterface*> Materials;
-/*
-	FCriticalSection			MeshMutex;
-	TSet<FSyncedMeshDesc> Meshes;
-*/
-
-	TMap<FString, UMaterialInstanceConstant*> MaterialInstances;
+	FMeshSyncConnectionPtr Connection;
 };
 
 #define LOCTEXT_NAMESPACE "FMeshSyncModule"
@@ -342,6 +141,33 @@ IMPLEMENT_MODULE(FMeshSyncModule, MeshSync)
 
 DEFINE_LOG_CATEGORY(LogMeshSync);
 
+DEFINE_STAT(STAT_MeshSync_Receive);
+DEFINE_STAT(STAT_MeshSync_ProcessPayload);
+DEFINE_STAT(STAT_MeshSync_Dispatch);
+DEFINE_STAT(STAT_MeshSync_Inflate);
+DEFINE_STAT(STAT_MeshSync_ReadLayout);
+DEFINE_STAT(STAT_MeshSync_ReadArrays);
+DEFINE_STAT(STAT_MeshSync_Validate);
+DEFINE_STAT(STAT_MeshSync_Hash);
+DEFINE_STAT(STAT_MeshSync_Preprocess);
+DEFINE_STAT(STAT_MeshSync_ReduceLODs);
+DEFINE_STAT(STAT_MeshSync_MergeCell);
+DEFINE_STAT(STAT_MeshSync_SpillCell);
+DEFINE_STAT(STAT_MeshSync_CommitBatch);
+DEFINE_STAT(STAT_MeshSync_CreatePackage);
+DEFINE_STAT(STAT_MeshSync_CreateBodySetup);
+DEFINE_STAT(STAT_MeshSync_PostEditChange);
+DEFINE_STAT(STAT_MeshSync_CommitMaterial);
+DEFINE_STAT(STAT_MeshSync_PlaceTiles);
+DEFINE_STAT(STAT_MeshSync_SavePackages);
+DEFINE_STAT(STAT_MeshSync_BytesReceived);
+DEFINE_STAT(STAT_MeshSync_FramesInFlight);
+DEFINE_STAT(STAT_MeshSync_PreprocessInFlight);
+DEFINE_STAT(STAT_MeshSync_CommitQueueDepth);
+DEFINE_STAT(STAT_MeshSync_InFlightMeshes);
+DEFINE_STAT(STAT_MeshSync_InFlightMemory);
+DEFINE_STAT(STAT_MeshSync_ReadingPaused);
+
 FMeshSyncServer::~FMeshSyncServer()
 {
 	if (Thread != NULL)
@@ -351,6 +177,39 @@ FMeshSyncServer::~FMeshSyncServer()
 		Thread = NULL;
 	}
 
+	// A running replay feeds the pool, stop it before the pool goes away.
+	if (Capture != NULL)
+	{
+		Capture->StopReplay();
+	}
+
+	if (WorkerPool != NULL)
+	{
+		WorkerPool->Destroy();
+		delete WorkerPool;
+		WorkerPool = NULL;
+	}
+	Connections.Empty();
+
+	delete Merger;
+	Merger = NULL;
+	delete BenchMerger;
+	BenchMerger = NULL;
+	delete Preprocessor;
+	Preprocessor = NULL;
+	delete CommitQueue;
+	CommitQueue = NULL;
+	delete AssetIndex;
+	AssetIndex = NULL;
+	delete BenchAssetIndex;
+	BenchAssetIndex = NULL;
+	delete Capture;
+	Capture = NULL;
+	delete MaterialResolver;
+	MaterialResolver = NULL;
+	delete Palette;
+	Palette = NULL;
+
 	Socket->Close();
 	ISocketSubsystem::Get()->DestroySocket(Socket);
 	Socket = NULL;
@@ -365,6 +224,15 @@ void FMeshSyncServer::Create(int InPort)
 	FString absolutePathPackageMaterials = FPaths::ProjectContentDir() + "/Lego/Scene/Materials/";
 	FPackageName::RegisterMountPoint(*PathPackage, *absolutePathPackage);
 	FPackageName::RegisterMountPoint(*PathPackageMaterials, *absolutePathPackageMaterials);
+	PathBenchPackage = TEXT("/Temp/MeshSyncBench/");
+	PathBenchMaterials = TEXT("/Temp/MeshSyncBench/Materials/");
+	AssetIndex = new FMeshSyncAssetIndex(FPaths::ProjectSavedDir() / TEXT("MeshSync/AssetIndex.txt"));
+	MaterialResolver = new FMeshSyncMaterialResolver(PathPackageMaterials);
+	Palette = new FMeshSyncPalette(PathPackageMaterials);
+	CommitQueue = new FMeshSyncCommitQueue(this);
+	Preprocessor = new FMeshSyncPreprocessor(this);
+	Merger = new FMeshSyncMerger(this, FPaths::ProjectSavedDir() / TEXT("MeshSync/Merge"));
+	Capture = new FMeshSyncCapture(this);
 	ISocketSubsystem* SocketSubsystem = ISocketSubsystem::Get();
 	if (!SocketSubsystem)
 	{
@@ -386,7 +254,7 @@ void FMeshSyncServer::Create(int InPort)
 			{
 				UE_LOG(LogMeshSync, Warning, TEXT("Failed to bind listen socket %s in FMeshSyncServer"), *ListenAddr->ToString(true));
 			}
-			else if (!Socket->Listen(16))
+			else if (!Socket->Listen(64))
 			{
 				UE_LOG(LogMeshSync, Warning, TEXT("Failed to listen on socket %s in FMeshSyncServer"), *ListenAddr->ToString(true));
 			}
@@ -395,7 +263,21 @@ void FMeshSyncServer::Create(int InPort)
 				int32 port = Socket->GetPortNo();
 				check((InPort == 0 && port != 0) || port == InPort);
 				ListenAddr->SetPort(port);
-				Thread = FRunnableThread::Create(this, TEXT("FMeshSyncServer"), 8 * 1024, TPri_AboveNormal);
+
+#if UE_BUILD_DEBUG
+				// workers need more space in debug builds as they try to log messages and such
+				const static uint32 MeshSyncWorkerThreadSize = 2 * 1024 * 1024;
+#else
+				const static uint32 MeshSyncWorkerThreadSize = 1 * 1024 * 1024;
+#endif
+				int32 NumWorkers = GetDefault<UMeshSyncSettings>()->WorkerThreads;
+				if (NumWorkers <= 0) {
+					NumWorkers = FMath::Max(FPlatformMisc::NumberOfCoresIncludingHyperthreads() / 2, 1);
+				}
+				WorkerPool = FQueuedThreadPool::Allocate();
+				verify(WorkerPool->Create(NumWorkers, MeshSyncWorkerThreadSize, TPri_Normal));
+
+				Thread = FRunnableThread::Create(this, TEXT("FMeshSyncServer"), 128 * 1024, TPri_AboveNormal);
 				UE_LOG(LogMeshSync, Display, TEXT("Mesh Sync Server is ready for client connections on %s!"), *ListenAddr->ToString(true));
 			}
 		}
@@ -406,306 +288,1100 @@ void FMeshSyncServer::Create(int InPort)
 uint32 FMeshSyncServer::Run()
 {
 	Running.Set(true);
+	// Grows while attached clients stay quiet, drops back as soon as one of them makes progress.
+	int32 IdleWaitMs = MinIdleWaitMs;
+	double LastLivenessCheck = 0.0;
 	while (!StopRequested.GetValue())
 	{
-		bool bReadReady = false;
-		if (Socket->WaitForPendingConnection(bReadReady, FTimespan::FromSeconds(0.25f)))
+		SET_DWORD_STAT(STAT_MeshSync_ReadingPaused, IsOverInFlightBudget() ? 1 : 0);
+		// Failed receives already drop a connection, polling the socket state is only a fallback.
+		const double Now = FPlatformTime::Seconds();
+		const bool bCheckLiveness = (Now - LastLivenessCheck) * 1000.0 >= LivenessCheckIntervalMs;
+		if (bCheckLiveness)
 		{
-			for (int32 ConnectionIndex = 0; ConnectionIndex < Connections.Num(); ++ConnectionIndex)
-			{
-				FMeshSyncConnectionThreaded* Connection = Connections[ConnectionIndex];
-				if (!Connection->IsAlive())
-				{
-					Connections.RemoveAtSwap(ConnectionIndex);
-					delete Connection;
-				}
-			}
+			LastLivenessCheck = Now;
+		}
 
-			if (bReadReady)
+		bool bProgress = false;
+		for (int32 ConnectionIndex = Connections.Num() - 1; ConnectionIndex >= 0; --ConnectionIndex)
+		{
+			FMeshSyncConnectionPtr& Connection = Connections[ConnectionIndex];
+			if (!Connection->PumpSend(bProgress) || !Connection->PumpReceive(bProgress) || Connection->HasFailed() ||
+				(bCheckLiveness && !Connection->IsAlive()))
 			{
-				FSocket* ClientSocket = Socket->Accept(TEXT("Remote Connection"));
-				if (ClientSocket != NULL)
-				{
-					FMeshSyncConnectionThreaded* Connection = new FMeshSyncConnectionThreaded(this, ClientSocket, PathPackage);
-					Connections.Add(Connection);
-				}
+				// A worker still decoding this connection keeps it alive until it is done.
+				Connections.RemoveAtSwap(ConnectionIndex);
 			}
 		}
+
+		if (bProgress)
+		{
+			IdleWaitMs = MinIdleWaitMs;
+		}
 		else
 		{
-			FPlatformProcess::Sleep(0.25f);
+#if MESHSYNC_NATIVE_POLL
+			WaitForSockets();
+#else
+			// Block on the listen socket while idle, so a new client is accepted as soon as
+			// it connects. With clients attached the wait backs off to service their sockets.
+			const FTimespan IdleWait = Connections.Num() > 0 ? FTimespan::FromMilliseconds(IdleWaitMs) : FTimespan::FromSeconds(0.25f);
+			IdleWaitMs = FMath::Min(IdleWaitMs * 2, (int32)MaxIdleWaitMs);
+			bool bReadReady = false;
+			if (!Socket->WaitForPendingConnection(bReadReady, IdleWait))
+			{
+				FPlatformProcess::Sleep(0.25f);
+				continue;
+			}
+			if (!bReadReady)
+			{
+				continue;
+			}
+#endif
 		}
+		AcceptConnections();
 	}
 
 	return 0;
 }
 
-UMaterialInterface* FMeshSyncServer::FindMaterial(FString const& Name)
+void FMeshSyncServer::ChargeInFlight(FSyncedMeshDesc& Desc)
+{
+	const int64 Bytes = Desc.GetAllocatedSize();
+	if (!Desc.bInFlight) {
+		Desc.bInFlight = true;
+		InFlightMeshes.Increment();
+		INC_DWORD_STAT(STAT_MeshSync_InFlightMeshes);
+	}
+	InFlightBytes.Add(Bytes - Desc.InFlightBytes);
+	if (Bytes > Desc.InFlightBytes) {
+		INC_MEMORY_STAT_BY(STAT_MeshSync_InFlightMemory, Bytes - Desc.InFlightBytes);
+	} else {
+		DEC_MEMORY_STAT_BY(STAT_MeshSync_InFlightMemory, Desc.InFlightBytes - Bytes);
+	}
+	Desc.InFlightBytes = Bytes;
+}
+
+void FMeshSyncServer::ReleaseInFlight(FSyncedMeshDesc& Desc)
+{
+	if (!Desc.bInFlight) {
+		return;
+	}
+	InFlightMeshes.Decrement();
+	InFlightBytes.Subtract(Desc.InFlightBytes);
+	DEC_DWORD_STAT(STAT_MeshSync_InFlightMeshes);
+	DEC_MEMORY_STAT_BY(STAT_MeshSync_InFlightMemory, Desc.InFlightBytes);
+	Desc.bInFlight = false;
+	Desc.InFlightBytes = 0;
+}
+
+void FMeshSyncServer::ChargeInFlightBytes(int64 Bytes)
+{
+	InFlightBytes.Add(Bytes);
+	INC_MEMORY_STAT_BY(STAT_MeshSync_InFlightMemory, Bytes);
+}
+
+void FMeshSyncServer::ReleaseInFlightBytes(int64 Bytes)
+{
+	InFlightBytes.Subtract(Bytes);
+	DEC_MEMORY_STAT_BY(STAT_MeshSync_InFlightMemory, Bytes);
+}
+
+bool FMeshSyncServer::BeginBenchmark()
+{
+	check(IsInGameThread());
+	if (IsBenchmarking() || !Merger->IsIdle() || !Preprocessor->IsIdle() || CommitQueue->Num() > 0) {
+		return false;
+	}
+	BenchAssetIndex = new FMeshSyncAssetIndex(FString());
+	BenchMerger = new FMeshSyncMerger(this, FPaths::ProjectSavedDir() / TEXT("MeshSync/BenchMerge"));
+	Benchmarking.Set(1);
+	return true;
+}
+
+void FMeshSyncServer::EndBenchmark()
+{
+	check(IsInGameThread());
+	if (!IsBenchmarking()) {
+		return;
+	}
+	Benchmarking.Set(0);
+	MaterialResolver->RemoveUnder(PathBenchPackage);
+	CommitQueue->ReleasePackages(PathBenchPackage);
+	delete BenchMerger;
+	BenchMerger = NULL;
+	delete BenchAssetIndex;
+	BenchAssetIndex = NULL;
+}
+
+bool FMeshSyncServer::IsOverInFlightBudget() const
 {
-	UMaterialInterface** Material = Materials.Find(Name);
-	if(Material)
-		return *Material;
-	else // not found! search in package
+	return InFlightMeshes.GetValue() >= GetDefault<UMeshSyncSettings>()->MaxInFlightMeshes ||
+		InFlightBytes.GetValue() >= GetInFlightMemoryBudget();
+}
+
+int64 FMeshSyncServer::GetInFlightMemoryBudget() const
+{
+	return (int64)GetDefault<UMeshSyncSettings>()->MaxInFlightMemoryMB * 1024 * 1024;
+}
+
+int32 FMeshSyncServer::GetPort() const
+{
+	return Thread != NULL ? ListenAddr->GetPort() : 0;
+}
+
+#if MESHSYNC_NATIVE_POLL
+void FMeshSyncServer::WaitForSockets()
+{
+	// Sockets wake the reactor as soon as they are ready. Paused connections are checked again
+	// shortly, responses queued while the reactor waits are sent by SendFrame itself.
+	int32 TimeoutMs = LivenessCheckIntervalMs;
+	TArray<FMeshSyncPollFd, TInlineAllocator<32>> Fds;
+	Fds.AddZeroed();
+	Fds[0].fd = static_cast<FSocketBSD*>(Socket)->GetNativeSocket();
+	Fds[0].events = POLLIN;
+	for (const FMeshSyncConnectionPtr& Connection : Connections)
 	{
-		FString SearchName = PathPackageMaterials + Name;
-		UMaterialInterface* Mat = LoadObject<UMaterialInterface>(nullptr, *SearchName);
-		if (Mat) {
-			AddMaterial(Name, Mat);
-		} else { // NULL
-			UE_LOG(LogMeshSync, Warning, TEXT("Material %s not found!"), *Name);
+		const bool bRead = !Connection->IsReadingPaused();
+		const bool bWrite = Connection->HasPendingSend();
+		if (!bRead)
+		{
+			TimeoutMs = MinIdleWaitMs;
 		}
-		return Mat;
+		if (bRead || bWrite)
+		{
+			Fds.AddZeroed();
+			Fds.Last().fd = static_cast<FSocketBSD*>(Connection->GetSocket())->GetNativeSocket();
+			Fds.Last().events = (bRead ? POLLIN : 0) | (bWrite ? POLLOUT : 0);
+		}
+	}
+	if (MeshSyncPoll(Fds.GetData(), Fds.Num(), TimeoutMs) < 0)
+	{
+		FPlatformProcess::Sleep(TimeoutMs / 1000.0f);
 	}
 }
+#endif
+
+void FMeshSyncServer::AcceptConnections()
+{
+	bool bPending = false;
+	while (Socket->HasPendingConnection(bPending) && bPending)
+	{
+		FSocket* ClientSocket = Socket->Accept(TEXT("Remote Connection"));
+		if (ClientSocket == NULL)
+		{
+			break;
+		}
+		ClientSocket->SetNonBlocking(true);
+		Connections.Add(MakeShareable(new FMeshSyncConnection(this, ClientSocket, PathPackage, NextConnectionId++)));
+	}
+}
+
+void FMeshSyncServer::ScheduleFrames(FMeshSyncConnection* Connection)
+{
+	WorkerPool->AddQueuedWork(new FMeshSyncFrameWork(Connection->AsShared()));
+}
+
+UMaterialInterface* FMeshSyncServer::FindMaterial(FString const& Name)
+{
+	return MaterialResolver->Find(Name);
+}
 
 void FMeshSyncServer::AddMaterial(FString const& Name, UMaterialInterface* Material)
 {
-	Materials.Add(Name) = Material;
+	MaterialResolver->Add(Name, Material);
 }
 
 void FMeshSyncServer::InitMaterials()
 {
-	Materials.Add(TEXT("MT_Knobs")) =
-		LoadObject<UMaterial>(nullptr, MT_KNOBS);
-	Materials.Add(TEXT("MT_Terrain")) =
-		LoadObject<UMaterial>(nullptr, MT_TERRAIN);
-	Materials.Add(TEXT("MT_Decor")) =
-		LoadObject<UMaterial>(nullptr, MT_DECOR);
+	AddMaterial(TEXT("MT_Knobs"), LoadObject<UMaterial>(nullptr, MT_KNOBS));
+	AddMaterial(TEXT("MT_Terrain"), LoadObject<UMaterial>(nullptr, MT_TERRAIN));
+	AddMaterial(TEXT("MT_Decor"), LoadObject<UMaterial>(nullptr, MT_DECOR));
+	MaterialResolver->Preload();
+	MaterialResolver->Publish();
+	Palette->Load();
 }
 
-FMeshSyncConnectionThreaded::FMeshSyncConnectionThreaded(FMeshSyncServer* InServer, FSocket* InSocket, FString const& InPackage)
+FMeshSyncConnection::FMeshSyncConnection(FMeshSyncServer* InServer, FSocket* InSocket, FString const& InPackage, uint32 InId)
 	: Socket(InSocket)
 	, Server(InServer)
+	, Id(InId)
 	, PathPackage(InPackage)
+	, HeaderReceived(0)
+	, Current(NULL)
+	, BodyReceived(0)
+	, FrameStartCycles(0)
+	, Codec(EMeshSyncCodec::None)
+	, Encodings(MeshFlag::NONE)
+	, FrameSequence(0)
 {
-	Running.Set(true);
-	StopRequested.Reset();
+	DispProcs.Add(EMeshSyncCommand::SendMesh) = &FMeshSyncConnection::ProcessingIncomingMesh;
+	DispProcs.Add(EMeshSyncCommand::SendMaterial) = &FMeshSyncConnection::ProcessingIncomingMaterial;
+	DispProcs.Add(EMeshSyncCommand::SendMeshDelta) = &FMeshSyncConnection::ProcessingIncomingMeshDelta;
+	DispProcs.Add(EMeshSyncCommand::Hello) = &FMeshSyncConnection::ProcessingHello;
+	DispProcs.Add(EMeshSyncCommand::Compressed) = &FMeshSyncConnection::ProcessingCompressed;
+	DispProcs.Add(EMeshSyncCommand::SendMeshBegin) = &FMeshSyncConnection::ProcessingMeshBegin;
+	DispProcs.Add(EMeshSyncCommand::SendMeshChunk) = &FMeshSyncConnection::ProcessingMeshChunk;
+	DispProcs.Add(EMeshSyncCommand::SendMeshEnd) = &FMeshSyncConnection::ProcessingMeshEnd;
+}
 
-#if UE_BUILD_DEBUG
-	// this thread needs more space in debug builds as it tries to log messages and such
-	const static uint32 MeshSyncServerThreadSize = 2 * 1024 * 1024;
-#else
-	const static uint32 MeshSyncServerThreadSize = 1 * 1024 * 1024;
-#endif
+FMeshSyncConnection::~FMeshSyncConnection()
+{
+	if (Socket) {
+		Socket->Close();
+		ISocketSubsystem::Get()->DestroySocket(Socket);
+		Socket = NULL;
+	}
 
-	WorkerThread = FRunnableThread::Create(this, TEXT("FMeshSyncServerConnection"), MeshSyncServerThreadSize, TPri_AboveNormal);
+	if (Current) {
+		Server->ReleaseInFlightBytes(Current->Body.Num());
+		delete Current;
+	}
+	for (auto& Pair : Uploads) {
+		Server->GetDescPool().Release(Pair.Value.Desc);
+	}
+	for (FMeshSyncFrame* Frame : PendingFrames) {
+		Server->ReleaseInFlightBytes(Frame->Body.Num());
+		delete Frame;
+	}
+	for (FMeshSyncFrame* Frame : FreeFrames) {
+		delete Frame;
+	}
 }
 
-bool FMeshSyncConnectionThreaded::ProcessingPayload(MeshSyncPayload & Payload)
+bool FMeshSyncConnection::ReceiveSome(uint8* Dest, uint32 Count, uint32& OutReceived)
 {
+	OutReceived = 0;
 	int32 Recved = 0;
-	auto Ret = Socket->Recv((uint8*)&Payload, sizeof(Payload), Recved);
-	if (!Ret || Recved != sizeof(Payload)) {
-		UE_LOG(LogMeshSync, Warning, TEXT("Unable to receive payload, terminating connection"));
+	const int32 Wanted = (int32)FMath::Min(Count, MeshSyncRecvChunkSize);
+	if (Socket->Recv(Dest, Wanted, Recved)) {
+		OutReceived = Recved;
+		return Recved > 0;
+	}
+	// Nothing pending on a non-blocking socket is not an error.
+	return ISocketSubsystem::Get()->GetLastErrorCode() == SE_EWOULDBLOCK;
+}
+
+bool FMeshSyncConnection::PumpReceive(bool& bOutProgress)
+{
+	if (Failed.GetValue()) {
 		return false;
 	}
-	if (Payload.Magic != MagicNumber) {
-		UE_LOG(LogMeshSync, Warning, TEXT("Unable to process payload magic number, terminating connection"));
+	if (IsReadingPaused()) {
+		return true;
+	}
+
+	MESHSYNC_SCOPE(STAT_MeshSync_Receive);
+	while (true)
+	{
+		uint32 Received = 0;
+		if (HeaderReceived < sizeof(Header))
+		{
+			if (!ReceiveSome((uint8*)&Header + HeaderReceived, sizeof(Header) - HeaderReceived, Received)) {
+				UE_LOG(LogMeshSync, Warning, TEXT("Unable to receive payload, terminating connection"));
+				return false;
+			}
+			if (Received == 0) {
+				return true;
+			}
+			if (HeaderReceived == 0) {
+				FrameStartCycles = FPlatformTime::Cycles64();
+			}
+			bOutProgress = true;
+			FMeshSyncStageTimes::Get().BytesReceived.Add(Received);
+			INC_DWORD_STAT_BY(STAT_MeshSync_BytesReceived, Received);
+			HeaderReceived += Received;
+			if (HeaderReceived < sizeof(Header)) {
+				continue;
+			}
+			if (!ProcessingPayload(Header)) {
+				return false;
+			}
+			Current = AllocFrame();
+			Current->Command = Header.Command;
+			Current->Body.SetNumUninitialized(Header.Length, false);
+			Server->ChargeInFlightBytes(Header.Length);
+			BodyReceived = 0;
+		}
+
+		if (BodyReceived < Header.Length)
+		{
+			if (!ReceiveSome(Current->Body.GetData() + BodyReceived, Header.Length - BodyReceived, Received)) {
+				UE_LOG(LogMeshSync, Warning, TEXT("Unable to receive %u bytes frame, terminating connection"), Header.Length);
+				return false;
+			}
+			if (Received == 0) {
+				return true;
+			}
+			bOutProgress = true;
+			FMeshSyncStageTimes::Get().BytesReceived.Add(Received);
+			INC_DWORD_STAT_BY(STAT_MeshSync_BytesReceived, Received);
+			BodyReceived += Received;
+			if (BodyReceived < Header.Length) {
+				// Give other connections a turn between large chunks.
+				return true;
+			}
+		}
+
+		Current->ReceiveCycles = FPlatformTime::Cycles64();
+		FMeshSyncStageTimes::Get().Add(EMeshSyncStage::Receive, Current->ReceiveCycles - FrameStartCycles);
+		// Recorded here rather than by the decoding worker, so the capture keeps the order frames arrived in.
+		Server->GetCapture().Record(Id, *Current);
+		QueueFrame(Current);
+		Current = NULL;
+		HeaderReceived = 0;
+		BodyReceived = 0;
+		if (HasFrameBacklog() || Server->IsOverInFlightBudget()) {
+			return true;
+		}
+	}
+}
+
+bool FMeshSyncConnection::IsReadingPaused() const
+{
+	// Leave data in the socket while workers catch up, TCP flow control throttles the client.
+	// A body already allocated is received in full, it only adds to the budget once decoded.
+	return !Current && (HasFrameBacklog() || Server->IsOverInFlightBudget());
+}
+
+bool FMeshSyncConnection::HasPendingSend()
+{
+	FScopeLock Lock(&SendLock);
+	return SendBuffer.Num() > 0;
+}
+
+bool FMeshSyncConnection::PumpSend(bool& bOutProgress)
+{
+	FScopeLock Lock(&SendLock);
+	if (SendBuffer.Num() == 0) {
+		return true;
+	}
+	int32 Sent = 0;
+	if (!Socket->Send(SendBuffer.GetData(), SendBuffer.Num(), Sent)) {
+		if (ISocketSubsystem::Get()->GetLastErrorCode() == SE_EWOULDBLOCK) {
+			return true;
+		}
+		UE_LOG(LogMeshSync, Warning, TEXT("Unable to send %d bytes, terminating connection"), SendBuffer.Num());
 		return false;
 	}
+	if (Sent > 0) {
+		SendBuffer.RemoveAt(0, Sent, false);
+		bOutProgress = true;
+	}
 	return true;
 }
 
-bool FMeshSyncConnectionThreaded::Dispatch(EMeshSyncCommand Command, uint32 Length)
+void FMeshSyncConnection::SendFrame(EMeshSyncCommand Command, const TArray<uint8>& Body)
 {
-	if (DispProcs.Find(Command)) {
-		return (this->*DispProcs[Command])(Length);
+	// Replayed sessions have nobody to answer.
+	if (IsReplay()) {
+		return;
+	}
+	FScopeLock Lock(&SendLock);
+	const bool bWasEmpty = SendBuffer.Num() == 0;
+	FMeshSyncFrameWriter::AppendFrame(SendBuffer, Command, Body);
+	// The reactor may be blocked waiting for its sockets, whatever the socket does not take now it sends later.
+	int32 Sent = 0;
+	if (bWasEmpty && Socket->Send(SendBuffer.GetData(), SendBuffer.Num(), Sent) && Sent > 0) {
+		SendBuffer.RemoveAt(0, Sent, false);
 	}
-	return false;
 }
 
-bool FMeshSyncConnectionThreaded::ProcessingIncomingMesh(uint32 Length)
+void FMeshSyncConnection::Respond(uint32 RequestId, EMeshSyncResponse Status, const FString& Detail)
 {
-	auto pDesc = new FSyncedMeshDesc;
-	FSyncedMeshDesc& Desc = *pDesc;
-	FRawMesh& Mesh = Desc.RawMesh;
+	if (!WantsResponses()) {
+		return;
+	}
+	TArray<uint8> Body;
+	FMeshSyncFrameWriter Writer(Body);
+	Writer.WritePrim(RequestId);
+	Writer.WritePrim(Status);
+	Writer.WriteString(Detail);
+	SendFrame(EMeshSyncCommand::Response, Body);
+}
 
-	ReadString(Desc.Name);
-	// Name format [Name]+X_Y_Z
+FMeshSyncFrame* FMeshSyncConnection::AllocFrame()
+{
+	FScopeLock Lock(&FramesLock);
+	return FreeFrames.Num() > 0 ? FreeFrames.Pop(false) : new FMeshSyncFrame;
+}
 
-	MeshFlag Flag;
-	ReadPrim(Flag); // Read Mesh Flag
+void FMeshSyncConnection::QueueFrame(FMeshSyncFrame* Frame)
+{
+	{
+		FScopeLock Lock(&FramesLock);
+		PendingFrames.Add(Frame);
+	}
+	NumPendingFrames.Increment();
+	INC_DWORD_STAT(STAT_MeshSync_FramesInFlight);
 
-	ReadPrim(Desc.TileX);
-	ReadPrim(Desc.TileY);
-	ReadPrim(Desc.TileZ);
+	if (Scheduled.Set(1) == 0) {
+		Server->ScheduleFrames(this);
+	}
+}
 
-	ReadArray(Mesh.FaceMaterialIndices);
-	ReadArray(Mesh.FaceSmoothingMasks);
-	ReadArray(Mesh.WedgeIndices);
+void FMeshSyncConnection::InjectFrame(EMeshSyncCommand Command, const uint8* Data, uint32 Length)
+{
+	FMeshSyncFrame* Frame = AllocFrame();
+	Frame->Command = Command;
+	Frame->Body.SetNumUninitialized(Length, false);
+	Server->ChargeInFlightBytes(Length);
+	FMemory::Memcpy(Frame->Body.GetData(), Data, Length);
+	Frame->ReceiveCycles = FPlatformTime::Cycles64();
+	QueueFrame(Frame);
+}
 
-	ReadArray(Mesh.VertexPositions);
-	TArray<FVector> Normal;
-	ReadArray(Normal);
+void FMeshSyncConnection::ProcessFrames()
+{
+	while (true)
+	{
+		FMeshSyncFrame* Frame = NULL;
+		{
+			FScopeLock Lock(&FramesLock);
+			if (PendingFrames.Num() > 0) {
+				Frame = PendingFrames[0];
+				PendingFrames.RemoveAt(0, 1, false);
+			}
+		}
 
-	ReadArray(Mesh.WedgeTexCoords[0]); // Main Texcoord
-	ReadArray(Mesh.WedgeTexCoords[1]); // Normal Texcoord
-	ReadArray(Mesh.WedgeTexCoords[2]); // Roughness Metallic
+		if (!Frame)
+		{
+			Scheduled.Set(0);
+			// The reactor may have queued a frame after the check above without scheduling.
+			FScopeLock Lock(&FramesLock);
+			if (PendingFrames.Num() == 0 || Scheduled.Set(1) != 0) {
+				return;
+			}
+			continue;
+		}
 
-	ReadArray(Mesh.WedgeColors);
+		if (!Failed.GetValue()) {
+			FMeshSyncStageScope DecodeScope(EMeshSyncStage::Decode);
+			MESHSYNC_SCOPE(STAT_MeshSync_Dispatch);
+			FMeshSyncFrameReader Reader(Frame->Body.GetData(), Frame->Body.Num());
+			if (!Dispatch(Frame->Command, Reader)) {
+				Respond(FrameSequence, EMeshSyncResponse::Failed, TEXT("Rejected frame, see the server log"));
+				Failed.Set(1);
+			}
+		}
+		FrameSequence++;
+
+		Server->ReleaseInFlightBytes(Frame->Body.Num());
+		if (Frame->Body.Max() > MaxRetainedFrameBytes) {
+			Frame->Body.Empty();
+		}
+		{
+			FScopeLock Lock(&FramesLock);
+			FreeFrames.Add(Frame);
+		}
+		NumPendingFrames.Decrement();
+		DEC_DWORD_STAT(STAT_MeshSync_FramesInFlight);
+	}
+}
+
+bool FMeshSyncConnection::ProcessingPayload(MeshSyncPayload & Payload)
+{
+	MESHSYNC_SCOPE(STAT_MeshSync_ProcessPayload);
+	if (Payload.Magic != MagicNumber) {
+		UE_LOG(LogMeshSync, Warning, TEXT("Unable to process payload magic number, terminating connection"));
+		return false;
+	}
+	if (Payload.Length > (uint32)MAX_int32) {
+		UE_LOG(LogMeshSync, Warning, TEXT("Frame length %u exceeds the supported maximum, terminating connection"), Payload.Length);
+		return false;
+	}
+	// Checked before the body is allocated, a single frame may not take more than the whole budget.
+	if ((int64)Payload.Length > Server->GetInFlightMemoryBudget()) {
+		UE_LOG(LogMeshSync, Warning, TEXT("Frame length %u exceeds the in-flight memory budget, terminating connection"), Payload.Length);
+		return false;
+	}
+	return true;
+}
+
+bool FMeshSyncConnection::Dispatch(EMeshSyncCommand Command, FMeshSyncFrameReader& Reader)
+{
+	if (FnProcessing* Proc = DispProcs.Find(Command)) {
+		return (this->*(*Proc))(Reader);
+	}
+	// The frame is already consumed, so unknown commands can be skipped safely.
+	UE_LOG(LogMeshSync, Warning, TEXT("Skipping unknown command %u"), (uint32)Command);
+	return true;
+}
+
+// Wire size of one element of a mesh channel under the frame's encodings.
+static uint32 MeshSyncElementSize(EMeshSyncChannel Channel, MeshFlag Flag)
+{
+	switch (Channel) {
+	case EMeshSyncChannel::FaceMaterialIndices:
+		return sizeof(int32);
+	case EMeshSyncChannel::FaceSmoothingMasks:
+	case EMeshSyncChannel::WedgeIndices:
+		return sizeof(uint32);
+	case EMeshSyncChannel::VertexPositions:
+		return EnumHasAnyFlags(Flag, MeshFlag::QUANTIZED_POSITION) ? sizeof(FMeshSyncQuantizedPosition) : sizeof(FVector);
+	case EMeshSyncChannel::Normals:
+		return EnumHasAnyFlags(Flag, MeshFlag::OCT_NORMAL) ? sizeof(FMeshSyncOctNormal) : sizeof(FVector);
+	case EMeshSyncChannel::TexCoord0:
+	case EMeshSyncChannel::TexCoord1:
+	case EMeshSyncChannel::TexCoord2:
+		return EnumHasAnyFlags(Flag, MeshFlag::HALF_UV) ? sizeof(FMeshSyncHalfUV) : sizeof(FVector2D);
+	case EMeshSyncChannel::WedgeColors:
+		return sizeof(FColor);
+	default:
+		return 0;
+	}
+}
 
+// Whether a channel is decoded. Normals are recomputed by the build, and
+// channels the flag marks as absent are not allocated at all.
+static bool MeshSyncDecodesChannel(EMeshSyncChannel Channel, MeshFlag Flag)
+{
+	switch (Channel) {
+	case EMeshSyncChannel::Normals:
+		return false;
+	case EMeshSyncChannel::TexCoord0:
+		return EnumHasAnyFlags(Flag, MeshFlag::HAS_UV0);
+	case EMeshSyncChannel::TexCoord1:
+		return EnumHasAnyFlags(Flag, MeshFlag::HAS_UV1);
+	case EMeshSyncChannel::TexCoord2:
+		return EnumHasAnyFlags(Flag, MeshFlag::HAS_TEX_ID);
+	case EMeshSyncChannel::WedgeColors:
+		return EnumHasAnyFlags(Flag, MeshFlag::HAS_COLOR_0);
+	default:
+		return true;
+	}
+}
+
+// Appends a decoded channel to Mesh, expanding quantized encodings.
+static void AppendMeshChannel(const FMeshSyncFrameReader& Reader, EMeshSyncChannel Channel, const FMeshSyncArrayView& View,
+	MeshFlag Flag, const FVector& PositionMin, const FVector& PositionMax, FRawMesh& Mesh)
+{
+	switch (Channel) {
+	case EMeshSyncChannel::FaceMaterialIndices:
+		Reader.AppendArray(View, Mesh.FaceMaterialIndices);
+		break;
+	case EMeshSyncChannel::FaceSmoothingMasks:
+		Reader.AppendArray(View, Mesh.FaceSmoothingMasks);
+		break;
+	case EMeshSyncChannel::WedgeIndices:
+		Reader.AppendArray(View, Mesh.WedgeIndices);
+		break;
+	case EMeshSyncChannel::VertexPositions:
+		if (EnumHasAnyFlags(Flag, MeshFlag::QUANTIZED_POSITION)) {
+			const FVector Step = (PositionMax - PositionMin) / 65535.0f;
+			Reader.AppendConvertedArray<FMeshSyncQuantizedPosition>(View, Mesh.VertexPositions,
+				[&](const FMeshSyncQuantizedPosition& Q) { return PositionMin + FVector(Q.X, Q.Y, Q.Z) * Step; });
+		} else {
+			Reader.AppendArray(View, Mesh.VertexPositions);
+		}
+		break;
+	case EMeshSyncChannel::TexCoord0:
+	case EMeshSyncChannel::TexCoord1:
+	case EMeshSyncChannel::TexCoord2:
+	{
+		TArray<FVector2D>& TexCoords = Mesh.WedgeTexCoords[(int32)Channel - (int32)EMeshSyncChannel::TexCoord0];
+		if (EnumHasAnyFlags(Flag, MeshFlag::HALF_UV)) {
+			Reader.AppendConvertedArray<FMeshSyncHalfUV>(View, TexCoords,
+				[](const FMeshSyncHalfUV& UV) { return FVector2D(UV.U.GetFloat(), UV.V.GetFloat()); });
+		} else {
+			Reader.AppendArray(View, TexCoords);
+		}
+		break;
+	}
+	case EMeshSyncChannel::WedgeColors:
+		Reader.AppendArray(View, Mesh.WedgeColors);
+		break;
+	default:
+		break;
+	}
+}
+
+// Sizes a channel for a chunked upload up front.
+static void ReserveMeshChannel(EMeshSyncChannel Channel, int32 Num, FRawMesh& Mesh)
+{
+	switch (Channel) {
+	case EMeshSyncChannel::FaceMaterialIndices:
+		Mesh.FaceMaterialIndices.Reserve(Num);
+		break;
+	case EMeshSyncChannel::FaceSmoothingMasks:
+		Mesh.FaceSmoothingMasks.Reserve(Num);
+		break;
+	case EMeshSyncChannel::WedgeIndices:
+		Mesh.WedgeIndices.Reserve(Num);
+		break;
+	case EMeshSyncChannel::VertexPositions:
+		Mesh.VertexPositions.Reserve(Num);
+		break;
+	case EMeshSyncChannel::TexCoord0:
+	case EMeshSyncChannel::TexCoord1:
+	case EMeshSyncChannel::TexCoord2:
+		Mesh.WedgeTexCoords[(int32)Channel - (int32)EMeshSyncChannel::TexCoord0].Reserve(Num);
+		break;
+	case EMeshSyncChannel::WedgeColors:
+		Mesh.WedgeColors.Reserve(Num);
+		break;
+	default:
+		break;
+	}
+}
+
+bool FMeshSyncConnection::DecodeMesh(FMeshSyncFrameReader& Reader, FSyncedMeshDesc& Desc)
+{
+	FRawMesh& Mesh = Desc.RawMesh;
+
+	MeshFlag Flag = MeshFlag::NONE;
 	uint32 MaterialId = 0;
-	ReadPrim(MaterialId);
+	FMeshSyncMeshLayout Layout;
+	FVector PositionMin(0.0f);
+	FVector PositionMax(0.0f);
+
+	bool bRead =
+		Reader.ReadString(Desc.Name) && // Name format [Name]+X_Y_Z
+		Reader.ReadPrim(Flag) && // Read Mesh Flag
+		Reader.ReadPrim(Desc.TileX) &&
+		Reader.ReadPrim(Desc.TileY) &&
+		Reader.ReadPrim(Desc.TileZ);
+
+	if (bRead && !AcceptsEncodings(Flag, Desc.Name)) {
+		return false;
+	}
+
+	// First pass only walks the frame to collect the count table.
+	{
+		MESHSYNC_SCOPE(STAT_MeshSync_ReadLayout);
+		for (int32 Channel = 0; bRead && Channel < (int32)EMeshSyncChannel::Num; Channel++) {
+			if (Channel == (int32)EMeshSyncChannel::VertexPositions && EnumHasAnyFlags(Flag, MeshFlag::QUANTIZED_POSITION)) {
+				bRead = Reader.ReadPrim(PositionMin) && Reader.ReadPrim(PositionMax);
+			}
+			bRead = bRead && Reader.SkipArray(MeshSyncElementSize((EMeshSyncChannel)Channel, Flag), Layout.Channels[Channel]);
+		}
+		bRead = bRead &&
+			Reader.ReadPrim(MaterialId) &&
+			Reader.ReadStringList(Desc.MaterialSlots) &&
+			Reader.SkipArray<FVector>(Layout.InstancePositions) &&
+			Reader.SkipArray<FColor>(Layout.InstanceColors);
+	}
+
+	if (!bRead) {
+		UE_LOG(LogMeshSync, Warning, TEXT("Malformed mesh frame %s, terminating connection"), *Desc.Name);
+		return false;
+	}
 
-	ReadStringList(Desc.MaterialSlots);
+	// Second pass sizes each array exactly once and scatters the frame into it.
+	// Instance arrays are placement, not geometry, and stay out of the content hash.
+	{
+		MESHSYNC_SCOPE(STAT_MeshSync_ReadArrays);
+		for (int32 Channel = 0; Channel < (int32)EMeshSyncChannel::Num; Channel++) {
+			if (MeshSyncDecodesChannel((EMeshSyncChannel)Channel, Flag)) {
+				AppendMeshChannel(Reader, (EMeshSyncChannel)Channel, Layout.Channels[Channel], Flag, PositionMin, PositionMax, Mesh);
+			}
+		}
+		if (EnumHasAnyFlags(Flag, MeshFlag::HAS_INSTANCE_POSITION)) {
+			Reader.CopyArray(Layout.InstancePositions, Desc.InstancePositions);
+		}
+		if (EnumHasAnyFlags(Flag, MeshFlag::HAS_INSTANCE_COLOR0)) {
+			Reader.CopyArray(Layout.InstanceColors, Desc.InstanceColors);
+		}
+	}
 
-	TArray<FVector> InstancePositions;
-	ReadArray(InstancePositions);
-	TArray<FColor> InstanceColors;
-	ReadArray(InstanceColors);
+	return FinishMesh(Desc);
+}
 
-	if (!Mesh.IsValidOrFixable()) {
-		delete pDesc;
+bool FMeshSyncConnection::AcceptsEncodings(MeshFlag Flag, const FString& Name) const
+{
+	if (EnumHasAnyFlags(Flag & MeshSyncEncodingMask, ~Encodings)) {
+		UE_LOG(LogMeshSync, Warning, TEXT("Mesh frame %s uses encodings that were not negotiated, terminating connection"), *Name);
 		return false;
 	}
+	return true;
+}
 
-	AsyncTask(ENamedThreads::GameThread, [=]()
+bool FMeshSyncConnection::FinishMesh(FSyncedMeshDesc& Desc)
+{
 	{
-		FString MeshPackageName = PathPackage + pDesc->Name;
-		UPackage* Package = FindPackage(nullptr, *MeshPackageName);
-		if (!Package) {
-			Package = CreatePackage(nullptr, *MeshPackageName);
-		} else { // already exists
-			UE_LOG(LogMeshSync, Display, TEXT("Mesh %s is already existed!"), *MeshPackageName);
-			delete pDesc;
-			return;
-		}
-
-		FName StaticMeshName = MakeUniqueObjectName(Package, UStaticMesh::StaticClass(), FName(*pDesc->Name));
-		UStaticMesh* StaticMesh = NewObject<UStaticMesh>(Package, StaticMeshName, RF_Public | RF_Standalone | RF_Transactional);
-		checkSlow(StaticMesh);
-
-		if (!StaticMesh) {
-			delete pDesc;
-			return;
-		}
-		StaticMesh->PreEditChange(nullptr);
-
-		StaticMesh->SourceModels.Empty();
-
-		// Saving mesh in the StaticMesh
-		new(StaticMesh->SourceModels) FStaticMeshSourceModel();
-		StaticMesh->SourceModels[0].RawMeshBulkData->SaveRawMesh(pDesc->RawMesh);
-
-		FStaticMeshSourceModel& SrcModel = StaticMesh->SourceModels[0];
-
-		// Model Configuration
-		StaticMesh->SourceModels[0].BuildSettings.bRecomputeNormals = true;
-		StaticMesh->SourceModels[0].BuildSettings.bRecomputeTangents = true;
-		StaticMesh->SourceModels[0].BuildSettings.bUseMikkTSpace = false;
-		StaticMesh->SourceModels[0].BuildSettings.bGenerateLightmapUVs = true;
-		StaticMesh->SourceModels[0].BuildSettings.bBuildAdjacencyBuffer = false;
-		StaticMesh->SourceModels[0].BuildSettings.bBuildReversedIndexBuffer = false;
-		StaticMesh->SourceModels[0].BuildSettings.bUseFullPrecisionUVs = false;
-		StaticMesh->SourceModels[0].BuildSettings.bUseHighPrecisionTangentBasis = false;
-
-		// Assign the Materials to the Slots (optional
-		for (int32 i = 0; i < pDesc->MaterialSlots.Num(); i++) {
-			FString MaterialName = pDesc->MaterialSlots[i]; // search imported MIC by name
-			if (!MaterialName.StartsWith(TEXT("MT_"))) {
-				MaterialName = FString(TEXT("MT_")) + MaterialName;
+		FMeshSyncStageScope ValidateScope(EMeshSyncStage::Validate);
+		MESHSYNC_SCOPE(STAT_MeshSync_Validate);
+		if (!Desc.RawMesh.IsValidOrFixable()) {
+			return false;
+		}
+		// IsValidOrFixable does not look at the indices, every worker after this one trusts them.
+		const uint32 NumVertices = (uint32)Desc.RawMesh.VertexPositions.Num();
+		for (const uint32 Index : Desc.RawMesh.WedgeIndices) {
+			if (Index >= NumVertices) {
+				UE_LOG(LogMeshSync, Warning, TEXT("Mesh %s references vertex %u of %u, terminating connection"), *Desc.Name, Index, NumVertices);
+				return false;
 			}
-			// with slots?
-			FStaticMaterial Material;
-			Material.MaterialInterface = Server->FindMaterial(MaterialName);
-			StaticMesh->StaticMaterials.Add(Material);
-			StaticMesh->SectionInfoMap.Set(0, i, FMeshSectionInfo(i));
 		}
+	}
+
+	// Hash the geometry as received, before preprocessing changes it.
+	{
+		MESHSYNC_SCOPE(STAT_MeshSync_Hash);
+		Desc.ContentHash = FMeshSyncAssetIndex::HashMesh(Desc);
+	}
+	const UMeshSyncSettings* Settings = GetDefault<UMeshSyncSettings>();
+	Desc.bDuplicate = Settings->bDeduplicateMeshes &&
+		Server->GetAssetIndex().ContainsMesh(Desc.ContentHash);
+	// Slots whose material is already known skip the name lookup at commit.
+	const FMeshSyncMaterialResolver& Resolver = Server->GetMaterialResolver();
+	Desc.SlotMaterials.SetNum(Desc.MaterialSlots.Num());
+	for (int32 Slot = 0; Slot < Desc.MaterialSlots.Num(); Slot++) {
+		Resolver.Lookup(FMeshSyncMaterialResolver::GetSlotMaterialName(Desc.MaterialSlots[Slot]), Desc.SlotMaterials[Slot]);
+	}
+	return true;
+}
+
+void FMeshSyncConnection::AcceptMesh(FSyncedMeshDesc& Desc, uint32 RequestId)
+{
+	if (!WantsResponses()) {
+		return;
+	}
+	Desc.Requester = AsShared();
+	Desc.RequestId = RequestId;
+	Respond(RequestId, Desc.bDuplicate ? EMeshSyncResponse::Deduplicated : EMeshSyncResponse::Accepted, FString());
+}
+
+bool FMeshSyncConnection::ProcessingIncomingMesh(FMeshSyncFrameReader& Reader)
+{
+	FSyncedMeshDesc* Desc = Server->GetDescPool().Acquire();
+	if (!DecodeMesh(Reader, *Desc)) {
+		Server->GetDescPool().Release(Desc);
+		return false;
+	}
+	AcceptMesh(*Desc, FrameSequence);
+	Server->GetPreprocessor().Dispatch(Desc);
+	return true;
+}
+
+bool FMeshSyncConnection::ProcessingIncomingMeshDelta(FMeshSyncFrameReader& Reader)
+{
+	uint64 Revision = 0;
+	if (!Reader.ReadPrim(Revision)) {
+		UE_LOG(LogMeshSync, Warning, TEXT("Malformed mesh delta frame, terminating connection"));
+		return false;
+	}
+
+	// Peek at the name that starts the SendMesh body, an up to date tile is not decoded at all.
+	FString Name;
+	FMeshSyncFrameReader NameReader = Reader;
+	if (!NameReader.ReadString(Name)) {
+		UE_LOG(LogMeshSync, Warning, TEXT("Malformed mesh delta frame, terminating connection"));
+		return false;
+	}
+
+	FMeshSyncAssetIndex& AssetIndex = Server->GetAssetIndex();
+	FMeshSyncTileRecord Record;
+	bool bKnownTile = AssetIndex.FindTile(Name, Record);
+	if (bKnownTile && !AssetIndex.IsAssetAvailable(Record.ObjectPath)) {
+		// Indexed by a session that ended without saving the tile, it has to be imported again.
+		UE_LOG(LogMeshSync, Verbose, TEXT("Tile %s no longer resolves to %s"), *Name, *Record.ObjectPath);
+		AssetIndex.RemoveTile(Name);
+		FString IndexedPath;
+		if (AssetIndex.FindMesh(Record.ContentHash, IndexedPath) && IndexedPath == Record.ObjectPath) {
+			AssetIndex.RemoveMesh(Record.ContentHash);
+		}
+		bKnownTile = false;
+	}
+	if (bKnownTile && Record.Revision == Revision) {
+		UE_LOG(LogMeshSync, Verbose, TEXT("Tile %s is up to date"), *Name);
+		Respond(FrameSequence, EMeshSyncResponse::Unchanged, Record.ObjectPath);
+		return true;
+	}
 
-		FAssetRegistryModule::AssetCreated(StaticMesh);
+	FSyncedMeshDesc* Desc = Server->GetDescPool().Acquire();
+	if (!DecodeMesh(Reader, *Desc)) {
+		Server->GetDescPool().Release(Desc);
+		return false;
+	}
+	Desc->Revision = Revision;
+	Desc->bUpdateInPlace = true;
+
+	if (bKnownTile && Record.ContentHash == Desc->ContentHash && Desc->InstancePositions.Num() == 0) {
+		// New revision, same geometry.
+		AssetIndex.SetTileRevision(Name, Revision);
+		Server->GetDescPool().Release(Desc);
+		Respond(FrameSequence, EMeshSyncResponse::Unchanged, Record.ObjectPath);
+		return true;
+	}
+	AcceptMesh(*Desc, FrameSequence);
+	Server->GetPreprocessor().Dispatch(Desc);
+	return true;
+}
 
-		Package->MarkPackageDirty();
-		//Package->FullyLoad();
+// Block codecs in the order the server prefers them.
+static const EMeshSyncCodec MeshSyncCodecs[] = { EMeshSyncCodec::Oodle, EMeshSyncCodec::LZ4, EMeshSyncCodec::Zlib };
 
-		// Processing the StaticMesh and Marking it as not saved
-		StaticMesh->ImportVersion = EImportStaticMeshVersion::LastVersion;
-		StaticMesh->CreateBodySetup();
-		StaticMesh->BodySetup->CollisionTraceFlag = CTF_UseComplexAsSimple;
-		StaticMesh->SetLightingGuid();
-		StaticMesh->PostEditChange();
+static FName MeshSyncCodecFormat(EMeshSyncCodec Codec)
+{
+	switch (Codec) {
+	case EMeshSyncCodec::Zlib:
+		return NAME_Zlib;
+	case EMeshSyncCodec::LZ4:
+		return FName(TEXT("LZ4"));
+	case EMeshSyncCodec::Oodle:
+		return FName(TEXT("Oodle"));
+	default:
+		return NAME_None;
+	}
+}
 
-		TArray<UObject*>ObjectsToSync;
-		ObjectsToSync.Add(StaticMesh);
-		GEditor->SyncBrowserToObjects(ObjectsToSync);
-		delete pDesc;
-	});
+bool FMeshSyncConnection::ProcessingHello(FMeshSyncFrameReader& Reader)
+{
+	uint32 Version = 0;
+	EMeshSyncCodec OfferedCodecs = EMeshSyncCodec::None;
+	MeshFlag OfferedEncodings = MeshFlag::NONE;
+	EMeshSyncFeature OfferedFeatures = EMeshSyncFeature::None;
+	if (!Reader.ReadPrim(Version) || !Reader.ReadPrim(OfferedCodecs) || !Reader.ReadPrim(OfferedEncodings) ||
+		(Reader.Remaining() > 0 && !Reader.ReadPrim(OfferedFeatures))) {
+		UE_LOG(LogMeshSync, Warning, TEXT("Malformed hello frame, terminating connection"));
+		return false;
+	}
 
+	const UMeshSyncSettings* Settings = GetDefault<UMeshSyncSettings>();
+	Codec = EMeshSyncCodec::None;
+	if (Settings->bAllowCompression) {
+		for (EMeshSyncCodec Candidate : MeshSyncCodecs) {
+			// Oodle and LZ4 are only there when a compression plugin registered them.
+			if (EnumHasAnyFlags(OfferedCodecs, Candidate) && FCompression::IsFormatValid(MeshSyncCodecFormat(Candidate))) {
+				Codec = Candidate;
+				break;
+			}
+		}
+	}
+	Encodings = Settings->bAllowQuantization ? (OfferedEncodings & MeshSyncEncodingMask) : MeshFlag::NONE;
+	const EMeshSyncFeature Features = OfferedFeatures & EMeshSyncFeature::Responses;
+	Responses.Set(EnumHasAnyFlags(Features, EMeshSyncFeature::Responses) ? 1 : 0);
+
+	UE_LOG(LogMeshSync, Display, TEXT("Client protocol %u, codec %s, encodings 0x%x, features 0x%x"),
+		Version, *MeshSyncCodecFormat(Codec).ToString(), (uint32)Encodings, (uint32)Features);
+
+	TArray<uint8> Body;
+	FMeshSyncFrameWriter Writer(Body);
+	Writer.WritePrim(MeshSyncProtocolVersion);
+	Writer.WritePrim(Codec);
+	Writer.WritePrim(Encodings);
+	Writer.WritePrim(Features);
+	SendFrame(EMeshSyncCommand::HelloAck, Body);
 	return true;
 }
 
-bool FMeshSyncConnectionThreaded::ProcessingIncomingMaterial(uint32 Length)
-{
-	FString MaterialName;
-	ReadString(MaterialName);
-	uint32 MaterialId;
-	ReadPrim(MaterialId);
-	FVector BaseColor;
-	ReadPrim(BaseColor);
-	float Roughness;
-	ReadPrim(Roughness);
-	float Metallic;
-	ReadPrim(Metallic);
-	FString BaseColorMap;
-	ReadString(BaseColorMap);
-	FString NormalMap;
-	ReadString(NormalMap);
-
-	uint32 MaterialCatagory = (MaterialId >> 16);
-	uint32 MaterialImpId = (MaterialId & 0x0000ffff);
-	
-	AsyncTask(ENamedThreads::GameThread, [=]()
+bool FMeshSyncConnection::ProcessingCompressed(FMeshSyncFrameReader& Reader)
+{
+	EMeshSyncCommand Inner;
+	uint32 RawLength = 0;
+	if (!Reader.ReadPrim(Inner) || !Reader.ReadPrim(RawLength) || RawLength > (uint32)MAX_int32) {
+		UE_LOG(LogMeshSync, Warning, TEXT("Malformed compressed frame, terminating connection"));
+		return false;
+	}
+	if (Codec == EMeshSyncCodec::None) {
+		UE_LOG(LogMeshSync, Warning, TEXT("Compressed frame without a negotiated codec, terminating connection"));
+		return false;
+	}
+	if (Inner == EMeshSyncCommand::Compressed || Inner == EMeshSyncCommand::Hello) {
+		UE_LOG(LogMeshSync, Warning, TEXT("Command %u cannot be compressed, terminating connection"), (uint32)Inner);
+		return false;
+	}
+	// The buffer is allocated before anything is decoded, a frame cannot claim more than the whole in-flight budget.
+	if ((int64)RawLength > Server->GetInFlightMemoryBudget()) {
+		UE_LOG(LogMeshSync, Warning, TEXT("Compressed frame inflates to %u bytes, over the in-flight memory budget, terminating connection"), RawLength);
+		return false;
+	}
+
+	// Decoders copy out of the frame, so one buffer serves every compressed frame of the connection.
+	InflateBuffer.SetNumUninitialized(RawLength, false);
 	{
-		if (MaterialName.StartsWith(TEXT("MT_"))) 
-		{
+		MESHSYNC_SCOPE(STAT_MeshSync_Inflate);
+		if (!FCompression::UncompressMemory(MeshSyncCodecFormat(Codec), InflateBuffer.GetData(), RawLength, Reader.GetCurrent(), Reader.Remaining())) {
+			UE_LOG(LogMeshSync, Warning, TEXT("Unable to inflate %u bytes frame, terminating connection"), RawLength);
+			return false;
+		}
+	}
+	FMeshSyncFrameReader InnerReader(InflateBuffer.GetData(), RawLength);
+	const bool bDispatched = Dispatch(Inner, InnerReader);
+	// An occasional huge frame should not pin its buffer for the life of the connection.
+	if (InflateBuffer.Max() > MaxRetainedInflateBytes) {
+		InflateBuffer.Empty();
+	}
+	return bDispatched;
+}
 
+bool FMeshSyncConnection::ProcessingMeshBegin(FMeshSyncFrameReader& Reader)
+{
+	uint32 UploadId = 0;
+	uint64 NumFaces = 0;
+	uint64 NumWedges = 0;
+	uint64 NumVertices = 0;
+	uint32 MaterialId = 0;
+	FMeshSyncArrayView InstancePositions;
+	FMeshSyncArrayView InstanceColors;
+	FMeshSyncUpload Upload;
+	Upload.Desc = Server->GetDescPool().Acquire();
+	Upload.RequestId = FrameSequence;
+	FSyncedMeshDesc& Desc = *Upload.Desc;
+
+	bool bRead =
+		Reader.ReadPrim(UploadId) &&
+		Reader.ReadString(Desc.Name) &&
+		Reader.ReadPrim(Upload.Flag) &&
+		Reader.ReadPrim(Desc.TileX) &&
+		Reader.ReadPrim(Desc.TileY) &&
+		Reader.ReadPrim(Desc.TileZ) &&
+		Reader.ReadPrim(NumFaces) &&
+		Reader.ReadPrim(NumWedges) &&
+		Reader.ReadPrim(NumVertices);
+	bRead = bRead &&
+		(!EnumHasAnyFlags(Upload.Flag, MeshFlag::QUANTIZED_POSITION) ||
+			(Reader.ReadPrim(Upload.PositionMin) && Reader.ReadPrim(Upload.PositionMax))) &&
+		Reader.ReadPrim(MaterialId) &&
+		Reader.ReadStringList(Desc.MaterialSlots) &&
+		Reader.SkipArray<FVector>(InstancePositions) &&
+		Reader.SkipArray<FColor>(InstanceColors);
+
+	bool bAccepted = false;
+	if (!bRead) {
+		UE_LOG(LogMeshSync, Warning, TEXT("Malformed mesh upload %s, terminating connection"), *Desc.Name);
+	} else if (Uploads.Contains(UploadId) || Uploads.Num() >= MaxUploads) {
+		UE_LOG(LogMeshSync, Warning, TEXT("Mesh upload %u for %s is already open or too many uploads are, terminating connection"), UploadId, *Desc.Name);
+	} else if (NumWedges != NumFaces * 3 || NumWedges > (uint64)MAX_int32 || NumVertices > (uint64)MAX_int32) {
+		// The raw mesh indexes its arrays with int32, larger meshes have to be split into tiles.
+		UE_LOG(LogMeshSync, Warning, TEXT("Mesh upload %s declares %llu faces, %llu wedges and %llu vertices, terminating connection"),
+			*Desc.Name, NumFaces, NumWedges, NumVertices);
+	} else {
+		bAccepted = AcceptsEncodings(Upload.Flag, Desc.Name);
+	}
+	if (!bAccepted) {
+		Server->GetDescPool().Release(Upload.Desc);
+		return false;
+	}
+
+	if (EnumHasAnyFlags(Upload.Flag, MeshFlag::HAS_INSTANCE_POSITION)) {
+		Reader.CopyArray(InstancePositions, Desc.InstancePositions);
+	}
+	if (EnumHasAnyFlags(Upload.Flag, MeshFlag::HAS_INSTANCE_COLOR0)) {
+		Reader.CopyArray(InstanceColors, Desc.InstanceColors);
+	}
+
+	for (int32 Channel = 0; Channel < (int32)EMeshSyncChannel::Num; Channel++) {
+		uint64 Declared = NumWedges;
+		if (Channel == (int32)EMeshSyncChannel::FaceMaterialIndices || Channel == (int32)EMeshSyncChannel::FaceSmoothingMasks) {
+			Declared = NumFaces;
+		} else if (Channel == (int32)EMeshSyncChannel::VertexPositions) {
+			Declared = NumVertices;
+		} else if (Channel != (int32)EMeshSyncChannel::Normals && !MeshSyncDecodesChannel((EMeshSyncChannel)Channel, Upload.Flag)) {
+			Declared = 0;
 		}
-		else // need build mic and reduce materials
-		{
-			FString RealName = TEXT("MT_");
-			RealName += MaterialName;
-			FString MaterialPackageName = Server->MaterialsPackage() + RealName;
-			UPackage* Package = FindPackage(nullptr, *MaterialPackageName);
-			if (!Package) {
-				Package = CreatePackage(nullptr, *MaterialPackageName);
-			} else { // already has this material
-				UE_LOG(LogMeshSync, Display, TEXT("Material %s is already existed!"), *MaterialPackageName);
-				return;
-			}
-			FName MaterialInstanceName = MakeUniqueObjectName(Package, UStaticMesh::StaticClass(), FName(*RealName));
-			UMaterialInstanceConstantFactoryNew* Factory = NewObject<UMaterialInstanceConstantFactoryNew>();
-			switch (MaterialCatagory) {
-			case MAT_MS_TERRAIN:
-				Factory->InitialParent = Server->FindMaterial(TEXT("MT_Terrain"));
-				break;
-			case MAT_MS_DECOR:
-				Factory->InitialParent = Server->FindMaterial(TEXT("MT_Decor"));
-				break;
-			case MAT_MS_KNOBS:
-				Factory->InitialParent = Server->FindMaterial(TEXT("MT_Knobs"));
-				break;
-			case MAT_MS_WATER:
-				//Factory->InitialParent = Material;
-				break;
+		Upload.Declared[Channel] = Declared;
+		Upload.Received[Channel] = 0;
+	}
+	Uploads.Add(UploadId, Upload);
+	return true;
+}
+
+bool FMeshSyncConnection::ProcessingMeshChunk(FMeshSyncFrameReader& Reader)
+{
+	uint32 UploadId = 0;
+	EMeshSyncChannel Channel = EMeshSyncChannel::Num;
+	uint64 First = 0;
+	if (!Reader.ReadPrim(UploadId) || !Reader.ReadPrim(Channel) || !Reader.ReadPrim(First)) {
+		UE_LOG(LogMeshSync, Warning, TEXT("Malformed mesh chunk, terminating connection"));
+		return false;
+	}
+	FMeshSyncUpload* Upload = Uploads.Find(UploadId);
+	if (!Upload || (uint32)Channel >= (uint32)EMeshSyncChannel::Num) {
+		UE_LOG(LogMeshSync, Warning, TEXT("Mesh chunk for unknown upload %u or channel %u, terminating connection"), UploadId, (uint32)Channel);
+		return false;
+	}
+
+	const int32 Index = (int32)Channel;
+	FRawMesh& Mesh = Upload->Desc->RawMesh;
+	FMeshSyncArrayView View;
+	if (!Reader.SkipArray(MeshSyncElementSize(Channel, Upload->Flag), View) ||
+		First != Upload->Received[Index] || First + View.Num > Upload->Declared[Index]) {
+		// Chunks of a channel must arrive in order and stay within the declared count.
+		UE_LOG(LogMeshSync, Warning, TEXT("Mesh chunk for %s channel %d does not continue the upload, terminating connection"),
+			*Upload->Desc->Name, Index);
+		return false;
+	}
+
+	if (MeshSyncDecodesChannel(Channel, Upload->Flag)) {
+		if (First == 0) {
+			ReserveMeshChannel(Channel, (int32)Upload->Declared[Index], Mesh);
+		}
+		AppendMeshChannel(Reader, Channel, View, Upload->Flag, Upload->PositionMin, Upload->PositionMax, Mesh);
+	}
+	Upload->Received[Index] += View.Num;
+
+	// Catch bad indices on the chunk that carries them rather than at the end of the upload.
+	if (Channel == EMeshSyncChannel::WedgeIndices) {
+		const uint64 NumVertices = Upload->Declared[(int32)EMeshSyncChannel::VertexPositions];
+		for (int32 Wedge = (int32)First; Wedge < Mesh.WedgeIndices.Num(); Wedge++) {
+			if (Mesh.WedgeIndices[Wedge] >= NumVertices) {
+				UE_LOG(LogMeshSync, Warning, TEXT("Mesh upload %s references vertex %u of %llu, terminating connection"),
+					*Upload->Desc->Name, Mesh.WedgeIndices[Wedge], NumVertices);
+				return false;
 			}
-			UMaterialInstanceConstant* MIC = (UMaterialInstanceConstant*)Factory->FactoryCreateNew(
-				UMaterialInstanceConstant::StaticClass(), 
-				Package, MaterialInstanceName, RF_Standalone | RF_Public | RF_Transactional, NULL, GWarn);
-			checkSlow(MIC);
-			FAssetRegistryModule::AssetCreated(MIC);
-			//Package->FullyLoad();
-			Package->SetDirtyFlag(true);
-			//MaterialImpId;
-			//UObject* NewAsset = AssetTools.CreateAsset(Name, FPackageName::GetLongPackagePath(PackageName), UMaterialInstanceConstant::StaticClass(), Factory);
-			TArray<UObject*>ObjectsToSync;
-			ObjectsToSync.Add(MIC);
-			GEditor->SyncBrowserToObjects(ObjectsToSync);
-			Server->AddMaterial(RealName, MIC);
-			MIC->PreEditChange(NULL);
-			MIC->PostEditChange();
-		}
-
-	});
-	
-	return false;
-}
-#pragma optimize("", on)
\ No newline at end of file
+		}
+	}
+	return true;
+}
+
+bool FMeshSyncConnection::ProcessingMeshEnd(FMeshSyncFrameReader& Reader)
+{
+	uint32 UploadId = 0;
+	FMeshSyncUpload Upload;
+	if (!Reader.ReadPrim(UploadId) || !Uploads.RemoveAndCopyValue(UploadId, Upload)) {
+		UE_LOG(LogMeshSync, Warning, TEXT("Mesh upload end for unknown upload, terminating connection"));
+		return false;
+	}
+
+	bool bComplete = true;
+	for (int32 Channel = 0; Channel < (int32)EMeshSyncChannel::Num; Channel++) {
+		// Normals are optional on the wire.
+		if (Channel != (int32)EMeshSyncChannel::Normals && Upload.Received[Channel] != Upload.Declared[Channel]) {
+			UE_LOG(LogMeshSync, Warning, TEXT("Mesh upload %s ended with %llu of %llu elements in channel %d, terminating connection"),
+				*Upload.Desc->Name, Upload.Received[Channel], Upload.Declared[Channel], Channel);
+			bComplete = false;
+			break;
+		}
+	}
+	if (!bComplete || !FinishMesh(*Upload.Desc)) {
+		Respond(Upload.RequestId, EMeshSyncResponse::Failed, TEXT("Incomplete or invalid upload"));
+		Server->GetDescPool().Release(Upload.Desc);
+		return false;
+	}
+	AcceptMesh(*Upload.Desc, Upload.RequestId);
+	Server->GetPreprocessor().Dispatch(Upload.Desc);
+	return true;
+}
+
+bool FMeshSyncConnection::ProcessingIncomingMaterial(FMeshSyncFrameReader& Reader)
+{
+	TUniquePtr<FSyncedMaterialDesc> Desc(new FSyncedMaterialDesc);
+
+	bool bRead =
+		Reader.ReadString(Desc->Name) &&
+		Reader.ReadPrim(Desc->MaterialId) &&
+		Reader.ReadPrim(Desc->BaseColor) &&
+		Reader.ReadPrim(Desc->Roughness) &&
+		Reader.ReadPrim(Desc->Metallic) &&
+		Reader.ReadString(Desc->BaseColorMap) &&
+		Reader.ReadString(Desc->NormalMap);
+
+	if (!bRead) {
+		UE_LOG(LogMeshSync, Warning, TEXT("Malformed material frame %s, terminating connection"), *Desc->Name);
+		return false;
+	}
+	Desc->ParameterHash = FMeshSyncAssetIndex::HashMaterial(*Desc);
+	if (GetDefault<UMeshSyncSettings>()->bUsePaletteMaterials) {
+		Server->GetPalette().AddMaterial(Desc->Name, FLinearColor(Desc->BaseColor).ToFColor(true));
+	}
+
+	if (WantsResponses()) {
+		Desc->Requester = AsShared();
+		Desc->RequestId = FrameSequence;
+		Respond(FrameSequence, EMeshSyncResponse::Accepted, FString());
+	}
+
+	Server->GetCommitQueue().EnqueueMaterial(Desc.Release());
+	return true;
+}
@@ -0,0 +1,255 @@
+// Copyright 1998-2019 Epic Games, Inc. All Rights Reserved.
+
+#include "MeshSyncAssetIndex.h"
+#include "MeshSync.h"
+#include "MeshSyncServer.h"
+
+#include "Misc/FileHelper.h"
+#include "Misc/PackageName.h"
+#include "Misc/Paths.h"
+
+FMeshSyncAssetIndex::FMeshSyncAssetIndex(const FString& InIndexFile)
+	: IndexFile(InIndexFile)
+	, bDirty(false)
+	, LastFlushTime(0.0)
+{
+	Load();
+}
+
+FMeshSyncAssetIndex::~FMeshSyncAssetIndex()
+{
+	Flush();
+}
+
+FSHAHash FMeshSyncAssetIndex::HashMesh(const FSyncedMeshDesc& Desc)
+{
+	const FRawMesh& Mesh = Desc.RawMesh;
+
+	FSHA1 Sha;
+	auto HashArray = [&Sha](const auto& Array)
+	{
+		const uint32 Num = Array.Num();
+		Sha.Update((const uint8*)&Num, sizeof(Num));
+		Sha.Update((const uint8*)Array.GetData(), Array.Num() * Array.GetTypeSize());
+	};
+	HashArray(Mesh.VertexPositions);
+	HashArray(Mesh.WedgeIndices);
+	HashArray(Mesh.FaceMaterialIndices);
+	// Normals are built from the smoothing groups.
+	HashArray(Mesh.FaceSmoothingMasks);
+	for (int32 UVIndex = 0; UVIndex < MAX_MESH_TEXTURE_COORDS; UVIndex++)
+	{
+		HashArray(Mesh.WedgeTexCoords[UVIndex]);
+	}
+	// Same geometry painted differently must stay a separate asset.
+	HashArray(Mesh.WedgeColors);
+	for (const FString& Slot : Desc.MaterialSlots)
+	{
+		Sha.UpdateWithString(*Slot, Slot.Len() + 1);
+	}
+	Sha.Final();
+
+	FSHAHash Hash;
+	Sha.GetHash(Hash.Hash);
+	return Hash;
+}
+
+FSHAHash FMeshSyncAssetIndex::HashMaterial(const FSyncedMaterialDesc& Desc)
+{
+	FSHA1 Sha;
+	const uint32 Category = Desc.MaterialId >> 16;
+	Sha.Update((const uint8*)&Category, sizeof(Category));
+	Sha.Update((const uint8*)&Desc.BaseColor, sizeof(Desc.BaseColor));
+	Sha.Update((const uint8*)&Desc.Roughness, sizeof(Desc.Roughness));
+	Sha.Update((const uint8*)&Desc.Metallic, sizeof(Desc.Metallic));
+	Sha.UpdateWithString(*Desc.BaseColorMap, Desc.BaseColorMap.Len() + 1);
+	Sha.UpdateWithString(*Desc.NormalMap, Desc.NormalMap.Len() + 1);
+	Sha.Final();
+
+	FSHAHash Hash;
+	Sha.GetHash(Hash.Hash);
+	return Hash;
+}
+
+bool FMeshSyncAssetIndex::FindMesh(const FSHAHash& Hash, FString& OutObjectPath) const
+{
+	FScopeLock ScopeLock(&Lock);
+	if (const FString* Found = Meshes.Find(Hash))
+	{
+		OutObjectPath = *Found;
+		return true;
+	}
+	return false;
+}
+
+bool FMeshSyncAssetIndex::ContainsMesh(const FSHAHash& Hash) const
+{
+	FScopeLock ScopeLock(&Lock);
+	return Meshes.Contains(Hash);
+}
+
+void FMeshSyncAssetIndex::AddMesh(const FSHAHash& Hash, const FString& ObjectPath)
+{
+	FScopeLock ScopeLock(&Lock);
+	Meshes.Add(Hash, ObjectPath);
+	SessionAssets.Add(ObjectPath);
+	bDirty = true;
+}
+
+void FMeshSyncAssetIndex::RemoveMesh(const FSHAHash& Hash)
+{
+	FScopeLock ScopeLock(&Lock);
+	if (Meshes.Remove(Hash) > 0)
+	{
+		bDirty = true;
+	}
+}
+
+void FMeshSyncAssetIndex::SetTile(const FString& TileName, const FMeshSyncTileRecord& Record)
+{
+	FScopeLock ScopeLock(&Lock);
+	if (const FMeshSyncTileRecord* Previous = Tiles.Find(TileName))
+	{
+		ReleaseTileUse(Previous->ObjectPath);
+	}
+	Tiles.Add(TileName, Record);
+	TilesUsing.FindOrAdd(Record.ObjectPath)++;
+	SessionAssets.Add(Record.ObjectPath);
+	bDirty = true;
+}
+
+void FMeshSyncAssetIndex::RemoveTile(const FString& TileName)
+{
+	FScopeLock ScopeLock(&Lock);
+	FMeshSyncTileRecord Removed;
+	if (Tiles.RemoveAndCopyValue(TileName, Removed))
+	{
+		ReleaseTileUse(Removed.ObjectPath);
+		bDirty = true;
+	}
+}
+
+void FMeshSyncAssetIndex::ReleaseTileUse(const FString& ObjectPath)
+{
+	int32* Count = TilesUsing.Find(ObjectPath);
+	if (Count && --(*Count) <= 0)
+	{
+		TilesUsing.Remove(ObjectPath);
+	}
+}
+
+bool FMeshSyncAssetIndex::FindTile(const FString& TileName, FMeshSyncTileRecord& OutRecord) const
+{
+	FScopeLock ScopeLock(&Lock);
+	if (const FMeshSyncTileRecord* Found = Tiles.Find(TileName))
+	{
+		OutRecord = *Found;
+		return true;
+	}
+	return false;
+}
+
+void FMeshSyncAssetIndex::SetTileRevision(const FString& TileName, uint64 Revision)
+{
+	FScopeLock ScopeLock(&Lock);
+	if (FMeshSyncTileRecord* Found = Tiles.Find(TileName))
+	{
+		Found->Revision = Revision;
+		bDirty = true;
+	}
+}
+
+int32 FMeshSyncAssetIndex::CountTilesUsing(const FString& ObjectPath) const
+{
+	FScopeLock ScopeLock(&Lock);
+	const int32* Count = TilesUsing.Find(ObjectPath);
+	return Count ? *Count : 0;
+}
+
+bool FMeshSyncAssetIndex::IsAssetAvailable(const FString& ObjectPath) const
+{
+	{
+		FScopeLock ScopeLock(&Lock);
+		if (SessionAssets.Contains(ObjectPath))
+		{
+			return true;
+		}
+	}
+	return FPackageName::DoesPackageExist(FPackageName::ObjectPathToPackageName(ObjectPath));
+}
+
+void FMeshSyncAssetIndex::Flush(double MinInterval)
+{
+	FScopeLock ScopeLock(&Lock);
+	const double Now = FPlatformTime::Seconds();
+	if (!bDirty || IndexFile.IsEmpty() || Now - LastFlushTime < MinInterval)
+	{
+		return;
+	}
+
+	// "V <format version>", then one tab separated entry per line, "M <hash> <object path>" or "T <tile> <object path> <hash> <revision>".
+	FString Contents = FString::Printf(TEXT("V\t%d\n"), FormatVersion);
+	for (const auto& Entry : Meshes)
+	{
+		Contents += FString::Printf(TEXT("M\t%s\t%s\n"), *Entry.Key.ToString(), *Entry.Value);
+	}
+	for (const auto& Entry : Tiles)
+	{
+		Contents += FString::Printf(TEXT("T\t%s\t%s\t%s\t%llu\n"), *Entry.Key, *Entry.Value.ObjectPath, *Entry.Value.ContentHash.ToString(), Entry.Value.Revision);
+	}
+	if (!FFileHelper::SaveStringToFile(Contents, *IndexFile))
+	{
+		UE_LOG(LogMeshSync, Warning, TEXT("Unable to write MeshSync asset index %s"), *IndexFile);
+	}
+	bDirty = false;
+	LastFlushTime = Now;
+}
+
+void FMeshSyncAssetIndex::Load()
+{
+	TArray<FString> Lines;
+	if (IndexFile.IsEmpty() || !FFileHelper::LoadFileToStringArray(Lines, *IndexFile))
+	{
+		return;
+	}
+
+	// Without a version line the index predates FormatVersion 2.
+	int32 Version = 1;
+	for (const FString& Line : Lines)
+	{
+		TArray<FString> Fields;
+		Line.ParseIntoArray(Fields, TEXT("\t"));
+		if (Fields.Num() == 2 && Fields[0] == TEXT("V"))
+		{
+			Version = FCString::Atoi(*Fields[1]);
+		}
+		else if (Fields.Num() == 3 && Fields[0] == TEXT("M"))
+		{
+			if (Version != FormatVersion)
+			{
+				continue;
+			}
+			FSHAHash Hash;
+			Hash.FromString(Fields[1]);
+			Meshes.Add(Hash, Fields[2]);
+		}
+		else if (Fields.Num() == 5 && Fields[0] == TEXT("T"))
+		{
+			FMeshSyncTileRecord& Record = Tiles.Add(Fields[1]);
+			Record.ObjectPath = Fields[2];
+			// Kept for their assets and revisions, a hash of another format never matches.
+			if (Version == FormatVersion)
+			{
+				Record.ContentHash.FromString(Fields[3]);
+			}
+			Record.Revision = FCString::Strtoui64(*Fields[4], nullptr, 10);
+			TilesUsing.FindOrAdd(Record.ObjectPath)++;
+		}
+	}
+	if (Version != FormatVersion)
+	{
+		UE_LOG(LogMeshSync, Display, TEXT("MeshSync asset index %s has format %d, its content hashes are dropped"), *IndexFile, Version);
+		bDirty = true;
+	}
+	UE_LOG(LogMeshSync, Display, TEXT("Loaded %d synced meshes and %d tiles from %s"), Meshes.Num(), Tiles.Num(), *IndexFile);
+}
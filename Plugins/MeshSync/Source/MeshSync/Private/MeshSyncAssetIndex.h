@@ -0,0 +1,82 @@
+// Copyright 1998-2019 Epic Games, Inc. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Misc/SecureHash.h"
+#include "Misc/ScopeLock.h"
+
+class FSyncedMeshDesc;
+class FSyncedMaterialDesc;
+
+/** What the server holds for one synced tile. */
+struct FMeshSyncTileRecord
+{
+	FMeshSyncTileRecord() : Revision(0) {}
+
+	FString ObjectPath;
+	FSHAHash ContentHash;
+	// Last revision a SendMeshDelta carried for this tile, 0 when never sent
+	uint64 Revision;
+};
+
+/**
+ * Persistent record of the meshes MeshSync has produced, keyed by the hash
+ * of their incoming geometry, so a tile whose content was already imported
+ * (under any name, in any session) resolves to the existing asset. It also
+ * tracks which asset, content and revision every tile currently maps to.
+ *
+ * Lookups are thread safe, workers use them to skip preparing duplicates.
+ */
+class FMeshSyncAssetIndex
+{
+public:
+	/** Loads and saves the index at InIndexFile, without a file it lives in memory only. */
+	FMeshSyncAssetIndex(const FString& InIndexFile);
+	~FMeshSyncAssetIndex();
+
+	/** Hash over positions, indices, smoothing groups, UVs, colors and material slots of a decoded mesh. */
+	static FSHAHash HashMesh(const FSyncedMeshDesc& Desc);
+	/** Hash over the parent category and parameters of a material, not its name. */
+	static FSHAHash HashMaterial(const FSyncedMaterialDesc& Desc);
+
+	bool FindMesh(const FSHAHash& Hash, FString& OutObjectPath) const;
+	bool ContainsMesh(const FSHAHash& Hash) const;
+	void AddMesh(const FSHAHash& Hash, const FString& ObjectPath);
+	void RemoveMesh(const FSHAHash& Hash);
+
+	void SetTile(const FString& TileName, const FMeshSyncTileRecord& Record);
+	void RemoveTile(const FString& TileName);
+	bool FindTile(const FString& TileName, FMeshSyncTileRecord& OutRecord) const;
+	void SetTileRevision(const FString& TileName, uint64 Revision);
+	/** Number of tiles currently represented by the asset at ObjectPath. */
+	int32 CountTilesUsing(const FString& ObjectPath) const;
+
+	/**
+	 * Whether an indexed asset can still be loaded, either committed this session or saved to disk.
+	 * Entries of an earlier session that ended without saving are not.
+	 */
+	bool IsAssetAvailable(const FString& ObjectPath) const;
+
+	/** Writes the index if it changed and at least MinInterval seconds passed since the last write. */
+	void Flush(double MinInterval = 0.0);
+
+	/** Change when HashMesh hashes differently, content hashes of older indexes are dropped on load. */
+	static const int32 FormatVersion = 2;
+
+private:
+	void Load();
+	// Caller holds Lock.
+	void ReleaseTileUse(const FString& ObjectPath);
+
+	FString IndexFile;
+	mutable FCriticalSection Lock;
+	TMap<FSHAHash, FString> Meshes;
+	TMap<FString, FMeshSyncTileRecord> Tiles;
+	// Number of tiles per object path, see CountTilesUsing.
+	TMap<FString, int32> TilesUsing;
+	// Object paths committed since the index was loaded, they exist in memory even while unsaved.
+	TSet<FString> SessionAssets;
+	bool bDirty;
+	double LastFlushTime;
+};
@@ -0,0 +1,451 @@
+// Copyright 1998-2019 Epic Games, Inc. All Rights Reserved.
+
+#include "MeshSyncBenchmark.h"
+#include "MeshSync.h"
+#include "MeshSyncServer.h"
+#include "MeshSyncSettings.h"
+#include "MeshSyncCommitQueue.h"
+#include "MeshSyncPreprocess.h"
+#include "MeshSyncMerge.h"
+
+#include "Containers/Ticker.h"
+#include "HAL/IConsoleManager.h"
+#include "HAL/PlatformMemory.h"
+#include "HAL/Runnable.h"
+#include "HAL/RunnableThread.h"
+#include "Math/RandomStream.h"
+#include "Misc/FileHelper.h"
+#include "Misc/Parse.h"
+#include "Modules/ModuleManager.h"
+#include "IPAddress.h"
+#include "Sockets.h"
+#include "SocketSubsystem.h"
+
+FMeshSyncStageTimes& FMeshSyncStageTimes::Get()
+{
+	static FMeshSyncStageTimes Times;
+	return Times;
+}
+
+namespace
+{
+	const TCHAR* StageNames[] = { TEXT("Receive"), TEXT("Decode"), TEXT("Validate"), TEXT("Preprocess"), TEXT("Commit") };
+	static_assert(ARRAY_COUNT(StageNames) == (int32)EMeshSyncStage::Num, "Missing stage name");
+
+	struct FStageSnapshot
+	{
+		int64 Cycles[(int32)EMeshSyncStage::Num];
+		int64 Items[(int32)EMeshSyncStage::Num];
+		int64 BytesReceived;
+		int64 MeshesCommitted;
+		int64 TilesAccepted;
+
+		void Capture() {
+			FMeshSyncStageTimes& Times = FMeshSyncStageTimes::Get();
+			for (int32 Stage = 0; Stage < (int32)EMeshSyncStage::Num; Stage++) {
+				Cycles[Stage] = Times.Cycles[Stage].GetValue();
+				Items[Stage] = Times.Items[Stage].GetValue();
+			}
+			BytesReceived = Times.BytesReceived.GetValue();
+			MeshesCommitted = Times.MeshesCommitted.GetValue();
+			TilesAccepted = Times.TilesAccepted.GetValue();
+		}
+	};
+
+	// Writes a frame stream the way a DCC exporter would: materials first, then one grid mesh per tile.
+	void BuildSyntheticStream(TArray<uint8>& Stream, int32 NumMeshes, int32 NumTriangles, int32 NumMaterials, int32 Seed)
+	{
+		FRandomStream Random(Seed);
+		TArray<uint8> Body;
+
+		TArray<FString> MaterialNames;
+		for (int32 MaterialIndex = 0; MaterialIndex < NumMaterials; MaterialIndex++) {
+			MaterialNames.Add(FString::Printf(TEXT("Bench_%d_Mat%d"), Seed, MaterialIndex));
+
+			Body.Reset();
+			FMeshSyncFrameWriter Writer(Body);
+			Writer.WriteString(MaterialNames.Last());
+			Writer.WritePrim(((uint32)MAT_MS_DECOR << 16) | (uint32)MaterialIndex);
+			Writer.WritePrim(FVector(Random.FRand(), Random.FRand(), Random.FRand()));
+			Writer.WritePrim(Random.FRand());
+			Writer.WritePrim(0.0f);
+			Writer.WriteString(FString());
+			Writer.WriteString(FString());
+			FMeshSyncFrameWriter::AppendFrame(Stream, EMeshSyncCommand::SendMaterial, Body);
+		}
+
+		const int32 GridSize = FMath::Max(FMath::CeilToInt(FMath::Sqrt(NumTriangles / 2.0f)), 1);
+		const float CellSize = 10.0f;
+
+		// Topology is the same for every tile, positions are jittered so no two tiles deduplicate.
+		TArray<int32> FaceMaterialIndices;
+		TArray<uint32> FaceSmoothingMasks;
+		TArray<uint32> WedgeIndices;
+		TArray<FVector2D> TexCoords;
+		TArray<FColor> WedgeColors;
+		for (int32 Y = 0; Y < GridSize; Y++) {
+			for (int32 X = 0; X < GridSize; X++) {
+				const uint32 A = Y * (GridSize + 1) + X;
+				const uint32 B = A + 1;
+				const uint32 C = A + GridSize + 1;
+				const uint32 D = C + 1;
+				const uint32 Quad[] = { A, C, B, B, C, D };
+				for (uint32 Index : Quad) {
+					WedgeIndices.Add(Index);
+					TexCoords.Add(FVector2D(Index % (GridSize + 1), Index / (GridSize + 1)) / GridSize);
+					WedgeColors.Add(FColor::White);
+				}
+				FaceMaterialIndices.Add(0);
+				FaceMaterialIndices.Add(0);
+				FaceSmoothingMasks.Add(1);
+				FaceSmoothingMasks.Add(1);
+			}
+		}
+
+		const TArray<FVector> NoVectors;
+		const TArray<FVector2D> NoTexCoords;
+		const TArray<FColor> NoColors;
+		TArray<FVector> Positions;
+		Positions.SetNumUninitialized((GridSize + 1) * (GridSize + 1));
+
+		for (int32 MeshIndex = 0; MeshIndex < NumMeshes; MeshIndex++) {
+			for (int32 VertexIndex = 0; VertexIndex < Positions.Num(); VertexIndex++) {
+				Positions[VertexIndex] = FVector(
+					(VertexIndex % (GridSize + 1)) * CellSize,
+					(VertexIndex / (GridSize + 1)) * CellSize,
+					Random.FRandRange(0.0f, CellSize));
+			}
+
+			Body.Reset();
+			FMeshSyncFrameWriter Writer(Body);
+			Writer.WriteString(FString::Printf(TEXT("Bench_%d_%d"), Seed, MeshIndex));
+			Writer.WritePrim(MeshFlag::HAS_INDICES | MeshFlag::HAS_UV0 | MeshFlag::HAS_COLOR_0);
+			Writer.WritePrim((int32)(MeshIndex % 64));
+			Writer.WritePrim((int32)(MeshIndex / 64));
+			Writer.WritePrim((int32)0);
+			Writer.WriteArray(FaceMaterialIndices);
+			Writer.WriteArray(FaceSmoothingMasks);
+			Writer.WriteArray(WedgeIndices);
+			Writer.WriteArray(Positions);
+			Writer.WriteArray(NoVectors);
+			Writer.WriteArray(TexCoords);
+			Writer.WriteArray(NoTexCoords);
+			Writer.WriteArray(NoTexCoords);
+			Writer.WriteArray(WedgeColors);
+			Writer.WritePrim((uint32)MAT_MS_DECOR << 16);
+			Writer.WritePrim((uint32)(NumMaterials > 0 ? 1 : 0));
+			if (NumMaterials > 0) {
+				Writer.WriteString(MaterialNames[MeshIndex % NumMaterials]);
+			}
+			Writer.WriteArray(NoVectors);
+			Writer.WriteArray(NoColors);
+			FMeshSyncFrameWriter::AppendFrame(Stream, EMeshSyncCommand::SendMesh, Body);
+		}
+	}
+
+	// Plays a frame stream against the server over loopback, then holds the
+	// connection open so frames still buffered in the socket are not dropped.
+	class FMeshSyncBenchClient : public FRunnable
+	{
+	public:
+		FMeshSyncBenchClient(int32 InPort, const TArray<uint8>& InStream)
+			: Port(InPort)
+			, Stream(InStream)
+		{}
+
+		virtual uint32 Run() override
+		{
+			ISocketSubsystem* SocketSubsystem = ISocketSubsystem::Get();
+			FSocket* Socket = SocketSubsystem->CreateSocket(NAME_Stream, TEXT("MeshSync bench client"));
+			TSharedRef<FInternetAddr> Addr = SocketSubsystem->CreateInternetAddr(0x7f000001, Port);
+
+			bool bSent = false;
+			if (Socket && Socket->Connect(*Addr)) {
+				int32 Offset = 0;
+				int32 Sent = 0;
+				while (Offset < Stream.Num() && Socket->Send(Stream.GetData() + Offset, FMath::Min(Stream.Num() - Offset, 1 << 20), Sent)) {
+					Offset += Sent;
+				}
+				bSent = Offset == Stream.Num();
+			}
+			Result.Set(bSent ? 1 : -1);
+
+			while (!StopRequested.GetValue()) {
+				FPlatformProcess::Sleep(0.01f);
+			}
+			if (Socket) {
+				Socket->Close();
+				SocketSubsystem->DestroySocket(Socket);
+			}
+			return 0;
+		}
+
+		virtual void Stop() override
+		{
+			StopRequested.Set(1);
+		}
+
+		// 0 while sending, 1 once the whole stream is out, -1 on failure.
+		int32 GetResult() const { return Result.GetValue(); }
+
+	private:
+		int32 Port;
+		const TArray<uint8>& Stream;
+		FThreadSafeCounter Result;
+		FThreadSafeCounter StopRequested;
+	};
+
+	class FMeshSyncBenchmark
+	{
+	public:
+		FMeshSyncBenchmark(FMeshSyncServer* InServer, int32 InExpectedMeshes, float InTimeout)
+			: Server(InServer)
+			, Client(NULL)
+			, ClientThread(NULL)
+			, ExpectedMeshes(InExpectedMeshes)
+			, bMergeTiles(GetDefault<UMeshSyncSettings>()->bMergeTilesIntoCells)
+			, bStarted(false)
+			, bFinished(false)
+			, Timeout(InTimeout)
+			, StartTime(0.0)
+			, SendTime(0.0)
+			, FinishTime(0.0)
+			, PeakUsedPhysical(0)
+		{}
+
+		~FMeshSyncBenchmark()
+		{
+			StopClient();
+			FMeshSyncStageTimes::Get().Sampling.Set(0);
+			if (bStarted) {
+				Server->EndBenchmark();
+			}
+		}
+
+		// Frames to play, header and body back to back.
+		TArray<uint8> Stream;
+
+		// False when the server is busy, a benchmark only runs on an idle pipeline.
+		bool Start()
+		{
+			if (!Server->BeginBenchmark()) {
+				return false;
+			}
+			bStarted = true;
+
+			FMeshSyncStageTimes& Times = FMeshSyncStageTimes::Get();
+			{
+				FScopeLock Lock(&Times.SamplesLock);
+				for (TArray<uint64>& StageSamples : Times.Samples) {
+					StageSamples.Reset();
+				}
+			}
+			Times.Sampling.Set(1);
+			Baseline.Capture();
+			StartTime = FPlatformTime::Seconds();
+			Client = new FMeshSyncBenchClient(Server->GetPort(), Stream);
+			ClientThread = FRunnableThread::Create(Client, TEXT("MeshSyncBenchClient"));
+			return true;
+		}
+
+		// Returns true once the run finished or failed and the pipeline is drained.
+		bool Poll()
+		{
+			PeakUsedPhysical = FMath::Max<uint64>(PeakUsedPhysical, FPlatformMemory::GetStats().UsedPhysical);
+
+			if (bFinished) {
+				// Benchmark assets are dropped once nothing is left to commit under their path.
+				if (FPlatformTime::Seconds() - FinishTime > Timeout) {
+					UE_LOG(LogMeshSync, Warning, TEXT("MeshSync bench: the server did not drain after the run"));
+					return true;
+				}
+				return IsDrained();
+			}
+
+			const double Elapsed = FPlatformTime::Seconds() - StartTime;
+			if (Client->GetResult() < 0) {
+				UE_LOG(LogMeshSync, Error, TEXT("MeshSync bench: could not stream to port %d"), Server->GetPort());
+				Finish();
+				return false;
+			}
+			if (Elapsed > Timeout) {
+				UE_LOG(LogMeshSync, Error, TEXT("MeshSync bench: timed out after %.0f s"), Elapsed);
+				Report(Elapsed);
+				Finish();
+				return false;
+			}
+			if (Client->GetResult() == 0) {
+				return false;
+			}
+			if (SendTime == 0.0) {
+				SendTime = Elapsed;
+			}
+
+			FStageSnapshot Now;
+			Now.Capture();
+			// Merged tiles commit as cells, the merger has to be idle as well.
+			const int64 MeshesDone = bMergeTiles ?
+				Now.TilesAccepted - Baseline.TilesAccepted : Now.MeshesCommitted - Baseline.MeshesCommitted;
+			const bool bDone =
+				Now.BytesReceived - Baseline.BytesReceived >= Stream.Num() &&
+				IsDrained() &&
+				(ExpectedMeshes <= 0 || MeshesDone >= ExpectedMeshes);
+			if (bDone) {
+				Report(Elapsed);
+				Finish();
+			}
+			return bDone;
+		}
+
+	private:
+		bool IsDrained() const
+		{
+			FStageSnapshot Now;
+			Now.Capture();
+			const int32 Receive = (int32)EMeshSyncStage::Receive;
+			const int32 Decode = (int32)EMeshSyncStage::Decode;
+			return Now.Items[Receive] - Baseline.Items[Receive] == Now.Items[Decode] - Baseline.Items[Decode] &&
+				Server->GetMerger().IsIdle() &&
+				Server->GetPreprocessor().IsIdle() &&
+				Server->GetCommitQueue().Num() == 0;
+		}
+
+		void Finish()
+		{
+			bFinished = true;
+			FinishTime = FPlatformTime::Seconds();
+			FMeshSyncStageTimes::Get().Sampling.Set(0);
+			StopClient();
+		}
+
+		void StopClient()
+		{
+			if (ClientThread) {
+				ClientThread->Kill(true);
+				delete ClientThread;
+				ClientThread = NULL;
+			}
+			delete Client;
+			Client = NULL;
+		}
+
+		// Nearest rank percentile of sorted cycle counts, in milliseconds.
+		static double Percentile(const TArray<uint64>& Sorted, double Fraction)
+		{
+			if (Sorted.Num() == 0) {
+				return 0.0;
+			}
+			const int32 Index = FMath::Clamp(FMath::CeilToInt(Fraction * Sorted.Num()) - 1, 0, Sorted.Num() - 1);
+			return Sorted[Index] * FPlatformTime::GetSecondsPerCycle64() * 1000.0;
+		}
+
+		void Report(double Elapsed) const
+		{
+			FStageSnapshot End;
+			End.Capture();
+			const double SecondsPerCycle = FPlatformTime::GetSecondsPerCycle64();
+			const double Megabytes = (End.BytesReceived - Baseline.BytesReceived) / (1024.0 * 1024.0);
+			const int64 Meshes = End.MeshesCommitted - Baseline.MeshesCommitted;
+
+			UE_LOG(LogMeshSync, Display, TEXT("MeshSync bench: %lld meshes, %.1f MB in %.2f s (sent in %.2f s): %.1f meshes/s, %.1f MB/s"),
+				Meshes, Megabytes, Elapsed, SendTime, Meshes / Elapsed, Megabytes / Elapsed);
+			FMeshSyncStageTimes& Times = FMeshSyncStageTimes::Get();
+			for (int32 Stage = 0; Stage < (int32)EMeshSyncStage::Num; Stage++) {
+				const int64 Items = End.Items[Stage] - Baseline.Items[Stage];
+				const double Milliseconds = (End.Cycles[Stage] - Baseline.Cycles[Stage]) * SecondsPerCycle * 1000.0;
+				TArray<uint64> Sorted;
+				{
+					FScopeLock Lock(&Times.SamplesLock);
+					Sorted = Times.Samples[Stage];
+				}
+				Sorted.Sort();
+				UE_LOG(LogMeshSync, Display, TEXT("  %-10s %9.3f ms avg %9.3f p50 %9.3f p95 %9.3f max %12.1f ms total %8lld items"),
+					StageNames[Stage], Items > 0 ? Milliseconds / Items : 0.0,
+					Percentile(Sorted, 0.5), Percentile(Sorted, 0.95), Percentile(Sorted, 1.0), Milliseconds, Items);
+			}
+			UE_LOG(LogMeshSync, Display, TEXT("  Peak memory %.1f MB during the run, %.1f MB for the process"),
+				PeakUsedPhysical / (1024.0 * 1024.0), FPlatformMemory::GetStats().PeakUsedPhysical / (1024.0 * 1024.0));
+		}
+
+		FMeshSyncServer* Server;
+		FMeshSyncBenchClient* Client;
+		FRunnableThread* ClientThread;
+		int32 ExpectedMeshes;
+		bool bMergeTiles;
+		bool bStarted;
+		// Reported, waiting for the pipeline to drain before the benchmark's assets are dropped.
+		bool bFinished;
+		float Timeout;
+		double StartTime;
+		double SendTime;
+		double FinishTime;
+		uint64 PeakUsedPhysical;
+		FStageSnapshot Baseline;
+	};
+
+	FMeshSyncBenchmark* ActiveBenchmark = NULL;
+
+	bool TickBenchmark(float DeltaTime)
+	{
+		if (ActiveBenchmark->Poll()) {
+			delete ActiveBenchmark;
+			ActiveBenchmark = NULL;
+			return false;
+		}
+		return true;
+	}
+
+	void StartBenchmark(const TArray<FString>& Args)
+	{
+		FMeshSyncServer* Server = FModuleManager::GetModuleChecked<FMeshSyncModule>("MeshSync").GetServer();
+		if (ActiveBenchmark) {
+			UE_LOG(LogMeshSync, Warning, TEXT("MeshSync bench is already running"));
+			return;
+		}
+		if (!Server || Server->GetPort() == 0) {
+			UE_LOG(LogMeshSync, Warning, TEXT("MeshSync bench needs a listening server"));
+			return;
+		}
+
+		const FString Params = FString::Join(Args, TEXT(" "));
+		int32 NumMeshes = 256;
+		int32 NumTriangles = 2048;
+		int32 NumMaterials = 8;
+		int32 Seed = (int32)(FPlatformTime::Cycles() & 0x7fffffff);
+		float Timeout = 600.0f;
+		FString File;
+		FParse::Value(*Params, TEXT("Meshes="), NumMeshes);
+		FParse::Value(*Params, TEXT("Triangles="), NumTriangles);
+		FParse::Value(*Params, TEXT("Materials="), NumMaterials);
+		FParse::Value(*Params, TEXT("Seed="), Seed);
+		FParse::Value(*Params, TEXT("Timeout="), Timeout);
+		FParse::Value(*Params, TEXT("File="), File);
+
+		// A recorded stream has an unknown mesh count, the run ends when the server drains instead.
+		FMeshSyncBenchmark* Benchmark = new FMeshSyncBenchmark(Server, File.IsEmpty() ? NumMeshes : 0, Timeout);
+		if (File.IsEmpty()) {
+			BuildSyntheticStream(Benchmark->Stream, NumMeshes, NumTriangles, NumMaterials, Seed);
+		} else if (!FFileHelper::LoadFileToArray(Benchmark->Stream, *File)) {
+			UE_LOG(LogMeshSync, Warning, TEXT("MeshSync bench could not read %s"), *File);
+			delete Benchmark;
+			return;
+		}
+
+		if (!Benchmark->Start()) {
+			UE_LOG(LogMeshSync, Warning, TEXT("MeshSync bench needs an idle server, try again once the current sync is committed"));
+			delete Benchmark;
+			return;
+		}
+		UE_LOG(LogMeshSync, Display, TEXT("MeshSync bench: streaming %.1f MB to port %d"),
+			Benchmark->Stream.Num() / (1024.0 * 1024.0), Server->GetPort());
+		ActiveBenchmark = Benchmark;
+		FTicker::GetCoreTicker().AddTicker(FTickerDelegate::CreateStatic(&TickBenchmark));
+	}
+}
+
+static FAutoConsoleCommand MeshSyncBenchCommand(
+	TEXT("MeshSync.Bench"),
+	TEXT("Streams synthetic or recorded frames to the MeshSync server over loopback and reports throughput, per stage timings and peak memory.\n")
+	TEXT("Assets of the run are committed under /Temp/MeshSyncBench, never placed or saved, and dropped afterwards.\n")
+	TEXT("MeshSync.Bench [Meshes=256] [Triangles=2048] [Materials=8] [Seed=N] [File=<recorded frame stream>] [Timeout=600]"),
+	FConsoleCommandWithArgsDelegate::CreateStatic(&StartBenchmark));
@@ -0,0 +1,65 @@
+// Copyright 1998-2019 Epic Games, Inc. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "HAL/ThreadSafeCounter.h"
+#include "HAL/ThreadSafeCounter64.h"
+#include "Misc/ScopeLock.h"
+
+enum class EMeshSyncStage : uint8 {
+	Receive,
+	Decode,
+	Validate,
+	Preprocess,
+	Commit,
+	Num
+};
+
+/**
+ * Time and item totals per ingest stage. Every thread that handles a frame
+ * adds to them without locking, readers take differences of two snapshots.
+ * While Sampling is set the time of every item is kept as well, for percentiles.
+ */
+struct FMeshSyncStageTimes
+{
+	FThreadSafeCounter64 Cycles[(int32)EMeshSyncStage::Num];
+	FThreadSafeCounter64 Items[(int32)EMeshSyncStage::Num];
+	FThreadSafeCounter64 BytesReceived;
+	FThreadSafeCounter64 MeshesCommitted;
+	// Tiles filed under a cell for bMergeTilesIntoCells, they commit as part of merged meshes.
+	FThreadSafeCounter64 TilesAccepted;
+
+	FThreadSafeCounter Sampling;
+	FCriticalSection SamplesLock;
+	TArray<uint64> Samples[(int32)EMeshSyncStage::Num];
+
+	void Add(EMeshSyncStage Stage, uint64 InCycles) {
+		Cycles[(int32)Stage].Add(InCycles);
+		Items[(int32)Stage].Increment();
+		if (Sampling.GetValue()) {
+			FScopeLock Lock(&SamplesLock);
+			Samples[(int32)Stage].Add(InCycles);
+		}
+	}
+
+	static FMeshSyncStageTimes& Get();
+};
+
+/** Adds the lifetime of the scope to a stage. */
+class FMeshSyncStageScope
+{
+public:
+	explicit FMeshSyncStageScope(EMeshSyncStage InStage)
+		: Stage(InStage)
+		, StartCycles(FPlatformTime::Cycles64())
+	{}
+
+	~FMeshSyncStageScope() {
+		FMeshSyncStageTimes::Get().Add(Stage, FPlatformTime::Cycles64() - StartCycles);
+	}
+
+private:
+	EMeshSyncStage Stage;
+	uint64 StartCycles;
+};
@@ -0,0 +1,381 @@
+// Copyright 1998-2019 Epic Games, Inc. All Rights Reserved.
+
+#include "MeshSyncCapture.h"
+#include "MeshSync.h"
+#include "MeshSyncServer.h"
+
+#include "Async/MappedFileHandle.h"
+#include "GenericPlatform/GenericPlatformFile.h"
+#include "HAL/IConsoleManager.h"
+#include "HAL/PlatformFilemanager.h"
+#include "HAL/Event.h"
+#include "HAL/Runnable.h"
+#include "HAL/RunnableThread.h"
+#include "Misc/DateTime.h"
+#include "Misc/FileHelper.h"
+#include "Misc/Parse.h"
+#include "Misc/Paths.h"
+#include "Modules/ModuleManager.h"
+
+/** Feeds a capture file into one replay connection per recorded connection. */
+class FMeshSyncReplay : public FRunnable
+{
+public:
+	FMeshSyncReplay(FMeshSyncServer* InServer, const FString& InPath, bool bInPaced)
+		: Server(InServer)
+		, Path(InPath)
+		, bPaced(bInPaced)
+	{}
+
+	virtual uint32 Run() override
+	{
+		IPlatformFile& PlatformFile = FPlatformFileManager::Get().GetPlatformFile();
+		TUniquePtr<IMappedFileHandle> MappedFile(PlatformFile.OpenMapped(*Path));
+		TUniquePtr<IMappedFileRegion> MappedRegion;
+		TArray<uint8> Loaded;
+		const uint8* Data = NULL;
+		int64 Size = 0;
+		if (MappedFile.IsValid()) {
+			MappedRegion.Reset(MappedFile->MapRegion(0, MappedFile->GetFileSize()));
+		}
+		if (MappedRegion.IsValid()) {
+			Data = MappedRegion->GetMappedPtr();
+			Size = MappedRegion->GetMappedSize();
+		} else if (FFileHelper::LoadFileToArray(Loaded, *Path)) {
+			// Platforms without mapped files read the whole capture instead.
+			Data = Loaded.GetData();
+			Size = Loaded.Num();
+		} else {
+			UE_LOG(LogMeshSync, Warning, TEXT("Unable to open capture %s"), *Path);
+			Done.Set(1);
+			return 1;
+		}
+
+		FMeshSyncCaptureHeader Header;
+		if (Size < (int64)sizeof(Header)) {
+			UE_LOG(LogMeshSync, Warning, TEXT("%s is not a MeshSync capture"), *Path);
+			Done.Set(1);
+			return 1;
+		}
+		FMemory::Memcpy(&Header, Data, sizeof(Header));
+		if (Header.Magic != MeshSyncCaptureMagic) {
+			UE_LOG(LogMeshSync, Warning, TEXT("%s is not a MeshSync capture"), *Path);
+			Done.Set(1);
+			return 1;
+		}
+
+		TMap<uint32, FMeshSyncConnectionPtr> Connections;
+		const double StartTime = FPlatformTime::Seconds();
+		int64 Offset = sizeof(Header);
+		int32 NumFrames = 0;
+		int64 NumBytes = 0;
+		while (!StopRequested.GetValue() && Offset + (int64)sizeof(FMeshSyncCaptureRecord) <= Size)
+		{
+			FMeshSyncCaptureRecord Record;
+			FMemory::Memcpy(&Record, Data + Offset, sizeof(Record));
+			Offset += sizeof(Record);
+			if (Record.Length > Size - Offset) {
+				UE_LOG(LogMeshSync, Warning, TEXT("Capture %s is truncated after %d frames"), *Path, NumFrames);
+				break;
+			}
+
+			FMeshSyncConnectionPtr& Connection = Connections.FindOrAdd(Record.ConnectionId);
+			if (!Connection.IsValid()) {
+				Connection = MakeShareable(new FMeshSyncConnection(Server, NULL, Server->MainPackage(), Record.ConnectionId));
+			}
+
+			if (bPaced) {
+				const double DueTime = StartTime + Record.TimeMicroseconds / 1000000.0;
+				for (double Now = FPlatformTime::Seconds(); Now < DueTime && !StopRequested.GetValue(); Now = FPlatformTime::Seconds()) {
+					FPlatformProcess::Sleep(FMath::Min(DueTime - Now, 0.01));
+				}
+			}
+			// Same throttle as the reactor applies to a live client.
+			while ((Connection->HasFrameBacklog() || Server->IsOverInFlightBudget()) && !StopRequested.GetValue()) {
+				FPlatformProcess::Sleep(0.001f);
+			}
+
+			Connection->InjectFrame(Record.Command, Data + Offset, Record.Length);
+			Offset += Record.Length;
+			NumFrames++;
+			NumBytes += Record.Length;
+		}
+
+		for (auto& Pair : Connections) {
+			while (Pair.Value->HasPendingFrames()) {
+				FPlatformProcess::Sleep(0.001f);
+			}
+		}
+		UE_LOG(LogMeshSync, Display, TEXT("Replayed %d frames, %.1f MB from %s in %.2f s"),
+			NumFrames, NumBytes / (1024.0 * 1024.0), *Path, FPlatformTime::Seconds() - StartTime);
+		Done.Set(1);
+		return 0;
+	}
+
+	virtual void Stop() override
+	{
+		StopRequested.Set(1);
+	}
+
+	bool IsDone() const { return Done.GetValue() != 0; }
+
+private:
+	FMeshSyncServer* Server;
+	FString Path;
+	bool bPaced;
+	FThreadSafeCounter StopRequested;
+	FThreadSafeCounter Done;
+};
+
+/** Writes recorded frames to the capture file in the order they were queued. */
+class FMeshSyncCaptureWriter : public FRunnable
+{
+public:
+	FMeshSyncCaptureWriter(IFileHandle* InFile)
+		: File(InFile)
+		, WakeEvent(FPlatformProcess::GetSynchEventFromPool())
+		, QueuedBytes(0)
+	{}
+
+	virtual ~FMeshSyncCaptureWriter()
+	{
+		delete File;
+		FPlatformProcess::ReturnSynchEventToPool(WakeEvent);
+	}
+
+	/** False once the file failed or the disk fell MaxQueuedBytes behind, the recording is over then. */
+	bool Enqueue(TArray<uint8>&& Chunk)
+	{
+		FScopeLock Lock(&QueueLock);
+		if (Failed.GetValue() || QueuedBytes + Chunk.Num() > MaxQueuedBytes) {
+			return false;
+		}
+		QueuedBytes += Chunk.Num();
+		Queue.Add(MoveTemp(Chunk));
+		WakeEvent->Trigger();
+		return true;
+	}
+
+	virtual uint32 Run() override
+	{
+		while (true)
+		{
+			TArray<TArray<uint8>> Batch;
+			{
+				FScopeLock Lock(&QueueLock);
+				Swap(Batch, Queue);
+			}
+			if (Batch.Num() == 0) {
+				// Everything queued before Stop is written first.
+				if (StopRequested.GetValue()) {
+					break;
+				}
+				WakeEvent->Wait();
+				continue;
+			}
+
+			int64 Written = 0;
+			for (const TArray<uint8>& Chunk : Batch) {
+				if (!Failed.GetValue() && !File->Write(Chunk.GetData(), Chunk.Num())) {
+					UE_LOG(LogMeshSync, Warning, TEXT("Unable to write MeshSync capture, recording stopped"));
+					Failed.Set(1);
+				}
+				Written += Chunk.Num();
+			}
+			FScopeLock Lock(&QueueLock);
+			QueuedBytes -= Written;
+		}
+		File->Flush();
+		return 0;
+	}
+
+	virtual void Stop() override
+	{
+		StopRequested.Set(1);
+		WakeEvent->Trigger();
+	}
+
+private:
+	static const int64 MaxQueuedBytes = 256 * 1024 * 1024;
+
+	IFileHandle* File;
+	FEvent* WakeEvent;
+	FCriticalSection QueueLock;
+	TArray<TArray<uint8>> Queue;
+	int64 QueuedBytes;
+	FThreadSafeCounter Failed;
+	FThreadSafeCounter StopRequested;
+};
+
+FMeshSyncCapture::FMeshSyncCapture(FMeshSyncServer* InServer)
+	: Server(InServer)
+	, Writer(NULL)
+	, WriterThread(NULL)
+	, RecordStartCycles(0)
+	, Replay(NULL)
+	, ReplayThread(NULL)
+{
+}
+
+FMeshSyncCapture::~FMeshSyncCapture()
+{
+	StopReplay();
+	StopRecording();
+}
+
+bool FMeshSyncCapture::StartRecording(const FString& Path)
+{
+	if (Recording.GetValue()) {
+		UE_LOG(LogMeshSync, Warning, TEXT("A MeshSync capture is already being recorded"));
+		return false;
+	}
+	// Closes a recording that stopped on a write failure.
+	StopRecording();
+
+	IPlatformFile& PlatformFile = FPlatformFileManager::Get().GetPlatformFile();
+	PlatformFile.CreateDirectoryTree(*FPaths::GetPath(Path));
+	IFileHandle* File = PlatformFile.OpenWrite(*Path);
+	if (!File) {
+		UE_LOG(LogMeshSync, Warning, TEXT("Unable to create capture %s"), *Path);
+		return false;
+	}
+
+	FMeshSyncCaptureHeader Header;
+	Header.Magic = MeshSyncCaptureMagic;
+	Header.ProtocolVersion = MeshSyncProtocolVersion;
+	Header.Reserved = 0;
+	File->Write((const uint8*)&Header, sizeof(Header));
+
+	FScopeLock Lock(&RecordLock);
+	Writer = new FMeshSyncCaptureWriter(File);
+	WriterThread = FRunnableThread::Create(Writer, TEXT("MeshSyncCaptureWriter"));
+	RecordStartCycles = FPlatformTime::Cycles64();
+	Recording.Set(1);
+	UE_LOG(LogMeshSync, Display, TEXT("Recording MeshSync frames to %s"), *Path);
+	return true;
+}
+
+void FMeshSyncCapture::StopRecording()
+{
+	FMeshSyncCaptureWriter* OldWriter = NULL;
+	FRunnableThread* OldThread = NULL;
+	{
+		FScopeLock Lock(&RecordLock);
+		Recording.Set(0);
+		Swap(OldWriter, Writer);
+		Swap(OldThread, WriterThread);
+	}
+	if (OldThread) {
+		// Waits for the queued frames to be written.
+		OldThread->Kill(true);
+		delete OldThread;
+	}
+	if (OldWriter) {
+		delete OldWriter;
+		UE_LOG(LogMeshSync, Display, TEXT("MeshSync capture stopped"));
+	}
+}
+
+void FMeshSyncCapture::Record(uint32 ConnectionId, const FMeshSyncFrame& Frame)
+{
+	if (!Recording.GetValue()) {
+		return;
+	}
+
+	FMeshSyncCaptureRecord Record;
+	Record.TimeMicroseconds = Frame.ReceiveCycles > RecordStartCycles ?
+		(uint64)((Frame.ReceiveCycles - RecordStartCycles) * FPlatformTime::GetSecondsPerCycle64() * 1000000.0) : 0;
+	Record.ConnectionId = ConnectionId;
+	Record.Command = Frame.Command;
+	Record.Length = Frame.Body.Num();
+	Record.Reserved = 0;
+	TArray<uint8> Chunk;
+	Chunk.SetNumUninitialized(sizeof(Record) + Frame.Body.Num());
+	FMemory::Memcpy(Chunk.GetData(), &Record, sizeof(Record));
+	FMemory::Memcpy(Chunk.GetData() + sizeof(Record), Frame.Body.GetData(), Frame.Body.Num());
+
+	FScopeLock Lock(&RecordLock);
+	if (Writer && !Writer->Enqueue(MoveTemp(Chunk))) {
+		// The writer is joined by StopRecording, not here, the reactor must not wait on the disk.
+		UE_LOG(LogMeshSync, Warning, TEXT("MeshSync capture fell behind or failed, recording stopped"));
+		Recording.Set(0);
+	}
+}
+
+bool FMeshSyncCapture::StartReplay(const FString& Path, bool bPaced)
+{
+	if (Replay && !Replay->IsDone()) {
+		UE_LOG(LogMeshSync, Warning, TEXT("A MeshSync capture is already being replayed"));
+		return false;
+	}
+	StopReplay();
+
+	Replay = new FMeshSyncReplay(Server, Path, bPaced);
+	ReplayThread = FRunnableThread::Create(Replay, TEXT("MeshSyncReplay"));
+	return true;
+}
+
+void FMeshSyncCapture::StopReplay()
+{
+	if (ReplayThread) {
+		ReplayThread->Kill(true);
+		delete ReplayThread;
+		ReplayThread = NULL;
+	}
+	delete Replay;
+	Replay = NULL;
+}
+
+namespace
+{
+	FMeshSyncServer* GetMeshSyncServer()
+	{
+		return FModuleManager::GetModuleChecked<FMeshSyncModule>("MeshSync").GetServer();
+	}
+
+	void CaptureCommand(const TArray<FString>& Args)
+	{
+		FMeshSyncServer* Server = GetMeshSyncServer();
+		if (!Server) {
+			return;
+		}
+		if (Args.Num() > 0 && Args[0] == TEXT("Stop")) {
+			Server->GetCapture().StopRecording();
+			return;
+		}
+
+		FString File = FPaths::ProjectSavedDir() / TEXT("MeshSync/Captures") / (FDateTime::Now().ToString() + TEXT(".mscap"));
+		FParse::Value(*FString::Join(Args, TEXT(" ")), TEXT("File="), File);
+		Server->GetCapture().StartRecording(File);
+	}
+
+	void ReplayCommand(const TArray<FString>& Args)
+	{
+		FMeshSyncServer* Server = GetMeshSyncServer();
+		if (!Server) {
+			return;
+		}
+
+		const FString Params = FString::Join(Args, TEXT(" "));
+		FString File;
+		bool bPaced = false;
+		if (!FParse::Value(*Params, TEXT("File="), File)) {
+			UE_LOG(LogMeshSync, Warning, TEXT("Usage: MeshSync.Replay File=<capture> [Paced=true]"));
+			return;
+		}
+		FParse::Bool(*Params, TEXT("Paced="), bPaced);
+		Server->GetCapture().StartReplay(File, bPaced);
+	}
+}
+
+static FAutoConsoleCommand MeshSyncCaptureCommand(
+	TEXT("MeshSync.Capture"),
+	TEXT("Records every frame MeshSync receives, with timestamps, until MeshSync.Capture Stop.\n")
+	TEXT("MeshSync.Capture [File=<capture>] | Stop"),
+	FConsoleCommandWithArgsDelegate::CreateStatic(&CaptureCommand));
+
+static FAutoConsoleCommand MeshSyncReplayCommand(
+	TEXT("MeshSync.Replay"),
+	TEXT("Decodes and imports a recorded MeshSync session as fast as possible, or at its original pace.\n")
+	TEXT("MeshSync.Replay File=<capture> [Paced=true]"),
+	FConsoleCommandWithArgsDelegate::CreateStatic(&ReplayCommand));
@@ -0,0 +1,73 @@
+// Copyright 1998-2019 Epic Games, Inc. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "HAL/ThreadSafeCounter.h"
+#include "MeshSyncProtocol.h"
+
+class FMeshSyncServer;
+class FMeshSyncReplay;
+class FMeshSyncCaptureWriter;
+class FRunnableThread;
+struct FMeshSyncFrame;
+
+const uint64 MeshSyncCaptureMagic = 0x504143434e59534d; // "MSYNCCAP"
+
+// Start of a capture file.
+struct FMeshSyncCaptureHeader
+{
+	uint64 Magic;
+	uint32 ProtocolVersion;
+	uint32 Reserved;
+};
+
+// Precedes every recorded frame body.
+struct FMeshSyncCaptureRecord
+{
+	// Time the frame was received, relative to the start of the recording.
+	uint64 TimeMicroseconds;
+	uint32 ConnectionId;
+	EMeshSyncCommand Command;
+	uint32 Length;
+	uint32 Reserved;
+};
+
+/**
+ * Tees received frames into a capture file and plays capture files back
+ * through replay connections, so a session can be profiled or debugged
+ * without the client that produced it.
+ */
+class FMeshSyncCapture
+{
+public:
+	FMeshSyncCapture(FMeshSyncServer* InServer);
+	~FMeshSyncCapture();
+
+	bool StartRecording(const FString& Path);
+	void StopRecording();
+
+	/**
+	 * Appends a frame to the recording if there is one, called by the reactor as each frame completes.
+	 * Frames are stamped and ordered here, a writer thread puts them on disk.
+	 */
+	void Record(uint32 ConnectionId, const FMeshSyncFrame& Frame);
+
+	/** Replays a capture on a background thread, at full speed or at the pace it was recorded. */
+	bool StartReplay(const FString& Path, bool bPaced);
+	void StopReplay();
+
+private:
+	FMeshSyncServer* Server;
+
+	// Guards the writer, never held across a disk write.
+	FCriticalSection RecordLock;
+	FMeshSyncCaptureWriter* Writer;
+	FRunnableThread* WriterThread;
+	uint64 RecordStartCycles;
+	// Lets the reactor skip the lock while nothing is recorded.
+	FThreadSafeCounter Recording;
+
+	FMeshSyncReplay* Replay;
+	FRunnableThread* ReplayThread;
+};
@@ -0,0 +1,606 @@
+// Copyright 1998-2019 Epic Games, Inc. All Rights Reserved.
+
+#include "MeshSyncCommitQueue.h"
+#include "MeshSync.h"
+#include "MeshSyncSettings.h"
+#include "MeshSyncServer.h"
+#include "MeshSyncPreprocess.h"
+#include "MeshSyncMerge.h"
+#include "MeshSyncAssetIndex.h"
+#include "MeshSyncMaterialResolver.h"
+#include "MeshSyncPalette.h"
+#include "MeshSyncBenchmark.h"
+#include "MeshSyncStats.h"
+
+#include "Containers/Ticker.h"
+#include "Editor.h"
+
+#include "Materials/MaterialInstanceConstant.h"
+#include "Factories/MaterialInstanceConstantFactoryNew.h"
+#include "Engine/Texture.h"
+#include "Engine/Texture2D.h"
+#include "MaterialShared.h"
+
+#include "RawMesh.h"
+#include "StaticMeshResources.h"
+#include "PhysicsEngine/BodySetup.h"
+#include "AssetRegistryModule.h"
+#include "Engine/StaticMesh.h"
+#include "Package.h"
+#include "Misc/PackageName.h"
+#include "UObject/UObjectHash.h"
+#include "UObject/UObjectIterator.h"
+
+// Tells the client that sent an item how its commit went, if it is still connected.
+static void RespondCommitted(const FMeshSyncConnectionWeakPtr& Requester, uint32 RequestId, UObject* Asset, EMeshSyncResponse NoAssetStatus)
+{
+	if (FMeshSyncConnectionPtr Connection = Requester.Pin())
+	{
+		Connection->Respond(RequestId, Asset ? EMeshSyncResponse::Committed : NoAssetStatus, Asset ? Asset->GetPathName() : FString());
+	}
+}
+
+// Parameters the MeshSync parent materials expose.
+static const FName BaseColorParameter(TEXT("BaseColor"));
+static const FName RoughnessParameter(TEXT("Roughness"));
+static const FName MetallicParameter(TEXT("Metallic"));
+static const FName BaseColorMapParameter(TEXT("BaseColorMap"));
+static const FName NormalMapParameter(TEXT("NormalMap"));
+static const FName PaletteTextureParameter(TEXT("PaletteTexture"));
+
+FMeshSyncCommitQueue::FMeshSyncCommitQueue(FMeshSyncServer* InServer)
+	: Server(InServer)
+	, Self(MakeShareable(new FMeshSyncCommitQueue*(this)))
+	, Scene(InServer->MainPackage() + TEXT("Levels/"))
+{
+	TickHandle = FTicker::GetCoreTicker().AddTicker(FTickerDelegate::CreateRaw(this, &FMeshSyncCommitQueue::Tick));
+}
+
+FMeshSyncCommitQueue::~FMeshSyncCommitQueue()
+{
+	FTicker::GetCoreTicker().RemoveTicker(TickHandle);
+	Self.Reset();
+
+	FPendingCommit Commit;
+	while (Pending.Dequeue(Commit))
+	{
+		if (Commit.Mesh)
+		{
+			Server->ReleaseInFlight(*Commit.Mesh);
+			Server->GetDescPool().Release(Commit.Mesh);
+		}
+		delete Commit.Material;
+	}
+}
+
+void FMeshSyncCommitQueue::EnqueueMesh(FSyncedMeshDesc* Desc)
+{
+	FPendingCommit Commit = { Desc, NULL };
+	NumPending.Increment();
+	INC_DWORD_STAT(STAT_MeshSync_CommitQueueDepth);
+	Pending.Enqueue(Commit);
+}
+
+void FMeshSyncCommitQueue::EnqueueMaterial(FSyncedMaterialDesc* Desc)
+{
+	FPendingCommit Commit = { NULL, Desc };
+	NumPending.Increment();
+	INC_DWORD_STAT(STAT_MeshSync_CommitQueueDepth);
+	Pending.Enqueue(Commit);
+}
+
+bool FMeshSyncCommitQueue::Tick(float DeltaTime)
+{
+	// Materials resolved by the last batch or by preloading become visible to the workers.
+	Server->GetMaterialResolver().Publish();
+	const UMeshSyncSettings* Settings = GetDefault<UMeshSyncSettings>();
+	if (Settings->bSaveInBackground)
+	{
+		Saver.Tick(Settings->SaveTimeBudgetMs / 1000.0);
+	}
+	if (Pending.IsEmpty())
+	{
+		return true;
+	}
+
+	MESHSYNC_SCOPE(STAT_MeshSync_CommitBatch);
+	// Benchmark assets stay out of the level, the registry and the saver.
+	const bool bBenchmarking = Server->IsBenchmarking();
+	const double StartTime = FPlatformTime::Seconds();
+	const double TimeBudget = Settings->CommitTimeBudgetMs / 1000.0;
+
+	TArray<UObject*> Created;
+	TArray<UObject*> Committed;
+	int32 NumCommitted = 0;
+	FPendingCommit Commit;
+	// Always commit at least one item so a tiny budget cannot stall the queue.
+	while (NumCommitted < Settings->MaxCommitsPerFrame && Pending.Dequeue(Commit))
+	{
+		NumPending.Decrement();
+		DEC_DWORD_STAT(STAT_MeshSync_CommitQueueDepth);
+		NumCommitted++;
+
+		UObject* Asset = NULL;
+		bool bCreated = false;
+		{
+			FMeshSyncStageScope CommitScope(EMeshSyncStage::Commit);
+			if (Commit.Mesh && Commit.Mesh->bRemoved)
+			{
+				Scene.RemoveTile(Commit.Mesh->Name);
+				Server->GetAssetIndex().RemoveTile(Commit.Mesh->Name);
+				Server->GetMerger().OnCellMeshCommitted(*Commit.Mesh, true);
+				Server->GetDescPool().Release(Commit.Mesh);
+			}
+			else if (Commit.Mesh)
+			{
+				UStaticMesh* StaticMesh = CommitMesh(*Commit.Mesh, bCreated);
+				if (StaticMesh && Settings->bPlaceTilesInLevel && !bBenchmarking)
+				{
+					Scene.PlaceTile(StaticMesh, *Commit.Mesh);
+				}
+				Asset = StaticMesh;
+				RespondCommitted(Commit.Mesh->Requester, Commit.Mesh->RequestId, Asset, EMeshSyncResponse::Failed);
+				if (Commit.Mesh->MergeBatch.IsValid())
+				{
+					Server->GetMerger().OnCellMeshCommitted(*Commit.Mesh, StaticMesh != NULL);
+				}
+				Server->ReleaseInFlight(*Commit.Mesh);
+				Server->GetDescPool().Release(Commit.Mesh);
+				FMeshSyncStageTimes::Get().MeshesCommitted.Increment();
+			}
+			else
+			{
+				Asset = CommitMaterial(*Commit.Material, bCreated);
+				// Base materials are not synced.
+				RespondCommitted(Commit.Material->Requester, Commit.Material->RequestId, Asset, EMeshSyncResponse::Unchanged);
+				delete Commit.Material;
+			}
+		}
+		if (Asset)
+		{
+			Committed.AddUnique(Asset);
+			if (bCreated)
+			{
+				Created.Add(Asset);
+			}
+		}
+
+		if (FPlatformTime::Seconds() - StartTime >= TimeBudget)
+		{
+			break;
+		}
+	}
+
+	if (Settings->bUsePaletteMaterials)
+	{
+		FMeshSyncPalette& Palette = Server->GetPalette();
+		UTexture2D* PaletteTexture = Palette.GetTexture();
+		Palette.Flush();
+		if (PaletteTexture && Settings->bSaveInBackground && !bBenchmarking)
+		{
+			Saver.Enqueue(PaletteTexture->GetOutermost());
+		}
+	}
+	if (MaterialUpdate)
+	{
+		MESHSYNC_SCOPE(STAT_MeshSync_CommitMaterial);
+		MaterialUpdate.Reset();
+	}
+	{
+		MESHSYNC_SCOPE(STAT_MeshSync_PlaceTiles);
+		Scene.Flush();
+	}
+	Server->GetAssetIndex().Flush(5.0);
+
+	if (bBenchmarking)
+	{
+		return true;
+	}
+	// Registry and content browser are notified once for the whole batch.
+	for (UObject* Asset : Created)
+	{
+		FAssetRegistryModule::AssetCreated(Asset);
+	}
+	if (Settings->bSaveInBackground)
+	{
+		for (UObject* Asset : Committed)
+		{
+			Saver.Enqueue(Asset->GetOutermost());
+		}
+	}
+	if (Committed.Num() > 0 && GEditor)
+	{
+		GEditor->SyncBrowserToObjects(Committed);
+	}
+	return true;
+}
+
+void FMeshSyncCommitQueue::ReleasePackages(const FString& Path)
+{
+	for (auto It = MaterialsByParameters.CreateIterator(); It; ++It)
+	{
+		if (!It.Value().IsValid() || It.Value()->GetOutermost()->GetName().StartsWith(Path))
+		{
+			It.RemoveCurrent();
+		}
+	}
+	for (TObjectIterator<UPackage> It; It; ++It)
+	{
+		UPackage* Package = *It;
+		if (Package->GetName().StartsWith(Path))
+		{
+			ForEachObjectWithOuter(Package, [](UObject* Object) { Object->ClearFlags(RF_Standalone | RF_Public); });
+			Package->SetDirtyFlag(false);
+		}
+	}
+}
+
+UStaticMesh* FMeshSyncCommitQueue::CommitMesh(FSyncedMeshDesc& Desc, bool& bOutCreated)
+{
+	bOutCreated = false;
+
+	FMeshSyncAssetIndex& AssetIndex = Server->GetAssetIndex();
+	FMeshSyncTileRecord TileRecord;
+	TileRecord.ContentHash = Desc.ContentHash;
+	TileRecord.Revision = Desc.Revision;
+
+	if (GetDefault<UMeshSyncSettings>()->bDeduplicateMeshes)
+	{
+		FString ExistingPath;
+		if (AssetIndex.FindMesh(Desc.ContentHash, ExistingPath))
+		{
+			if (UStaticMesh* Existing = LoadObject<UStaticMesh>(nullptr, *ExistingPath, nullptr, LOAD_NoWarn))
+			{
+				UE_LOG(LogMeshSync, Verbose, TEXT("Mesh %s shares its geometry with %s"), *Desc.Name, *ExistingPath);
+				TileRecord.ObjectPath = ExistingPath;
+				AssetIndex.SetTile(Desc.Name, TileRecord);
+				return Existing;
+			}
+			// Deleted since it was indexed, import it again.
+			AssetIndex.RemoveMesh(Desc.ContentHash);
+		}
+	}
+
+	UStaticMesh* StaticMesh = NULL;
+	if (Desc.bUpdateInPlace)
+	{
+		// Only a mesh no other tile resolves to may be rebuilt in place.
+		FMeshSyncTileRecord Previous;
+		if (AssetIndex.FindTile(Desc.Name, Previous) && AssetIndex.CountTilesUsing(Previous.ObjectPath) == 1)
+		{
+			StaticMesh = LoadObject<UStaticMesh>(nullptr, *Previous.ObjectPath, nullptr, LOAD_NoWarn);
+			FString PreviousPath;
+			if (StaticMesh && AssetIndex.FindMesh(Previous.ContentHash, PreviousPath) && PreviousPath == Previous.ObjectPath)
+			{
+				AssetIndex.RemoveMesh(Previous.ContentHash);
+			}
+		}
+	}
+
+	if (!StaticMesh)
+	{
+		StaticMesh = CreateMesh(Desc);
+		if (!StaticMesh) {
+			return NULL;
+		}
+		bOutCreated = true;
+	}
+
+	BuildMesh(StaticMesh, Desc);
+
+	TileRecord.ObjectPath = StaticMesh->GetPathName();
+	AssetIndex.AddMesh(Desc.ContentHash, TileRecord.ObjectPath);
+	AssetIndex.SetTile(Desc.Name, TileRecord);
+	return StaticMesh;
+}
+
+UStaticMesh* FMeshSyncCommitQueue::CreateMesh(FSyncedMeshDesc& Desc)
+{
+	FString MeshPackageName = Server->MainPackage() + Desc.Name;
+	UPackage* Package = FindPackage(nullptr, *MeshPackageName);
+	if (Package && Desc.bUpdateInPlace) {
+		// The tile's package holds a mesh other tiles still use, keep it and branch off.
+		FString BaseName = MeshPackageName;
+		for (int32 Suffix = 1; Package || FPackageName::DoesPackageExist(MeshPackageName); Suffix++) {
+			MeshPackageName = FString::Printf(TEXT("%s_%d"), *BaseName, Suffix);
+			Package = FindPackage(nullptr, *MeshPackageName);
+		}
+	}
+	if (!Package) {
+		MESHSYNC_SCOPE(STAT_MeshSync_CreatePackage);
+		Package = CreatePackage(nullptr, *MeshPackageName);
+	} else { // already exists
+		UE_LOG(LogMeshSync, Display, TEXT("Mesh %s is already existed!"), *MeshPackageName);
+		return NULL;
+	}
+
+	FName StaticMeshName = MakeUniqueObjectName(Package, UStaticMesh::StaticClass(), FName(*Desc.Name));
+	UStaticMesh* StaticMesh = NewObject<UStaticMesh>(Package, StaticMeshName, RF_Public | RF_Standalone | RF_Transactional);
+	checkSlow(StaticMesh);
+	return StaticMesh;
+}
+
+void FMeshSyncCommitQueue::BuildMesh(UStaticMesh* StaticMesh, FSyncedMeshDesc& Desc)
+{
+	StaticMesh->PreEditChange(nullptr);
+
+	StaticMesh->SourceModels.Empty();
+
+	// Saving mesh in the StaticMesh
+	new(StaticMesh->SourceModels) FStaticMeshSourceModel();
+	StaticMesh->SourceModels[0].RawMeshBulkData->SaveRawMesh(Desc.RawMesh);
+	// Keyed by content, render data built for the same mesh in any session comes from the derived data cache.
+	StaticMesh->SourceModels[0].RawMeshBulkData->UseHashAsGuid(StaticMesh);
+
+	FStaticMeshSourceModel& SrcModel = StaticMesh->SourceModels[0];
+
+	// Model Configuration
+	FMeshSyncPreprocessor::GetBuildSettings(Desc, SrcModel.BuildSettings);
+	if (Desc.LightmapCoordinateIndex != INDEX_NONE) {
+		StaticMesh->LightMapCoordinateIndex = Desc.LightmapCoordinateIndex;
+		StaticMesh->LightMapResolution = GetDefault<UMeshSyncSettings>()->LightmapResolution;
+	}
+
+	// Assign the Materials to the Slots (optional
+	StaticMesh->StaticMaterials.Empty(Desc.MaterialSlots.Num());
+	StaticMesh->SectionInfoMap.Clear();
+	for (int32 i = 0; i < Desc.MaterialSlots.Num(); i++) {
+		// with slots?
+		FStaticMaterial Material;
+		if (Desc.SlotMaterials.IsValidIndex(i)) {
+			Material.MaterialInterface = Cast<UMaterialInterface>(Desc.SlotMaterials[i].ResolveObject());
+		}
+		if (!Material.MaterialInterface) { // search imported MIC by name
+			Material.MaterialInterface = Server->FindMaterial(FMeshSyncMaterialResolver::GetSlotMaterialName(Desc.MaterialSlots[i]));
+		}
+		StaticMesh->StaticMaterials.Add(Material);
+		StaticMesh->SectionInfoMap.Set(0, i, FMeshSectionInfo(i));
+	}
+
+	// LODs reduced on the workers are stored as is, otherwise the build reduces LOD 0.
+	const TArray<FMeshSyncLODLevel>& Levels = GetDefault<UMeshSyncSettings>()->LODs;
+	for (int32 LODIndex = 0; LODIndex < Levels.Num(); LODIndex++) {
+		FStaticMeshSourceModel* LODModel = new(StaticMesh->SourceModels) FStaticMeshSourceModel();
+		if (Desc.LODMeshes.IsValidIndex(LODIndex)) {
+			LODModel->RawMeshBulkData->SaveRawMesh(Desc.LODMeshes[LODIndex]);
+			LODModel->RawMeshBulkData->UseHashAsGuid(StaticMesh);
+		} else {
+			LODModel->ReductionSettings.PercentTriangles = Levels[LODIndex].PercentTriangles;
+		}
+		FMeshSyncPreprocessor::GetBuildSettings(Desc, LODModel->BuildSettings);
+		LODModel->ScreenSize.Default = Levels[LODIndex].ScreenSize;
+		for (int32 i = 0; i < Desc.MaterialSlots.Num(); i++) {
+			StaticMesh->SectionInfoMap.Set(LODIndex + 1, i, FMeshSectionInfo(i));
+		}
+	}
+	StaticMesh->bAutoComputeLODScreenSize = Levels.Num() == 0;
+
+	StaticMesh->MarkPackageDirty();
+	//Package->FullyLoad();
+
+	// Processing the StaticMesh and Marking it as not saved
+	StaticMesh->ImportVersion = EImportStaticMeshVersion::LastVersion;
+	const bool bCookAsync = GetDefault<UMeshSyncSettings>()->bCookCollisionAsync;
+	if (bCookAsync)
+	{
+		// Without a body setup the build has no collision to cook, it is set up once render data exists.
+		StaticMesh->BodySetup = nullptr;
+	}
+	else
+	{
+		MESHSYNC_SCOPE(STAT_MeshSync_CreateBodySetup);
+		SetupCollision(StaticMesh, Desc);
+	}
+	StaticMesh->SetLightingGuid();
+	{
+		MESHSYNC_SCOPE(STAT_MeshSync_PostEditChange);
+		StaticMesh->PostEditChange();
+	}
+
+	if (bCookAsync)
+	{
+		MESHSYNC_SCOPE(STAT_MeshSync_CreateBodySetup);
+		SetupCollision(StaticMesh, Desc);
+		StaticMesh->CreateNavCollision(true);
+		UBodySetup* BodySetup = StaticMesh->BodySetup;
+		if (BodySetup->CollisionTraceFlag == CTF_UseComplexAsSimple || BodySetup->AggGeom.ConvexElems.Num() > 0)
+		{
+			Scene.DeferMesh(StaticMesh);
+			TWeakPtr<FMeshSyncCommitQueue*, ESPMode::ThreadSafe> WeakSelf = Self;
+			TWeakObjectPtr<UStaticMesh> WeakMesh = StaticMesh;
+			BodySetup->CreatePhysicsMeshesAsync(FOnAsyncPhysicsCookFinished::CreateLambda([WeakSelf, WeakMesh]()
+			{
+				TSharedPtr<FMeshSyncCommitQueue*, ESPMode::ThreadSafe> Queue = WeakSelf.Pin();
+				if (Queue.IsValid() && WeakMesh.IsValid())
+				{
+					(*Queue)->Scene.ResumeMesh(WeakMesh.Get());
+					(*Queue)->Scene.Flush();
+				}
+			}));
+		}
+		else
+		{
+			// Boxes need no cooking.
+			BodySetup->CreatePhysicsMeshes();
+		}
+	}
+}
+
+void FMeshSyncCommitQueue::SetupCollision(UStaticMesh* StaticMesh, FSyncedMeshDesc& Desc)
+{
+	const EMeshSyncCollision Collision = GetDefault<UMeshSyncSettings>()->Collision;
+	StaticMesh->CreateBodySetup();
+	UBodySetup* BodySetup = StaticMesh->BodySetup;
+	BodySetup->RemoveSimpleCollision();
+
+	if (Collision != EMeshSyncCollision::ComplexAsSimple && Desc.CollisionHull.Num() == 0)
+	{
+		// Not preprocessed on a worker.
+		FMeshSyncPreprocessor::FitCollision(Desc);
+	}
+	if (Collision == EMeshSyncCollision::ComplexAsSimple || Desc.CollisionHull.Num() == 0)
+	{
+		BodySetup->CollisionTraceFlag = CTF_UseComplexAsSimple;
+	}
+	else if (Collision == EMeshSyncCollision::Box)
+	{
+		const FBox Bounds(Desc.CollisionHull);
+		const FVector Size = Bounds.GetSize();
+		FKBoxElem Box(Size.X, Size.Y, Size.Z);
+		Box.Center = Bounds.GetCenter();
+		BodySetup->AggGeom.BoxElems.Add(Box);
+		BodySetup->CollisionTraceFlag = CTF_UseSimpleAsComplex;
+	}
+	else
+	{
+		FKConvexElem Convex;
+		Convex.VertexData = Desc.CollisionHull;
+		Convex.UpdateElemBox();
+		BodySetup->AggGeom.ConvexElems.Add(Convex);
+		BodySetup->CollisionTraceFlag = CTF_UseSimpleAsComplex;
+	}
+
+	// Identical content cooks to identical data, a stable guid lets the derived data cache share it.
+	const uint32* HashWords = (const uint32*)Desc.ContentHash.Hash;
+	BodySetup->BodySetupGuid = FGuid(HashWords[0], HashWords[1], HashWords[2], HashWords[3] ^ (uint32)Collision);
+	BodySetup->bHasCookedCollisionData = true;
+	BodySetup->InvalidatePhysicsData();
+}
+
+UMaterialInstanceConstant* FMeshSyncCommitQueue::CommitMaterial(FSyncedMaterialDesc& Desc, bool& bOutCreated)
+{
+	MESHSYNC_SCOPE(STAT_MeshSync_CommitMaterial);
+	bOutCreated = false;
+	if (Desc.Name.StartsWith(TEXT("MT_")))
+	{
+		return NULL;
+	}
+
+	// need build mic and reduce materials
+	uint32 MaterialCatagory = (Desc.MaterialId >> 16);
+
+	FString RealName = TEXT("MT_");
+	RealName += Desc.Name;
+
+	if (GetDefault<UMeshSyncSettings>()->bUsePaletteMaterials)
+	{
+		// The color went to the palette, the material resolves to its category's palette instance.
+		UMaterialInstanceConstant* MIC = GetPaletteMaterial(MaterialCatagory, bOutCreated);
+		if (MIC)
+		{
+			Server->AddMaterial(RealName, MIC);
+		}
+		return MIC;
+	}
+
+	if (TWeakObjectPtr<UMaterialInstanceConstant>* Shared = MaterialsByParameters.Find(Desc.ParameterHash))
+	{
+		if (UMaterialInstanceConstant* MIC = Shared->Get())
+		{
+			UE_LOG(LogMeshSync, Verbose, TEXT("Material %s shares its parameters with %s"), *RealName, *MIC->GetName());
+			Server->AddMaterial(RealName, MIC);
+			return MIC;
+		}
+	}
+
+	FString MaterialPackageName = Server->MaterialsPackage() + RealName;
+	if (FindPackage(nullptr, *MaterialPackageName) || FPackageName::DoesPackageExist(MaterialPackageName)) { // already has this material
+		UE_LOG(LogMeshSync, Display, TEXT("Material %s is already existed!"), *MaterialPackageName);
+		return Cast<UMaterialInstanceConstant>(Server->FindMaterial(RealName));
+	}
+
+	UMaterialInstanceConstant* MIC = CreateMaterialInstance(RealName, MaterialCatagory);
+	ApplyMaterialParameters(MIC, Desc);
+	UpdateMaterialInstance(MIC);
+	Server->AddMaterial(RealName, MIC);
+	MaterialsByParameters.Add(Desc.ParameterHash, MIC);
+	bOutCreated = true;
+	return MIC;
+}
+
+UMaterialInstanceConstant* FMeshSyncCommitQueue::GetPaletteMaterial(uint32 MaterialCatagory, bool& bOutCreated)
+{
+	static const TCHAR* CategoryNames[] = { TEXT("Terrain"), TEXT("Decor"), TEXT("Knobs"), TEXT("Water") };
+	const FString RealName = MaterialCatagory < ARRAY_COUNT(CategoryNames) ?
+		FString::Printf(TEXT("MT_Palette_%s"), CategoryNames[MaterialCatagory]) :
+		FString::Printf(TEXT("MT_Palette_%u"), MaterialCatagory);
+
+	FString MaterialPackageName = Server->MaterialsPackage() + RealName;
+	if (FindPackage(nullptr, *MaterialPackageName) || FPackageName::DoesPackageExist(MaterialPackageName))
+	{
+		return Cast<UMaterialInstanceConstant>(Server->FindMaterial(RealName));
+	}
+
+	UMaterialInstanceConstant* MIC = CreateMaterialInstance(RealName, MaterialCatagory);
+	MIC->SetTextureParameterValueEditorOnly(PaletteTextureParameter, Server->GetPalette().GetTexture());
+	UpdateMaterialInstance(MIC);
+	Server->AddMaterial(RealName, MIC);
+	bOutCreated = true;
+	return MIC;
+}
+
+UMaterialInstanceConstant* FMeshSyncCommitQueue::CreateMaterialInstance(const FString& RealName, uint32 MaterialCatagory)
+{
+	UPackage* Package = CreatePackage(nullptr, *(Server->MaterialsPackage() + RealName));
+
+	FName MaterialInstanceName = MakeUniqueObjectName(Package, UMaterialInstanceConstant::StaticClass(), FName(*RealName));
+	UMaterialInstanceConstantFactoryNew* Factory = NewObject<UMaterialInstanceConstantFactoryNew>();
+	switch (MaterialCatagory) {
+	case MAT_MS_TERRAIN:
+		Factory->InitialParent = Server->FindMaterial(TEXT("MT_Terrain"));
+		break;
+	case MAT_MS_DECOR:
+		Factory->InitialParent = Server->FindMaterial(TEXT("MT_Decor"));
+		break;
+	case MAT_MS_KNOBS:
+		Factory->InitialParent = Server->FindMaterial(TEXT("MT_Knobs"));
+		break;
+	case MAT_MS_WATER:
+		//Factory->InitialParent = Material;
+		break;
+	}
+	UMaterialInstanceConstant* MIC = (UMaterialInstanceConstant*)Factory->FactoryCreateNew(
+		UMaterialInstanceConstant::StaticClass(), 
+		Package, MaterialInstanceName, RF_Standalone | RF_Public | RF_Transactional, NULL, GWarn);
+	checkSlow(MIC);
+	Package->SetDirtyFlag(true);
+	return MIC;
+}
+
+void FMeshSyncCommitQueue::UpdateMaterialInstance(UMaterialInstanceConstant* MIC)
+{
+	// Instead of a PostEditChange per instance, which recreates every render state each time.
+	if (!MaterialUpdate)
+	{
+		MaterialUpdate = MakeUnique<FMaterialUpdateContext>();
+	}
+	MIC->UpdateStaticPermutation(MaterialUpdate.Get());
+	MaterialUpdate->AddMaterialInstance(MIC);
+}
+
+void FMeshSyncCommitQueue::ApplyMaterialParameters(UMaterialInstanceConstant* MIC, const FSyncedMaterialDesc& Desc)
+{
+	MIC->SetVectorParameterValueEditorOnly(BaseColorParameter, FLinearColor(Desc.BaseColor));
+	MIC->SetScalarParameterValueEditorOnly(RoughnessParameter, Desc.Roughness);
+	MIC->SetScalarParameterValueEditorOnly(MetallicParameter, Desc.Metallic);
+
+	auto SetTexture = [this, MIC](const FName& Parameter, const FString& Name)
+	{
+		if (Name.IsEmpty())
+		{
+			return;
+		}
+		// Bare names are looked up next to the synced materials.
+		const FString TexturePath = Name.StartsWith(TEXT("/")) ? Name : Server->MaterialsPackage() + Name;
+		if (UTexture* Texture = LoadObject<UTexture>(nullptr, *TexturePath, nullptr, LOAD_NoWarn))
+		{
+			MIC->SetTextureParameterValueEditorOnly(Parameter, Texture);
+		}
+		else
+		{
+			UE_LOG(LogMeshSync, Warning, TEXT("Texture %s for %s not found!"), *TexturePath, *MIC->GetName());
+		}
+	};
+	SetTexture(BaseColorMapParameter, Desc.BaseColorMap);
+	SetTexture(NormalMapParameter, Desc.NormalMap);
+}
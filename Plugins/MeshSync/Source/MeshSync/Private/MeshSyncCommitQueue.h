@@ -0,0 +1,78 @@
+// Copyright 1998-2019 Epic Games, Inc. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Containers/Queue.h"
+#include "HAL/ThreadSafeCounter.h"
+#include "Misc/SecureHash.h"
+#include "UObject/WeakObjectPtr.h"
+#include "MeshSyncScene.h"
+#include "MeshSyncSaver.h"
+
+class FMeshSyncServer;
+class FSyncedMeshDesc;
+class FSyncedMaterialDesc;
+class UStaticMesh;
+class UMaterialInstanceConstant;
+class FMaterialUpdateContext;
+
+/**
+ * Collects decoded meshes and materials from the worker threads and turns
+ * them into assets on the game thread, a bounded batch per frame so the
+ * editor stays responsive while a large scene streams in. Items commit in
+ * the order they were queued.
+ */
+class FMeshSyncCommitQueue
+{
+public:
+	FMeshSyncCommitQueue(FMeshSyncServer* InServer);
+	~FMeshSyncCommitQueue();
+
+	/** Takes ownership of Desc, callable from any thread. */
+	void EnqueueMesh(FSyncedMeshDesc* Desc);
+	/** Takes ownership of Desc, callable from any thread. */
+	void EnqueueMaterial(FSyncedMaterialDesc* Desc);
+
+	int32 Num() const { return NumPending.GetValue(); }
+
+	/** Forgets the assets committed under Path and leaves them to garbage collection, once a benchmark ends. */
+	void ReleasePackages(const FString& Path);
+
+private:
+	struct FPendingCommit
+	{
+		FSyncedMeshDesc* Mesh;
+		FSyncedMaterialDesc* Material;
+	};
+
+	bool Tick(float DeltaTime);
+
+	/** Resolves, creates or updates the mesh for a tile, bOutCreated is set for new assets. */
+	UStaticMesh* CommitMesh(FSyncedMeshDesc& Desc, bool& bOutCreated);
+	UStaticMesh* CreateMesh(FSyncedMeshDesc& Desc);
+	void BuildMesh(UStaticMesh* StaticMesh, FSyncedMeshDesc& Desc);
+	/** Gives the mesh a body setup for UMeshSyncSettings::Collision, to be cooked by the caller. */
+	void SetupCollision(UStaticMesh* StaticMesh, FSyncedMeshDesc& Desc);
+	/** Resolves or creates the instance for a material, bOutCreated is set for new assets. */
+	UMaterialInstanceConstant* CommitMaterial(FSyncedMaterialDesc& Desc, bool& bOutCreated);
+	/** The instance all materials of a category share when bUsePaletteMaterials is set. */
+	UMaterialInstanceConstant* GetPaletteMaterial(uint32 MaterialCatagory, bool& bOutCreated);
+	UMaterialInstanceConstant* CreateMaterialInstance(const FString& RealName, uint32 MaterialCatagory);
+	void ApplyMaterialParameters(UMaterialInstanceConstant* MIC, const FSyncedMaterialDesc& Desc);
+	/** Queues MIC for the render state update at the end of the batch. */
+	void UpdateMaterialInstance(UMaterialInstanceConstant* MIC);
+
+	FMeshSyncServer* Server;
+	// Collision cook callbacks hold it weakly to find out whether the queue still exists.
+	TSharedPtr<FMeshSyncCommitQueue*, ESPMode::ThreadSafe> Self;
+	TQueue<FPendingCommit, EQueueMode::Mpsc> Pending;
+	FThreadSafeCounter NumPending;
+	FDelegateHandle TickHandle;
+	FMeshSyncScene Scene;
+	FMeshSyncSaver Saver;
+	// Instances created this session by parameter hash, so materials differing only by name share one.
+	TMap<FSHAHash, TWeakObjectPtr<UMaterialInstanceConstant>> MaterialsByParameters;
+	// Open while a batch creates instances, render state is updated once when it closes.
+	TUniquePtr<FMaterialUpdateContext> MaterialUpdate;
+};
@@ -0,0 +1,57 @@
+// Copyright 1998-2019 Epic Games, Inc. All Rights Reserved.
+
+#include "MeshSyncDescPool.h"
+#include "MeshSyncServer.h"
+#include "MeshSyncSettings.h"
+
+FMeshSyncDescPool::FMeshSyncDescPool()
+	: PooledBytes(0)
+{
+	Free.Reserve(MaxPooled);
+}
+
+FMeshSyncDescPool::~FMeshSyncDescPool()
+{
+	for (FSyncedMeshDesc* Desc : Free)
+	{
+		delete Desc;
+	}
+}
+
+FSyncedMeshDesc* FMeshSyncDescPool::Acquire()
+{
+	{
+		FScopeLock ScopeLock(&Lock);
+		if (Free.Num() > 0)
+		{
+			FSyncedMeshDesc* Desc = Free.Pop(false);
+			PooledBytes -= Desc->GetAllocatedSize();
+			return Desc;
+		}
+	}
+	return new FSyncedMeshDesc;
+}
+
+void FMeshSyncDescPool::Release(FSyncedMeshDesc* Desc)
+{
+	if (!Desc)
+	{
+		return;
+	}
+	// Pooled memory is not charged as in flight, keep it a small share of that budget.
+	const SIZE_T MaxBytes = (SIZE_T)GetDefault<UMeshSyncSettings>()->MaxInFlightMemoryMB * 1024 * 1024 / MaxPooledBudgetDivisor;
+	// Measured after the reset, which frees the LODs, so Acquire subtracts the same amount.
+	Desc->Reset();
+	const SIZE_T Size = Desc->GetAllocatedSize();
+	if (Size <= MaxPooledSize)
+	{
+		FScopeLock ScopeLock(&Lock);
+		if (Free.Num() < MaxPooled && PooledBytes + Size <= MaxBytes)
+		{
+			Free.Add(Desc);
+			PooledBytes += Size;
+			return;
+		}
+	}
+	delete Desc;
+}
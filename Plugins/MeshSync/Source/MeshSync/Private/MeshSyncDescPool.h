@@ -0,0 +1,37 @@
+// Copyright 1998-2019 Epic Games, Inc. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Misc/ScopeLock.h"
+
+class FSyncedMeshDesc;
+
+/**
+ * Recycles mesh descriptors between frames. A released descriptor is reset
+ * but keeps its array allocations, so a steady stream of similar tiles
+ * decodes without touching the allocator.
+ */
+class FMeshSyncDescPool
+{
+public:
+	FMeshSyncDescPool();
+	~FMeshSyncDescPool();
+
+	/** Returns a reset descriptor, callable from any thread. */
+	FSyncedMeshDesc* Acquire();
+	/** Takes Desc back, callable from any thread. */
+	void Release(FSyncedMeshDesc* Desc);
+
+	/** Descriptors kept for reuse. */
+	static const int32 MaxPooled = 64;
+	/** Larger descriptors are freed instead of pinning their memory in the pool. */
+	static const SIZE_T MaxPooledSize = 32 * 1024 * 1024;
+	/** All pooled descriptors together keep at most this fraction of MaxInFlightMemoryMB. */
+	static const int32 MaxPooledBudgetDivisor = 8;
+
+private:
+	FCriticalSection Lock;
+	TArray<FSyncedMeshDesc*> Free;
+	SIZE_T PooledBytes;
+};
@@ -0,0 +1,178 @@
+// Copyright 1998-2019 Epic Games, Inc. All Rights Reserved.
+
+#include "MeshSyncMaterialResolver.h"
+#include "MeshSync.h"
+
+#include "AssetRegistryModule.h"
+#include "Materials/MaterialInterface.h"
+#include "Modules/ModuleManager.h"
+#include "UObject/Package.h"
+#include "UObject/UObjectGlobals.h"
+
+FMeshSyncMaterialResolver::FMeshSyncMaterialResolver(const FString& InMaterialsPath)
+	: MaterialsPath(InMaterialsPath)
+	, bDirty(false)
+	, Snapshot(MakeShareable(new FSnapshot))
+	, NumPreloading(0)
+{
+}
+
+FMeshSyncMaterialResolver::~FMeshSyncMaterialResolver()
+{
+	if (AssetAddedHandle.IsValid() && FModuleManager::Get().IsModuleLoaded("AssetRegistry"))
+	{
+		FModuleManager::GetModuleChecked<FAssetRegistryModule>("AssetRegistry").Get().OnAssetAdded().Remove(AssetAddedHandle);
+	}
+	// Pending preloads call back into this object.
+	if (NumPreloading > 0)
+	{
+		FlushAsyncLoading();
+	}
+}
+
+void FMeshSyncMaterialResolver::Preload()
+{
+	IAssetRegistry& AssetRegistry = FModuleManager::LoadModuleChecked<FAssetRegistryModule>("AssetRegistry").Get();
+	AssetAddedHandle = AssetRegistry.OnAssetAdded().AddRaw(this, &FMeshSyncMaterialResolver::OnAssetAdded);
+
+	FString PackagePath = MaterialsPath;
+	PackagePath.RemoveFromEnd(TEXT("/"));
+	FARFilter Filter;
+	Filter.PackagePaths.Add(FName(*PackagePath));
+	Filter.bRecursivePaths = true;
+	Filter.ClassNames.Add(UMaterialInterface::StaticClass()->GetFName());
+	Filter.bRecursiveClasses = true;
+	TArray<FAssetData> Assets;
+	AssetRegistry.GetAssets(Filter, Assets);
+
+	for (const FAssetData& Asset : Assets)
+	{
+		const FString Name = Asset.AssetName.ToString();
+		if (Resolved.Contains(Name))
+		{
+			continue;
+		}
+		const FSoftObjectPath Path = Asset.ToSoftObjectPath();
+		NumPreloading++;
+		LoadPackageAsync(Asset.PackageName.ToString(), FLoadPackageAsyncDelegate::CreateLambda(
+			[this, Name, Path](const FName& PackageName, UPackage* Package, EAsyncLoadingResult::Type Result)
+		{
+			NumPreloading--;
+			UMaterialInterface* Material = Cast<UMaterialInterface>(Path.ResolveObject());
+			if (Result == EAsyncLoadingResult::Succeeded && Material && !Resolved.Contains(Name))
+			{
+				Add(Name, Material);
+			}
+		}));
+	}
+	UE_LOG(LogMeshSync, Display, TEXT("Preloading %d materials from %s"), Assets.Num(), *MaterialsPath);
+}
+
+UMaterialInterface* FMeshSyncMaterialResolver::Find(const FString& Name)
+{
+	if (TWeakObjectPtr<UMaterialInterface>* Found = Resolved.Find(Name))
+	{
+		if (UMaterialInterface* Material = Found->Get())
+		{
+			return Material;
+		}
+		// Deleted since it was resolved.
+		Resolved.Remove(Name);
+		bDirty = true;
+	}
+	if (Missing.Contains(Name))
+	{
+		return NULL;
+	}
+
+	// not found! search in package
+	UMaterialInterface* Material = LoadObject<UMaterialInterface>(nullptr, *(MaterialsPath + Name), nullptr, LOAD_NoWarn);
+	if (Material)
+	{
+		Add(Name, Material);
+	}
+	else
+	{
+		UE_LOG(LogMeshSync, Warning, TEXT("Material %s not found!"), *Name);
+		Missing.Add(Name);
+	}
+	return Material;
+}
+
+void FMeshSyncMaterialResolver::Add(const FString& Name, UMaterialInterface* Material)
+{
+	if (!Material)
+	{
+		return;
+	}
+	Resolved.Add(Name, Material);
+	Missing.Remove(Name);
+	bDirty = true;
+}
+
+void FMeshSyncMaterialResolver::RemoveUnder(const FString& Path)
+{
+	for (auto It = Resolved.CreateIterator(); It; ++It)
+	{
+		UMaterialInterface* Material = It.Value().Get();
+		if (Material && Material->GetOutermost()->GetName().StartsWith(Path))
+		{
+			It.RemoveCurrent();
+			bDirty = true;
+		}
+	}
+}
+
+void FMeshSyncMaterialResolver::Publish()
+{
+	if (!bDirty)
+	{
+		return;
+	}
+	bDirty = false;
+
+	TSharedPtr<FSnapshot, ESPMode::ThreadSafe> NewSnapshot = MakeShareable(new FSnapshot);
+	NewSnapshot->Reserve(Resolved.Num());
+	for (const auto& Pair : Resolved)
+	{
+		if (UMaterialInterface* Material = Pair.Value.Get())
+		{
+			NewSnapshot->Add(Pair.Key, FSoftObjectPath(Material));
+		}
+	}
+	FRWScopeLock ScopeLock(SnapshotLock, SLT_Write);
+	Snapshot = NewSnapshot;
+}
+
+bool FMeshSyncMaterialResolver::Lookup(const FString& Name, FSoftObjectPath& OutPath) const
+{
+	TSharedPtr<const FSnapshot, ESPMode::ThreadSafe> Current;
+	{
+		FRWScopeLock ScopeLock(SnapshotLock, SLT_ReadOnly);
+		Current = Snapshot;
+	}
+	if (const FSoftObjectPath* Path = Current->Find(Name))
+	{
+		OutPath = *Path;
+		return true;
+	}
+	return false;
+}
+
+FString FMeshSyncMaterialResolver::GetSlotMaterialName(const FString& Slot)
+{
+	if (Slot.StartsWith(TEXT("MT_")))
+	{
+		return Slot;
+	}
+	return FString(TEXT("MT_")) + Slot;
+}
+
+void FMeshSyncMaterialResolver::OnAssetAdded(const FAssetData& AssetData)
+{
+	// A material created outside MeshSync may satisfy a name that missed before.
+	if (Missing.Num() > 0 && AssetData.PackagePath.ToString().StartsWith(MaterialsPath.LeftChop(1)))
+	{
+		Missing.Remove(AssetData.AssetName.ToString());
+	}
+}
@@ -0,0 +1,64 @@
+// Copyright 1998-2019 Epic Games, Inc. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Misc/ScopeRWLock.h"
+#include "UObject/SoftObjectPath.h"
+#include "UObject/WeakObjectPtr.h"
+
+class UMaterialInterface;
+struct FAssetData;
+
+/**
+ * Resolves material names used by synced meshes and materials. The game
+ * thread owns the name table and remembers misses, so a name that is not on
+ * disk is searched for once. The materials folder is preloaded
+ * asynchronously when the server starts.
+ *
+ * Worker threads read an immutable snapshot of the resolved names, published
+ * once per commit batch, to pre-resolve material slots while decoding.
+ */
+class FMeshSyncMaterialResolver
+{
+public:
+	FMeshSyncMaterialResolver(const FString& InMaterialsPath);
+	~FMeshSyncMaterialResolver();
+
+	/** Starts async loads of every material under the materials path. */
+	void Preload();
+
+	/** Game thread only. Loads the material on the first request for a name, NULL for known misses. */
+	UMaterialInterface* Find(const FString& Name);
+	/** Game thread only. */
+	void Add(const FString& Name, UMaterialInterface* Material);
+
+	/** Game thread only. Forgets every name that resolved to a material in a package under Path. */
+	void RemoveUnder(const FString& Path);
+
+	/** Game thread only. Makes names resolved since the last call visible to Lookup. */
+	void Publish();
+
+	/** Object path a name resolved to as of the last Publish, callable from any thread. */
+	bool Lookup(const FString& Name, FSoftObjectPath& OutPath) const;
+
+	/** Name of the synced material a mesh's material slot refers to. */
+	static FString GetSlotMaterialName(const FString& Slot);
+
+private:
+	typedef TMap<FString, FSoftObjectPath> FSnapshot;
+
+	void OnAssetAdded(const FAssetData& AssetData);
+
+	FString MaterialsPath;
+	TMap<FString, TWeakObjectPtr<UMaterialInterface>> Resolved;
+	TSet<FString> Missing;
+	bool bDirty;
+
+	// Readers only copy the pointer, the table itself is never modified once published.
+	mutable FRWLock SnapshotLock;
+	TSharedPtr<const FSnapshot, ESPMode::ThreadSafe> Snapshot;
+
+	int32 NumPreloading;
+	FDelegateHandle AssetAddedHandle;
+};
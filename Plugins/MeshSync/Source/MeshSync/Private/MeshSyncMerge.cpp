@@ -0,0 +1,496 @@
+// Copyright 1998-2019 Epic Games, Inc. All Rights Reserved.
+
+#include "MeshSyncMerge.h"
+#include "MeshSync.h"
+#include "MeshSyncSettings.h"
+#include "MeshSyncServer.h"
+#include "MeshSyncPreprocess.h"
+#include "MeshSyncCommitQueue.h"
+#include "MeshSyncAssetIndex.h"
+#include "MeshSyncMaterialResolver.h"
+#include "MeshSyncStats.h"
+#include "MeshSyncBenchmark.h"
+
+#include "Async/TaskGraphInterfaces.h"
+#include "Containers/Ticker.h"
+#include "HAL/FileManager.h"
+#include "Misc/FileHelper.h"
+#include "Misc/Paths.h"
+#include "Serialization/MemoryReader.h"
+#include "Serialization/MemoryWriter.h"
+
+FMeshSyncMerger::FMeshSyncMerger(FMeshSyncServer* InServer, const FString& InSpillDir)
+	: Server(InServer)
+	, RetainedBytes(0)
+	, SpillDir(InSpillDir)
+{
+	// Left behind by a session that did not shut down.
+	IFileManager::Get().DeleteDirectory(*SpillDir, false, true);
+	TickHandle = FTicker::GetCoreTicker().AddTicker(FTickerDelegate::CreateRaw(this, &FMeshSyncMerger::Tick));
+}
+
+FMeshSyncMerger::~FMeshSyncMerger()
+{
+	FTicker::GetCoreTicker().RemoveTicker(TickHandle);
+	while (NumInFlight.GetValue() > 0)
+	{
+		FPlatformProcess::Sleep(0.001f);
+	}
+
+	int32 NumWaiting = 0;
+	for (const auto& Pair : Cells)
+	{
+		NumWaiting += Pair.Value.bDirty ? 1 : 0;
+	}
+	if (NumWaiting > 0)
+	{
+		UE_LOG(LogMeshSync, Warning, TEXT("%d cells were not merged before the server stopped"), NumWaiting);
+	}
+	IFileManager::Get().DeleteDirectory(*SpillDir, false, true);
+}
+
+void FMeshSyncMerger::AddTile(FSyncedMeshDesc* Desc)
+{
+	const UMeshSyncSettings* Settings = GetDefault<UMeshSyncSettings>();
+	const int32 CellSize = FMath::Max(Settings->MergeCellSize, 1);
+	const FIntVector TileCoords(Desc->TileX, Desc->TileY, Desc->TileZ);
+	const FIntVector Cell(TileCoords.X / CellSize, TileCoords.Y / CellSize, TileCoords.Z / CellSize);
+	const FVector TileOffset = FVector(TileCoords - Cell * CellSize) * Settings->TileSize;
+
+	FMergeTile* Tile = new FMergeTile();
+	Tile->RawMesh = MoveTemp(Desc->RawMesh);
+	Tile->MaterialSlots = Desc->MaterialSlots;
+	if (Desc->InstancePositions.Num() > 0)
+	{
+		for (const FVector& Position : Desc->InstancePositions)
+		{
+			Tile->Offsets.Add(TileOffset + Position);
+		}
+	}
+	else
+	{
+		Tile->Offsets.Add(TileOffset);
+	}
+	Tile->RetainedBytes = FSyncedMeshDesc::GetAllocatedSize(Tile->RawMesh) + Tile->Offsets.GetAllocatedSize();
+	const FString Name = Desc->Name;
+	const TWeakPtr<FMeshSyncConnection, ESPMode::ThreadSafe> Requester = Desc->Requester;
+	const uint32 RequestId = Desc->RequestId;
+	Server->GetDescPool().Release(Desc);
+
+	FScopeLock ScopeLock(&Lock);
+	const double Now = FPlatformTime::Seconds();
+	FIntVector* PreviousCell = TileCells.Find(Name);
+	if (PreviousCell && *PreviousCell != Cell)
+	{
+		// The tile moved, its old cell is merged again without it.
+		FCell& Previous = Cells.FindOrAdd(*PreviousCell);
+		RestoreCell(*PreviousCell, Previous);
+		RemoveTile(Previous, Name);
+		Previous.LastChangeTime = Now;
+		Previous.bDirty = true;
+	}
+	TileCells.Add(Name, Cell);
+
+	FCell& Target = Cells.FindOrAdd(Cell);
+	RestoreCell(Cell, Target);
+	RemoveTile(Target, Name);
+	Target.Tiles.Add(Name, MakeShareable(Tile));
+	RetainedBytes += Tile->RetainedBytes;
+	Target.LastChangeTime = Now;
+	Target.bDirty = true;
+	if (Requester.IsValid())
+	{
+		Target.Waiting.Emplace(Requester, RequestId);
+	}
+	FMeshSyncStageTimes::Get().TilesAccepted.Increment();
+	EvictCells();
+}
+
+void FMeshSyncMerger::RemoveTile(FCell& Cell, const FString& Name)
+{
+	FMergeTilePtr Tile;
+	if (Cell.Tiles.RemoveAndCopyValue(Name, Tile))
+	{
+		RetainedBytes -= Tile->RetainedBytes;
+	}
+}
+
+void FMeshSyncMerger::EvictCells()
+{
+	const int64 MaxBytes = (int64)GetDefault<UMeshSyncSettings>()->MaxMergeRetainedMemoryMB * 1024 * 1024;
+	if (RetainedBytes <= MaxBytes)
+	{
+		return;
+	}
+
+	// Cells waiting for or in a merge stay, their tiles are needed shortly.
+	TArray<FIntVector> Candidates;
+	for (const auto& Pair : Cells)
+	{
+		const FCell& Cell = Pair.Value;
+		if (!Cell.bDirty && !Cell.bMerging && !Cell.bSpilled && Cell.Tiles.Num() > 0)
+		{
+			Candidates.Add(Pair.Key);
+		}
+	}
+	Candidates.Sort([this](const FIntVector& A, const FIntVector& B)
+	{
+		return Cells[A].LastChangeTime < Cells[B].LastChangeTime;
+	});
+	for (const FIntVector& Coords : Candidates)
+	{
+		if (RetainedBytes <= MaxBytes || !SpillCell(Coords, Cells[Coords]))
+		{
+			break;
+		}
+	}
+}
+
+bool FMeshSyncMerger::SpillCell(const FIntVector& Coords, FCell& Cell)
+{
+	MESHSYNC_SCOPE(STAT_MeshSync_SpillCell);
+	TArray<uint8> Data;
+	FMemoryWriter Writer(Data, true);
+	int32 NumTiles = Cell.Tiles.Num();
+	Writer << NumTiles;
+	for (auto& Pair : Cell.Tiles)
+	{
+		// Saving leaves the tile as it is.
+		FMergeTile& Tile = const_cast<FMergeTile&>(*Pair.Value);
+		Writer << Pair.Key;
+		Writer << Tile.RawMesh;
+		Writer << Tile.MaterialSlots;
+		Writer << Tile.Offsets;
+	}
+	if (!FFileHelper::SaveArrayToFile(Data, *GetSpillFile(Coords)))
+	{
+		UE_LOG(LogMeshSync, Warning, TEXT("Unable to write the tiles of cell %s to %s, they stay in memory"), *Coords.ToString(), *SpillDir);
+		return false;
+	}
+
+	for (const auto& Pair : Cell.Tiles)
+	{
+		RetainedBytes -= Pair.Value->RetainedBytes;
+	}
+	Cell.Tiles.Empty();
+	Cell.bSpilled = true;
+	return true;
+}
+
+void FMeshSyncMerger::RestoreCell(const FIntVector& Coords, FCell& Cell)
+{
+	if (!Cell.bSpilled)
+	{
+		return;
+	}
+	MESHSYNC_SCOPE(STAT_MeshSync_SpillCell);
+	Cell.bSpilled = false;
+	const FString File = GetSpillFile(Coords);
+	TArray<uint8> Data;
+	if (!FFileHelper::LoadFileToArray(Data, *File))
+	{
+		UE_LOG(LogMeshSync, Warning, TEXT("Unable to read back the tiles of cell %s, the cell is merged without them"), *Coords.ToString());
+		return;
+	}
+	IFileManager::Get().Delete(*File);
+
+	FMemoryReader Reader(Data, true);
+	int32 NumTiles = 0;
+	Reader << NumTiles;
+	for (int32 Index = 0; Index < NumTiles && !Reader.IsError(); Index++)
+	{
+		FString Name;
+		FMergeTile* Tile = new FMergeTile();
+		Reader << Name;
+		Reader << Tile->RawMesh;
+		Reader << Tile->MaterialSlots;
+		Reader << Tile->Offsets;
+		Tile->RetainedBytes = FSyncedMeshDesc::GetAllocatedSize(Tile->RawMesh) + Tile->Offsets.GetAllocatedSize();
+		RetainedBytes += Tile->RetainedBytes;
+		Cell.Tiles.Add(Name, MakeShareable(Tile));
+	}
+	if (Reader.IsError())
+	{
+		UE_LOG(LogMeshSync, Warning, TEXT("The spilled tiles of cell %s are damaged, the cell is merged without some of them"), *Coords.ToString());
+	}
+}
+
+FString FMeshSyncMerger::GetSpillFile(const FIntVector& Coords) const
+{
+	return SpillDir / FString::Printf(TEXT("Cell_%d_%d_%d.bin"), Coords.X, Coords.Y, Coords.Z);
+}
+
+bool FMeshSyncMerger::IsIdle() const
+{
+	if (NumInFlight.GetValue() > 0 || NumCommitting.GetValue() > 0)
+	{
+		return false;
+	}
+	FScopeLock ScopeLock(&Lock);
+	for (const auto& Pair : Cells)
+	{
+		if (Pair.Value.bDirty)
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+bool FMeshSyncMerger::Tick(float DeltaTime)
+{
+	const double Delay = GetDefault<UMeshSyncSettings>()->MergeDelaySeconds;
+	const double Now = FPlatformTime::Seconds();
+
+	FScopeLock ScopeLock(&Lock);
+	for (auto& Pair : Cells)
+	{
+		FCell& Cell = Pair.Value;
+		// A cell being merged is picked up again once that merge is committed, so its meshes commit in order.
+		if (!Cell.bDirty || Cell.bMerging || Now - Cell.LastChangeTime < Delay)
+		{
+			continue;
+		}
+		Cell.bDirty = false;
+		Cell.bMerging = true;
+
+		TArray<FMergeTilePtr> Tiles;
+		Cell.Tiles.GenerateValueArray(Tiles);
+		FMergeBatchPtr Batch = MakeShareable(new FMeshSyncMergeBatch());
+		Batch->Cell = Pair.Key;
+		Batch->Requests = MoveTemp(Cell.Waiting);
+		Batch->NumPending.Set(1);
+		NumInFlight.Increment();
+		NumCommitting.Increment();
+		FFunctionGraphTask::CreateAndDispatchWhenReady([this, Batch, Tiles]()
+		{
+			MergeCell(Batch, Tiles);
+			NumInFlight.Decrement();
+		}, TStatId(), nullptr, ENamedThreads::AnyBackgroundThreadNormalTask);
+	}
+	return true;
+}
+
+void FMeshSyncMerger::MergeCell(const FMergeBatchPtr& Batch, const TArray<FMergeTilePtr>& Tiles)
+{
+	const FIntVector Cell = Batch->Cell;
+	TSet<FString> Emitted;
+	TArray<FString> Materials;
+	for (const FMergeTilePtr& Tile : Tiles)
+	{
+		for (const FString& Slot : Tile->MaterialSlots)
+		{
+			Materials.AddUnique(Slot);
+		}
+	}
+
+	for (const FString& Material : Materials)
+	{
+		FSyncedMeshDesc* Desc = MergeMaterial(Cell, Material, Tiles);
+		if (!Desc)
+		{
+			continue;
+		}
+		if (!Desc->RawMesh.IsValidOrFixable())
+		{
+			UE_LOG(LogMeshSync, Warning, TEXT("Merged mesh %s is invalid"), *Desc->Name);
+			Batch->NumFailed.Increment();
+			Server->GetDescPool().Release(Desc);
+			continue;
+		}
+		Emitted.Add(Desc->Name);
+		Desc->MergeBatch = Batch;
+		Batch->NumPending.Increment();
+
+		// Same steps a decoded mesh takes, see FMeshSyncConnection::FinishMesh.
+		Desc->ContentHash = FMeshSyncAssetIndex::HashMesh(*Desc);
+		Desc->bDuplicate = GetDefault<UMeshSyncSettings>()->bDeduplicateMeshes &&
+			Server->GetAssetIndex().ContainsMesh(Desc->ContentHash);
+		Desc->SlotMaterials.SetNum(1);
+		Server->GetMaterialResolver().Lookup(FMeshSyncMaterialResolver::GetSlotMaterialName(Material), Desc->SlotMaterials[0]);
+		Server->GetPreprocessor().Dispatch(Desc);
+	}
+
+	// A moved, replaced or removed tile can leave a material behind, its mesh leaves the level.
+	TSet<FString> Previous;
+	{
+		FScopeLock ScopeLock(&Lock);
+		FCell& State = Cells.FindChecked(Cell);
+		Previous = MoveTemp(State.Emitted);
+		State.Emitted = Emitted;
+	}
+	for (const FString& Name : Previous)
+	{
+		if (Emitted.Contains(Name))
+		{
+			continue;
+		}
+		FSyncedMeshDesc* Desc = Server->GetDescPool().Acquire();
+		Desc->Name = Name;
+		Desc->bRemoved = true;
+		Desc->bMerged = true;
+		Desc->MergeBatch = Batch;
+		Batch->NumPending.Increment();
+		Server->GetCommitQueue().EnqueueMesh(Desc);
+	}
+	FinishBatch(Batch);
+}
+
+void FMeshSyncMerger::OnCellMeshCommitted(FSyncedMeshDesc& Desc, bool bCommitted)
+{
+	if (!bCommitted)
+	{
+		Desc.MergeBatch->NumFailed.Increment();
+	}
+	FinishBatch(Desc.MergeBatch);
+}
+
+void FMeshSyncMerger::FinishBatch(const FMergeBatchPtr& Batch)
+{
+	if (Batch->NumPending.Decrement() > 0)
+	{
+		return;
+	}
+
+	const FString CellName = GetCellMeshName(Batch->Cell, FString());
+	const EMeshSyncResponse Response = Batch->NumFailed.GetValue() > 0 ? EMeshSyncResponse::Failed : EMeshSyncResponse::Committed;
+	for (const auto& Request : Batch->Requests)
+	{
+		if (FMeshSyncConnectionPtr Connection = Request.Key.Pin())
+		{
+			Connection->Respond(Request.Value, Response, CellName);
+		}
+	}
+	{
+		FScopeLock ScopeLock(&Lock);
+		Cells.FindChecked(Batch->Cell).bMerging = false;
+	}
+	NumCommitting.Decrement();
+}
+
+FSyncedMeshDesc* FMeshSyncMerger::MergeMaterial(const FIntVector& Cell, const FString& Material, const TArray<FMergeTilePtr>& Tiles)
+{
+	MESHSYNC_SCOPE(STAT_MeshSync_MergeCell);
+
+	// Wedge attributes survive only if every contributing tile has them, UV 0 and colors are filled in.
+	bool bAnyFaces = false;
+	bool bTangents = true;
+	bool bColors = false;
+	int32 NumTexCoords = MAX_MESH_TEXTURE_COORDS;
+	for (const FMergeTilePtr& Tile : Tiles)
+	{
+		const int32 Slot = Tile->MaterialSlots.Find(Material);
+		if (Slot == INDEX_NONE || !Tile->RawMesh.FaceMaterialIndices.Contains(Slot))
+		{
+			continue;
+		}
+		const FRawMesh& Mesh = Tile->RawMesh;
+		bAnyFaces = true;
+		const int32 NumWedges = Mesh.WedgeIndices.Num();
+		bTangents &= Mesh.WedgeTangentX.Num() == NumWedges && Mesh.WedgeTangentY.Num() == NumWedges && Mesh.WedgeTangentZ.Num() == NumWedges;
+		bColors |= Mesh.WedgeColors.Num() > 0;
+		int32 TileTexCoords = 1;
+		while (TileTexCoords < MAX_MESH_TEXTURE_COORDS && Mesh.WedgeTexCoords[TileTexCoords].Num() > 0)
+		{
+			TileTexCoords++;
+		}
+		NumTexCoords = FMath::Min(NumTexCoords, TileTexCoords);
+	}
+	if (!bAnyFaces)
+	{
+		return NULL;
+	}
+
+	const int32 CellSize = FMath::Max(GetDefault<UMeshSyncSettings>()->MergeCellSize, 1);
+	FSyncedMeshDesc* Desc = Server->GetDescPool().Acquire();
+	Desc->Name = GetCellMeshName(Cell, Material);
+	Desc->MaterialSlots.Add(Material);
+	Desc->TileX = Cell.X * CellSize;
+	Desc->TileY = Cell.Y * CellSize;
+	Desc->TileZ = Cell.Z * CellSize;
+	Desc->bUpdateInPlace = true;
+	Desc->bMerged = true;
+
+	FRawMesh& Out = Desc->RawMesh;
+	TArray<int32> Remap;
+	int32 NumInvalidFaces = 0;
+	for (const FMergeTilePtr& Tile : Tiles)
+	{
+		const int32 Slot = Tile->MaterialSlots.Find(Material);
+		if (Slot == INDEX_NONE)
+		{
+			continue;
+		}
+		const FRawMesh& Mesh = Tile->RawMesh;
+		const uint32 NumVertices = (uint32)Mesh.VertexPositions.Num();
+		const int32 NumFaces = FMath::Min(Mesh.FaceMaterialIndices.Num(), Mesh.WedgeIndices.Num() / 3);
+		for (const FVector& Offset : Tile->Offsets)
+		{
+			// Only vertices of faces using Material are copied.
+			Remap.Reset();
+			Remap.SetNumUninitialized(Mesh.VertexPositions.Num());
+			FMemory::Memset(Remap.GetData(), 0xff, Remap.Num() * Remap.GetTypeSize());
+
+			for (int32 Face = 0; Face < NumFaces; Face++)
+			{
+				if (Mesh.FaceMaterialIndices[Face] != Slot)
+				{
+					continue;
+				}
+				const uint32* Corners = &Mesh.WedgeIndices[Face * 3];
+				if (Corners[0] >= NumVertices || Corners[1] >= NumVertices || Corners[2] >= NumVertices)
+				{
+					NumInvalidFaces++;
+					continue;
+				}
+				Out.FaceMaterialIndices.Add(0);
+				Out.FaceSmoothingMasks.Add(Mesh.FaceSmoothingMasks.IsValidIndex(Face) ? Mesh.FaceSmoothingMasks[Face] : 1);
+				for (int32 Corner = 0; Corner < 3; Corner++)
+				{
+					const int32 Wedge = Face * 3 + Corner;
+					const uint32 Vertex = Mesh.WedgeIndices[Wedge];
+					if (Remap[Vertex] == INDEX_NONE)
+					{
+						Remap[Vertex] = Out.VertexPositions.Add(Mesh.VertexPositions[Vertex] + Offset);
+					}
+					Out.WedgeIndices.Add(Remap[Vertex]);
+					if (bTangents)
+					{
+						Out.WedgeTangentX.Add(Mesh.WedgeTangentX[Wedge]);
+						Out.WedgeTangentY.Add(Mesh.WedgeTangentY[Wedge]);
+						Out.WedgeTangentZ.Add(Mesh.WedgeTangentZ[Wedge]);
+					}
+					for (int32 Channel = 0; Channel < NumTexCoords; Channel++)
+					{
+						const TArray<FVector2D>& TexCoords = Mesh.WedgeTexCoords[Channel];
+						Out.WedgeTexCoords[Channel].Add(TexCoords.IsValidIndex(Wedge) ? TexCoords[Wedge] : FVector2D::ZeroVector);
+					}
+					if (bColors)
+					{
+						// Tiles without colors draw white, the palette maps them after the merge.
+						Out.WedgeColors.Add(Mesh.WedgeColors.IsValidIndex(Wedge) ? Mesh.WedgeColors[Wedge] : FColor::White);
+					}
+				}
+			}
+		}
+	}
+	if (NumInvalidFaces > 0)
+	{
+		UE_LOG(LogMeshSync, Warning, TEXT("Left %d faces referencing missing vertices out of %s"), NumInvalidFaces, *Desc->Name);
+	}
+	return Desc;
+}
+
+FString FMeshSyncMerger::GetCellMeshName(const FIntVector& Cell, const FString& Material)
+{
+	FString Name = FString::Printf(TEXT("Cell_%d_%d_%d"), Cell.X, Cell.Y, Cell.Z);
+	if (!Material.IsEmpty())
+	{
+		Name += TEXT("_");
+		for (TCHAR Char : Material)
+		{
+			Name.AppendChar(FChar::IsAlnum(Char) ? Char : TEXT('_'));
+		}
+	}
+	return Name;
+}
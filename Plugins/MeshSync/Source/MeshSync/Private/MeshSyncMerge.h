@@ -0,0 +1,117 @@
+// Copyright 1998-2019 Epic Games, Inc. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "HAL/ThreadSafeCounter.h"
+#include "Misc/ScopeLock.h"
+#include "RawMesh.h"
+
+class FMeshSyncServer;
+class FMeshSyncConnection;
+class FSyncedMeshDesc;
+
+/** One merge of a cell. Its tiles are answered once every mesh it produced is committed. */
+struct FMeshSyncMergeBatch
+{
+	FIntVector Cell;
+	// Tiles filed since the previous merge of the cell.
+	TArray<TPair<TWeakPtr<FMeshSyncConnection, ESPMode::ThreadSafe>, uint32>> Requests;
+	// Meshes not committed yet, plus one while the merge still produces them.
+	FThreadSafeCounter NumPending;
+	FThreadSafeCounter NumFailed;
+};
+
+/**
+ * Groups incoming tiles into spatial cells of UMeshSyncSettings::MergeCellSize
+ * tiles and emits one mesh per cell and material instead of one per tile.
+ *
+ * Tiles are kept per cell as they arrive. Once a cell has not changed for
+ * MergeDelaySeconds its geometry is merged on a task graph worker and the
+ * merged meshes go through the preprocessor like any synced mesh, replacing
+ * the cell's previous meshes in place. Meshes of materials the cell no longer
+ * has are taken out of the level and the index. Filed tiles stay for the session, up to
+ * MaxMergeRetainedMemoryMB in memory and the cells changed least recently on disk.
+ */
+class FMeshSyncMerger
+{
+public:
+	/**
+	 * Must be created on the game thread, it ticks there to find cells ready to merge.
+	 * Evicted cells are written to InSpillDir, which belongs to this merger alone.
+	 */
+	FMeshSyncMerger(FMeshSyncServer* InServer, const FString& InSpillDir);
+	/** Waits for cells still being merged. */
+	~FMeshSyncMerger();
+
+	/** Takes ownership of Desc and files its geometry under its cell, callable from any thread. */
+	void AddTile(FSyncedMeshDesc* Desc);
+
+	/** Game thread, called by the commit queue for every mesh that carries a merge batch. */
+	void OnCellMeshCommitted(FSyncedMeshDesc& Desc, bool bCommitted);
+
+	/** True when no cell is waiting, being merged or being committed. */
+	bool IsIdle() const;
+
+private:
+	// Immutable once filed, merges read it without holding the lock.
+	struct FMergeTile
+	{
+		FRawMesh RawMesh;
+		TArray<FString> MaterialSlots;
+		// Offset of every instance from the cell origin.
+		TArray<FVector> Offsets;
+		// Counted in the merger's RetainedBytes while the tile is in memory.
+		int64 RetainedBytes;
+	};
+	typedef TSharedPtr<const FMergeTile, ESPMode::ThreadSafe> FMergeTilePtr;
+	typedef TSharedPtr<FMeshSyncMergeBatch, ESPMode::ThreadSafe> FMergeBatchPtr;
+
+	struct FCell
+	{
+		FCell() : LastChangeTime(0.0), bDirty(false), bMerging(false), bSpilled(false) {}
+
+		TMap<FString, FMergeTilePtr> Tiles;
+		double LastChangeTime;
+		bool bDirty;
+		// From the start of a merge until its meshes are committed.
+		bool bMerging;
+		// Tiles are in the cell's spill file, Tiles is empty.
+		bool bSpilled;
+		TArray<TPair<TWeakPtr<FMeshSyncConnection, ESPMode::ThreadSafe>, uint32>> Waiting;
+		// Names of the meshes the last merge produced.
+		TSet<FString> Emitted;
+	};
+
+	bool Tick(float DeltaTime);
+	// Caller holds Lock.
+	void RemoveTile(FCell& Cell, const FString& Name);
+	/** Writes the tiles of cells merged least recently to disk until the rest fit MaxMergeRetainedMemoryMB, caller holds Lock. */
+	void EvictCells();
+	// Caller holds Lock.
+	bool SpillCell(const FIntVector& Coords, FCell& Cell);
+	void RestoreCell(const FIntVector& Coords, FCell& Cell);
+	FString GetSpillFile(const FIntVector& Coords) const;
+	void MergeCell(const FMergeBatchPtr& Batch, const TArray<FMergeTilePtr>& Tiles);
+	/** Drops one pending mesh of Batch, the last one answers its tiles and ends the cell's merge. */
+	void FinishBatch(const FMergeBatchPtr& Batch);
+	/** Appends the faces of every tile using Material, NULL when there are none. */
+	FSyncedMeshDesc* MergeMaterial(const FIntVector& Cell, const FString& Material, const TArray<FMergeTilePtr>& Tiles);
+
+	static FString GetCellMeshName(const FIntVector& Cell, const FString& Material);
+
+	FMeshSyncServer* Server;
+	FDelegateHandle TickHandle;
+	// Merge tasks running, and merges whose meshes are not all committed.
+	FThreadSafeCounter NumInFlight;
+	FThreadSafeCounter NumCommitting;
+
+	mutable FCriticalSection Lock;
+	TMap<FIntVector, FCell> Cells;
+	// Cell each tile was last filed under.
+	TMap<FString, FIntVector> TileCells;
+	// Bytes of the filed tiles held in memory.
+	int64 RetainedBytes;
+	// Cells evicted by EvictCells, one file each, cleared with the merger.
+	FString SpillDir;
+};
@@ -0,0 +1,161 @@
+// Copyright 1998-2019 Epic Games, Inc. All Rights Reserved.
+
+#include "MeshSyncPalette.h"
+#include "MeshSync.h"
+#include "MeshSyncServer.h"
+#include "MeshSyncMaterialResolver.h"
+
+#include "AssetRegistryModule.h"
+#include "Engine/Texture2D.h"
+#include "Misc/PackageName.h"
+#include "Package.h"
+
+static const TCHAR* PaletteTextureName = TEXT("T_MeshSyncPalette");
+
+FMeshSyncPalette::FMeshSyncPalette(const FString& InPackagePath)
+	: PackagePath(InPackagePath)
+	, bDirty(false)
+	, bFullReported(false)
+{
+	// Index 0 is what wedges without a known color get.
+	FindOrAddColor(FColor::White);
+	bDirty = false;
+}
+
+void FMeshSyncPalette::Load()
+{
+	const FString TexturePath = PackagePath + PaletteTextureName + TEXT(".") + PaletteTextureName;
+	UTexture2D* Existing = LoadObject<UTexture2D>(nullptr, *TexturePath, nullptr, LOAD_NoWarn);
+	if (!Existing) {
+		return;
+	}
+	Texture = Existing;
+
+	TArray<uint8> Pixels;
+	if (Existing->Source.GetSizeX() != Size || Existing->Source.GetSizeY() != Size ||
+		Existing->Source.GetFormat() != TSF_BGRA8 || !Existing->Source.GetMipData(Pixels, 0)) {
+		UE_LOG(LogMeshSync, Warning, TEXT("%s is not a MeshSync palette, it will be overwritten"), *TexturePath);
+		Existing->Source.Init(Size, Size, 1, 1, TSF_BGRA8);
+		bDirty = true;
+		return;
+	}
+
+	// Used entries are opaque and contiguous.
+	FScopeLock ScopeLock(&Lock);
+	const FColor* Entries = (const FColor*)Pixels.GetData();
+	Colors.Reset();
+	ColorIndices.Reset();
+	for (int32 Index = 0; Index < Size * Size && Entries[Index].A == 255; Index++) {
+		ColorIndices.Add(Entries[Index], Index);
+		Colors.Add(Entries[Index]);
+	}
+	if (Colors.Num() == 0) {
+		FindOrAddColor(FColor::White);
+	}
+	UE_LOG(LogMeshSync, Display, TEXT("Loaded %d palette colors from %s"), Colors.Num(), *TexturePath);
+}
+
+int32 FMeshSyncPalette::FindOrAddColor(const FColor& Color)
+{
+	const FColor Opaque(Color.R, Color.G, Color.B, 255);
+	if (const int32* Index = ColorIndices.Find(Opaque)) {
+		return *Index;
+	}
+	if (Colors.Num() >= Size * Size) {
+		if (!bFullReported) {
+			UE_LOG(LogMeshSync, Warning, TEXT("MeshSync palette is full, further colors draw as white"));
+			bFullReported = true;
+		}
+		return 0;
+	}
+	const int32 Index = Colors.Add(Opaque);
+	ColorIndices.Add(Opaque, Index);
+	bDirty = true;
+	return Index;
+}
+
+void FMeshSyncPalette::AddMaterial(const FString& Name, const FColor& Color)
+{
+	FScopeLock ScopeLock(&Lock);
+	MaterialIndices.Add(FMeshSyncMaterialResolver::GetSlotMaterialName(Name), FindOrAddColor(Color));
+}
+
+void FMeshSyncPalette::ApplyToMesh(FSyncedMeshDesc& Desc)
+{
+	FScopeLock ScopeLock(&Lock);
+	TArray<int32, TInlineAllocator<16>> SlotIndices;
+	for (const FString& Slot : Desc.MaterialSlots) {
+		const int32* Index = MaterialIndices.Find(FMeshSyncMaterialResolver::GetSlotMaterialName(Slot));
+		SlotIndices.Add(Index ? *Index : INDEX_NONE);
+	}
+	ApplyToRawMesh(SlotIndices, Desc.RawMesh);
+	for (FRawMesh& LODMesh : Desc.LODMeshes) {
+		ApplyToRawMesh(SlotIndices, LODMesh);
+	}
+}
+
+void FMeshSyncPalette::ApplyToRawMesh(const TArray<int32, TInlineAllocator<16>>& SlotIndices, FRawMesh& Mesh)
+{
+	const int32 NumWedges = Mesh.WedgeIndices.Num();
+	const bool bHasColors = Mesh.WedgeColors.Num() == NumWedges;
+
+	// A face takes the color of its material, or keeps its own vertex colors when the material is not in the palette.
+	Mesh.WedgeColors.SetNumUninitialized(NumWedges);
+	for (int32 Face = 0; Face < Mesh.FaceMaterialIndices.Num(); Face++) {
+		const int32 Slot = Mesh.FaceMaterialIndices[Face];
+		const int32 SlotIndex = SlotIndices.IsValidIndex(Slot) ? SlotIndices[Slot] : INDEX_NONE;
+		for (int32 Wedge = Face * 3; Wedge < Face * 3 + 3 && Wedge < NumWedges; Wedge++) {
+			int32 Index = SlotIndex;
+			if (Index == INDEX_NONE) {
+				Index = bHasColors ? FindOrAddColor(Mesh.WedgeColors[Wedge]) : 0;
+			}
+			Mesh.WedgeColors[Wedge] = EncodeIndex(Index);
+		}
+	}
+}
+
+UTexture2D* FMeshSyncPalette::GetTexture()
+{
+	if (UTexture2D* Existing = Texture.Get()) {
+		return Existing;
+	}
+
+	const FString PackageName = PackagePath + PaletteTextureName;
+	UPackage* Package = CreatePackage(nullptr, *PackageName);
+	UTexture2D* NewTexture = NewObject<UTexture2D>(Package, PaletteTextureName, RF_Public | RF_Standalone | RF_Transactional);
+	NewTexture->Source.Init(Size, Size, 1, 1, TSF_BGRA8);
+	NewTexture->SRGB = true;
+	NewTexture->Filter = TF_Nearest;
+	NewTexture->AddressX = TA_Clamp;
+	NewTexture->AddressY = TA_Clamp;
+	NewTexture->CompressionSettings = TC_VectorDisplacementmap;
+	NewTexture->MipGenSettings = TMGS_NoMipmaps;
+	FAssetRegistryModule::AssetCreated(NewTexture);
+	Texture = NewTexture;
+
+	FScopeLock ScopeLock(&Lock);
+	bDirty = true;
+	return NewTexture;
+}
+
+void FMeshSyncPalette::Flush()
+{
+	UTexture2D* Target = Texture.Get();
+	if (!Target) {
+		return;
+	}
+	{
+		FScopeLock ScopeLock(&Lock);
+		if (!bDirty) {
+			return;
+		}
+		bDirty = false;
+
+		FColor* Entries = (FColor*)Target->Source.LockMip(0);
+		FMemory::Memzero(Entries, Size * Size * sizeof(FColor));
+		FMemory::Memcpy(Entries, Colors.GetData(), Colors.Num() * sizeof(FColor));
+		Target->Source.UnlockMip(0);
+	}
+	Target->MarkPackageDirty();
+	Target->PostEditChange();
+}
@@ -0,0 +1,65 @@
+// Copyright 1998-2019 Epic Games, Inc. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Misc/ScopeLock.h"
+#include "UObject/WeakObjectPtr.h"
+
+class FSyncedMeshDesc;
+struct FRawMesh;
+class UTexture2D;
+
+/**
+ * Distinct brick colors packed into one texture. Meshes carry the palette
+ * index of each wedge in the red (low byte) and green (high byte) vertex
+ * color channels, so a single material instance per category can draw
+ * every color by sampling the palette.
+ *
+ * Colors are added from the decode workers, the texture is written on the
+ * game thread. The palette persists in its texture, indices stay valid
+ * across sessions.
+ */
+class FMeshSyncPalette
+{
+public:
+	FMeshSyncPalette(const FString& InPackagePath);
+
+	/** Entries along each side of the palette texture. */
+	static const int32 Size = 256;
+
+	/** Game thread only. Picks up the entries of a palette saved by an earlier session. */
+	void Load();
+
+	/** Registers the color of a synced material, callable from any thread. */
+	void AddMaterial(const FString& Name, const FColor& Color);
+
+	/** Replaces the wedge colors of a prepared mesh and its LODs with palette indices, callable from any thread. */
+	void ApplyToMesh(FSyncedMeshDesc& Desc);
+
+	/** Game thread only. The palette texture, created on first use. */
+	UTexture2D* GetTexture();
+	/** Game thread only. Writes colors added since the last call into the texture. */
+	void Flush();
+
+	static FColor EncodeIndex(int32 Index) {
+		return FColor(Index & 0xff, (Index >> 8) & 0xff, 0, 255);
+	}
+
+private:
+	// Caller holds Lock.
+	int32 FindOrAddColor(const FColor& Color);
+	void ApplyToRawMesh(const TArray<int32, TInlineAllocator<16>>& SlotIndices, FRawMesh& Mesh);
+
+	FString PackagePath;
+
+	FCriticalSection Lock;
+	TArray<FColor> Colors;
+	TMap<FColor, int32> ColorIndices;
+	TMap<FString, int32> MaterialIndices;
+	bool bDirty;
+	bool bFullReported;
+
+	// Owned by the game thread.
+	TWeakObjectPtr<UTexture2D> Texture;
+};
@@ -0,0 +1,325 @@
+// Copyright 1998-2019 Epic Games, Inc. All Rights Reserved.
+
+#include "MeshSyncPreprocess.h"
+#include "MeshSync.h"
+#include "MeshSyncSettings.h"
+#include "MeshSyncServer.h"
+#include "MeshSyncCommitQueue.h"
+#include "MeshSyncMerge.h"
+#include "MeshSyncPalette.h"
+#include "MeshSyncBenchmark.h"
+#include "MeshSyncStats.h"
+
+#include "Async/TaskGraphInterfaces.h"
+#include "DerivedDataCacheInterface.h"
+#include "Engine/EngineTypes.h"
+#include "IMeshUtilities.h"
+#include "IMeshReductionInterfaces.h"
+#include "IMeshReductionManagerModule.h"
+#include "MeshDescription.h"
+#include "MeshDescriptionOperations.h"
+#include "Engine/StaticMesh.h"
+#include "Modules/ModuleManager.h"
+#include "RawMesh.h"
+#include "Serialization/MemoryReader.h"
+#include "Serialization/MemoryWriter.h"
+
+// Change when Process produces different results for the same input.
+#define MESHSYNC_DERIVEDDATA_VER TEXT("A3E9D2C4706B4F18B5E1C8D67F2A0B53")
+
+FMeshSyncPreprocessor::FMeshSyncPreprocessor(FMeshSyncServer* InServer)
+	: Server(InServer)
+	, MeshUtilities(NULL)
+	, MeshReduction(NULL)
+{
+	// Module loading is not thread safe, so resolve it up front for the workers.
+	MeshUtilities = FModuleManager::LoadModulePtr<IMeshUtilities>("MeshUtilities");
+	if (!MeshUtilities)
+	{
+		UE_LOG(LogMeshSync, Warning, TEXT("MeshUtilities is unavailable, normals and lightmap UVs will be built on the game thread"));
+	}
+	if (IMeshReductionManagerModule* ReductionModule = FModuleManager::LoadModulePtr<IMeshReductionManagerModule>("MeshReductionInterface"))
+	{
+		MeshReduction = ReductionModule->GetStaticMeshReductionInterface();
+	}
+	if (!MeshReduction)
+	{
+		UE_LOG(LogMeshSync, Warning, TEXT("No static mesh reduction is available, LODs will be reduced on the game thread"));
+	}
+}
+
+FMeshSyncPreprocessor::~FMeshSyncPreprocessor()
+{
+	while (NumInFlight.GetValue() > 0)
+	{
+		FPlatformProcess::Sleep(0.001f);
+	}
+}
+
+void FMeshSyncPreprocessor::Dispatch(FSyncedMeshDesc* Desc)
+{
+	// Tiles come back as merged cells.
+	if (GetDefault<UMeshSyncSettings>()->bMergeTilesIntoCells && !Desc->bMerged)
+	{
+		Server->GetMerger().AddTile(Desc);
+		return;
+	}
+
+	Server->ChargeInFlight(*Desc);
+
+	// Duplicates resolve to an existing asset, there is nothing to prepare.
+	if (!MeshUtilities || Desc->bDuplicate || !GetDefault<UMeshSyncSettings>()->bPreprocessOnWorkers)
+	{
+		ApplyPalette(*Desc);
+		Server->GetCommitQueue().EnqueueMesh(Desc);
+		return;
+	}
+
+	NumInFlight.Increment();
+	INC_DWORD_STAT(STAT_MeshSync_PreprocessInFlight);
+	FFunctionGraphTask::CreateAndDispatchWhenReady([this, Desc]()
+	{
+		Process(*Desc);
+		ApplyPalette(*Desc);
+		// Normals, tangents and lightmap UVs grew the mesh.
+		Server->ChargeInFlight(*Desc);
+		Server->GetCommitQueue().EnqueueMesh(Desc);
+		DEC_DWORD_STAT(STAT_MeshSync_PreprocessInFlight);
+		NumInFlight.Decrement();
+	}, TStatId(), nullptr, ENamedThreads::AnyBackgroundThreadNormalTask);
+}
+
+void FMeshSyncPreprocessor::Process(FSyncedMeshDesc& Desc)
+{
+	FMeshSyncStageScope PreprocessScope(EMeshSyncStage::Preprocess);
+	MESHSYNC_SCOPE(STAT_MeshSync_Preprocess);
+	const bool bUseCache = GetDefault<UMeshSyncSettings>()->bCacheBuildProducts;
+	FString CacheKey;
+	if (bUseCache)
+	{
+		CacheKey = GetCacheKey(Desc);
+		TArray<uint8> CachedData;
+		if (GetDerivedDataCacheRef().GetSynchronous(*CacheKey, CachedData) && LoadCached(Desc, CachedData))
+		{
+			return;
+		}
+	}
+
+	FRawMesh& Mesh = Desc.RawMesh;
+
+	FMeshBuildSettings BuildSettings;
+	GetBuildSettings(Desc, BuildSettings);
+	MeshUtilities->RecomputeTangentsAndNormalsForRawMesh(true, true, BuildSettings, Mesh);
+
+	// Lightmap UVs go in the first free channel, the build expects the channels to be contiguous.
+	int32 LightmapIndex = 1;
+	while (LightmapIndex < MAX_MESH_TEXTURE_COORDS && Mesh.WedgeTexCoords[LightmapIndex].Num() > 0)
+	{
+		LightmapIndex++;
+	}
+	if (LightmapIndex < MAX_MESH_TEXTURE_COORDS &&
+		MeshUtilities->GenerateUniqueUVsForStaticMesh(Mesh, GetDefault<UMeshSyncSettings>()->LightmapResolution, Mesh.WedgeTexCoords[LightmapIndex]))
+	{
+		Desc.LightmapCoordinateIndex = LightmapIndex;
+	}
+	Desc.bPreprocessed = true;
+
+	GenerateLODs(Desc);
+	if (GetDefault<UMeshSyncSettings>()->Collision != EMeshSyncCollision::ComplexAsSimple)
+	{
+		FitCollision(Desc);
+	}
+
+	if (bUseCache)
+	{
+		TArray<uint8> CachedData;
+		FMemoryWriter Writer(CachedData, true);
+		Serialize(Writer, Desc);
+		GetDerivedDataCacheRef().Put(*CacheKey, CachedData);
+	}
+}
+
+FString FMeshSyncPreprocessor::GetCacheKey(const FSyncedMeshDesc& Desc)
+{
+	const UMeshSyncSettings* Settings = GetDefault<UMeshSyncSettings>();
+	FSHA1 Sha;
+	Sha.Update(Desc.ContentHash.Hash, sizeof(Desc.ContentHash.Hash));
+	Sha.Update((const uint8*)&Settings->LightmapResolution, sizeof(Settings->LightmapResolution));
+	for (const FMeshSyncLODLevel& Level : Settings->LODs)
+	{
+		Sha.Update((const uint8*)&Level.PercentTriangles, sizeof(Level.PercentTriangles));
+	}
+	const uint8 Collision = (uint8)Settings->Collision;
+	Sha.Update(&Collision, sizeof(Collision));
+	Sha.Final();
+	FSHAHash Hash;
+	Sha.GetHash(Hash.Hash);
+	return FDerivedDataCacheInterface::BuildCacheKey(TEXT("MESHSYNC"), MESHSYNC_DERIVEDDATA_VER, *Hash.ToString());
+}
+
+void FMeshSyncPreprocessor::Serialize(FArchive& Ar, FSyncedMeshDesc& Desc)
+{
+	Ar << Desc.RawMesh;
+	Ar << Desc.LightmapCoordinateIndex;
+	Ar << Desc.LODMeshes;
+	Ar << Desc.CollisionHull;
+}
+
+bool FMeshSyncPreprocessor::LoadCached(FSyncedMeshDesc& Desc, const TArray<uint8>& CachedData)
+{
+	FSyncedMeshDesc Cached;
+	FMemoryReader Reader(CachedData, true);
+	Serialize(Reader, Cached);
+	if (Reader.IsError() || Cached.RawMesh.WedgeIndices.Num() != Desc.RawMesh.WedgeIndices.Num())
+	{
+		UE_LOG(LogMeshSync, Warning, TEXT("Cached build products of %s are unusable, building them again"), *Desc.Name);
+		return false;
+	}
+
+	// Cached products hold the colors as received, the palette goes over LOD 0 and every LOD after this.
+	Desc.RawMesh = MoveTemp(Cached.RawMesh);
+	Desc.LightmapCoordinateIndex = Cached.LightmapCoordinateIndex;
+	Desc.LODMeshes = MoveTemp(Cached.LODMeshes);
+	Desc.CollisionHull = MoveTemp(Cached.CollisionHull);
+	Desc.bPreprocessed = true;
+	return true;
+}
+
+void FMeshSyncPreprocessor::ApplyPalette(FSyncedMeshDesc& Desc)
+{
+	if (GetDefault<UMeshSyncSettings>()->bUsePaletteMaterials && !Desc.bDuplicate)
+	{
+		Server->GetPalette().ApplyToMesh(Desc);
+	}
+}
+
+void FMeshSyncPreprocessor::FitCollision(FSyncedMeshDesc& Desc)
+{
+	const TArray<FVector>& Positions = Desc.RawMesh.VertexPositions;
+	Desc.CollisionHull.Reset();
+	if (Positions.Num() == 0)
+	{
+		return;
+	}
+
+	FVector Directions[26];
+	int32 NumDirections = 0;
+	for (int32 X = -1; X <= 1; X++)
+	{
+		for (int32 Y = -1; Y <= 1; Y++)
+		{
+			for (int32 Z = -1; Z <= 1; Z++)
+			{
+				if (X != 0 || Y != 0 || Z != 0)
+				{
+					Directions[NumDirections++] = FVector(X, Y, Z);
+				}
+			}
+		}
+	}
+
+	int32 Extremes[26] = { 0 };
+	float Distances[26];
+	for (int32 Direction = 0; Direction < NumDirections; Direction++)
+	{
+		Distances[Direction] = Positions[0] | Directions[Direction];
+	}
+	for (int32 Vertex = 1; Vertex < Positions.Num(); Vertex++)
+	{
+		for (int32 Direction = 0; Direction < NumDirections; Direction++)
+		{
+			const float Distance = Positions[Vertex] | Directions[Direction];
+			if (Distance > Distances[Direction])
+			{
+				Distances[Direction] = Distance;
+				Extremes[Direction] = Vertex;
+			}
+		}
+	}
+	for (int32 Direction = 0; Direction < NumDirections; Direction++)
+	{
+		Desc.CollisionHull.AddUnique(Positions[Extremes[Direction]]);
+	}
+}
+
+void FMeshSyncPreprocessor::GenerateLODs(FSyncedMeshDesc& Desc)
+{
+	const TArray<FMeshSyncLODLevel>& Levels = GetDefault<UMeshSyncSettings>()->LODs;
+	if (!MeshReduction || Levels.Num() == 0)
+	{
+		return;
+	}
+
+	FSHA1 Sha;
+	Sha.Update(Desc.ContentHash.Hash, sizeof(Desc.ContentHash.Hash));
+	for (const FMeshSyncLODLevel& Level : Levels)
+	{
+		Sha.Update((const uint8*)&Level.PercentTriangles, sizeof(Level.PercentTriangles));
+	}
+	Sha.Final();
+	FSHAHash Key;
+	Sha.GetHash(Key.Hash);
+
+	{
+		FScopeLock ScopeLock(&LODCacheLock);
+		if (const TArray<FRawMesh>* Cached = LODCache.Find(Key))
+		{
+			Desc.LODMeshes = *Cached;
+			return;
+		}
+	}
+
+	MESHSYNC_SCOPE(STAT_MeshSync_ReduceLODs);
+	// Material slots only need to survive the round trip, any unique names do.
+	TMap<int32, FName> MaterialMap;
+	TMap<FName, int32> MaterialIndices;
+	for (int32 Slot = 0; Slot < Desc.MaterialSlots.Num(); Slot++)
+	{
+		const FName SlotName(*FString::FromInt(Slot));
+		MaterialMap.Add(Slot, SlotName);
+		MaterialIndices.Add(SlotName, Slot);
+	}
+
+	FMeshDescription Source;
+	UStaticMesh::RegisterMeshAttributes(Source);
+	FMeshDescriptionOperations::ConvertFromRawMesh(Desc.RawMesh, Source, MaterialMap);
+	FOverlappingCorners OverlappingCorners;
+	FMeshDescriptionOperations::FindOverlappingCorners(OverlappingCorners, Source, THRESH_POINTS_ARE_SAME);
+
+	Desc.LODMeshes.Reset(Levels.Num());
+	for (const FMeshSyncLODLevel& Level : Levels)
+	{
+		FMeshReductionSettings ReductionSettings;
+		ReductionSettings.PercentTriangles = Level.PercentTriangles;
+
+		FMeshDescription Reduced;
+		UStaticMesh::RegisterMeshAttributes(Reduced);
+		float MaxDeviation = 0.0f;
+		MeshReduction->Reduce(Reduced, MaxDeviation, Source, OverlappingCorners, ReductionSettings);
+		FMeshDescriptionOperations::ConvertToRawMesh(Reduced, Desc.LODMeshes.AddDefaulted_GetRef(), MaterialIndices);
+	}
+
+	FScopeLock ScopeLock(&LODCacheLock);
+	if (!LODCache.Contains(Key))
+	{
+		if (LODCacheOrder.Num() >= MaxCachedLODs)
+		{
+			LODCache.Remove(LODCacheOrder[0]);
+			LODCacheOrder.RemoveAt(0, 1, false);
+		}
+		LODCache.Add(Key, Desc.LODMeshes);
+		LODCacheOrder.Add(Key);
+	}
+}
+
+void FMeshSyncPreprocessor::GetBuildSettings(const FSyncedMeshDesc& Desc, FMeshBuildSettings& OutSettings)
+{
+	OutSettings.bRecomputeNormals = !Desc.bPreprocessed;
+	OutSettings.bRecomputeTangents = !Desc.bPreprocessed;
+	OutSettings.bUseMikkTSpace = false;
+	OutSettings.bGenerateLightmapUVs = Desc.LightmapCoordinateIndex == INDEX_NONE;
+	OutSettings.bBuildAdjacencyBuffer = false;
+	OutSettings.bBuildReversedIndexBuffer = false;
+	OutSettings.bUseFullPrecisionUVs = false;
+	OutSettings.bUseHighPrecisionTangentBasis = false;
+}
@@ -0,0 +1,70 @@
+// Copyright 1998-2019 Epic Games, Inc. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "HAL/ThreadSafeCounter.h"
+#include "Misc/ScopeLock.h"
+#include "Misc/SecureHash.h"
+#include "RawMesh.h"
+
+class FMeshSyncServer;
+class FSyncedMeshDesc;
+class IMeshUtilities;
+class IMeshReduction;
+struct FMeshBuildSettings;
+
+/**
+ * Prepares decoded meshes on task graph workers before they reach the
+ * commit queue. Normals, tangents, the lightmap UV channel and the reduced
+ * LODs are computed here, so the static mesh build on the game thread only
+ * has to produce render data.
+ */
+class FMeshSyncPreprocessor
+{
+public:
+	/** Must be created on the game thread, it loads the mesh utilities and reduction modules. */
+	FMeshSyncPreprocessor(FMeshSyncServer* InServer);
+	/** Waits for meshes still being prepared. */
+	~FMeshSyncPreprocessor();
+
+	/** Takes ownership of Desc, prepares it on a worker and hands it to the commit queue. */
+	void Dispatch(FSyncedMeshDesc* Desc);
+
+	/** True when no mesh is being prepared. */
+	bool IsIdle() const { return NumInFlight.GetValue() == 0; }
+
+	/** Build settings for a source model, skipping the steps already done by Process. */
+	static void GetBuildSettings(const FSyncedMeshDesc& Desc, FMeshBuildSettings& OutSettings);
+
+	/** Fills Desc.CollisionHull with the extreme points of the mesh along the 26 k-DOP directions. */
+	static void FitCollision(FSyncedMeshDesc& Desc);
+
+	/** Reduced meshes kept for content seen again, by content hash and LOD settings. */
+	static const int32 MaxCachedLODs = 64;
+
+private:
+	void Process(FSyncedMeshDesc& Desc);
+	void GenerateLODs(FSyncedMeshDesc& Desc);
+	/**
+	 * Palette indices go in last, over LOD 0 and every LOD. Everything cached before that point
+	 * holds the colors as received, which the content hash covers.
+	 */
+	void ApplyPalette(FSyncedMeshDesc& Desc);
+
+	/** Derived data cache key of what Process makes of Desc, by content hash and the settings it depends on. */
+	static FString GetCacheKey(const FSyncedMeshDesc& Desc);
+	static void Serialize(FArchive& Ar, FSyncedMeshDesc& Desc);
+	/** Replaces the outputs of Process with cached ones, false when they cannot be used. */
+	static bool LoadCached(FSyncedMeshDesc& Desc, const TArray<uint8>& CachedData);
+
+	FMeshSyncServer* Server;
+	IMeshUtilities* MeshUtilities;
+	IMeshReduction* MeshReduction;
+	FThreadSafeCounter NumInFlight;
+
+	FCriticalSection LODCacheLock;
+	TMap<FSHAHash, TArray<FRawMesh>> LODCache;
+	// Oldest first.
+	TArray<FSHAHash> LODCacheOrder;
+};
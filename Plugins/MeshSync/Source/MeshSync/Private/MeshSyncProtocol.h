@@ -0,0 +1,328 @@
+// Copyright 1998-2019 Epic Games, Inc. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Math/Float16.h"
+
+enum class EMeshSyncCommand : uint32 {
+	SendMesh,
+	SendMaterial,
+	// uint64 tile revision followed by a SendMesh body. The revision is opaque
+	// to the server (a counter or the client's own hash), an unchanged one
+	// skips the tile and a changed one rebuilds its mesh in place.
+	SendMeshDelta,
+	// uint32 protocol version, uint32 offered EMeshSyncCodec mask, uint32
+	// MeshSyncEncodingMask bits the client can send and, since version 3, an
+	// optional uint32 EMeshSyncFeature mask. Answered with HelloAck.
+	Hello,
+	// Server to client: uint32 protocol version, uint32 chosen EMeshSyncCodec
+	// (None when compression is off), uint32 accepted encoding bits and uint32
+	// accepted EMeshSyncFeature bits.
+	HelloAck,
+	// uint32 inner command, uint32 uncompressed length, then the inner body
+	// packed with the negotiated codec.
+	Compressed,
+	// Streams one mesh over several frames, for meshes too large for a
+	// single frame. Begin: uint32 upload id, Name, Flag, TileX/Y/Z, uint64
+	// face, wedge and vertex counts, the position bounds if quantized,
+	// MaterialId, MaterialSlots, InstancePositions and InstanceColors.
+	SendMeshBegin,
+	// uint32 upload id, EMeshSyncChannel, uint64 index of the first element,
+	// then an array continuing that channel where the previous chunk ended.
+	SendMeshChunk,
+	// uint32 upload id, the mesh is complete.
+	SendMeshEnd,
+	// Server to client, when EMeshSyncFeature::Responses was negotiated:
+	// uint32 request id, EMeshSyncResponse and a String with the asset path
+	// or the reason of a failure. The request id is the index of the frame
+	// the client sent on this connection, counting its Hello as 0. A chunked
+	// upload is answered with the id of its SendMeshBegin. A rejected frame
+	// is answered with Failed under its own id before the connection closes.
+	Response,
+};
+
+enum class EMeshSyncResponse : uint32 {
+	// Decoded and queued for commit, Committed or Failed follows.
+	Accepted,
+	// Decoded and found to match an imported mesh, Committed follows with its path.
+	Deduplicated,
+	// Nothing to import: an up to date SendMeshDelta tile, or a material
+	// that already exists.
+	Unchanged,
+	Failed,
+	Committed,
+};
+
+enum class EMeshSyncFeature : uint32 {
+	None = 0,
+	// Answer every mesh and material with Response frames.
+	Responses = 1,
+};
+ENUM_CLASS_FLAGS(EMeshSyncFeature);
+
+// Array channels of a mesh, in SendMesh order.
+enum class EMeshSyncChannel : uint32 {
+	FaceMaterialIndices,
+	FaceSmoothingMasks,
+	WedgeIndices,
+	VertexPositions,
+	Normals,
+	TexCoord0,
+	TexCoord1,
+	TexCoord2,
+	WedgeColors,
+	Num
+};
+
+// Bumped whenever a command or encoding is added. Clients that never send a
+// Hello get the version 1 behaviour: plain frames and float channels only.
+const uint32 MeshSyncProtocolVersion = 3;
+
+enum class EMeshSyncCodec : uint32 {
+	None = 0,
+	Zlib = 1,
+	LZ4 = 2,
+	Oodle = 4,
+};
+ENUM_CLASS_FLAGS(EMeshSyncCodec);
+
+enum class MeshFlag : uint32 {
+	NONE = 0,
+	HAS_INDICES = 1,
+	HAS_UV0 = 2,
+	HAS_UV1 = 4,
+	HAS_NORMAL = 8,
+	HAS_COLOR_0 = 16,
+	HAS_TEX_ID = 32,
+	HAS_INSTANCE_POSITION = 64,
+	HAS_INSTANCE_COLOR0 = 128,
+	// Positions are uint16 triplets preceded by the FVector min and max of the tile bounds.
+	QUANTIZED_POSITION = 256,
+	// Normals are octahedral int16 pairs.
+	OCT_NORMAL = 512,
+	// Texture coordinates are half float pairs.
+	HALF_UV = 1024,
+	HAS_INDICES_UV01_COLOR0_TEXID = (HAS_INDICES | HAS_UV0 | HAS_UV1 | HAS_COLOR_0 | HAS_TEX_ID),
+	HAS_INDICES_INSTANCE_POS_COLOR = (HAS_INDICES | HAS_INSTANCE_POSITION | HAS_INSTANCE_COLOR0)
+};
+ENUM_CLASS_FLAGS(MeshFlag);
+
+// Encodings a client must negotiate in its Hello before using them.
+const MeshFlag MeshSyncEncodingMask = MeshFlag::QUANTIZED_POSITION | MeshFlag::OCT_NORMAL | MeshFlag::HALF_UV;
+
+enum EMaterialMS {
+	MAT_MS_TERRAIN,
+	MAT_MS_DECOR,
+	MAT_MS_KNOBS,
+	MAT_MS_WATER
+};
+
+const uint64_t MagicNumber = 0x64202114f;
+
+// Frame header, followed by Length bytes of command body.
+struct MeshSyncPayload
+{
+	uint64_t Magic;
+	uint32_t Length;
+	EMeshSyncCommand Command;
+};
+
+// Element count and byte offset of an array inside a frame body.
+struct FMeshSyncArrayView
+{
+	uint32 Num;
+	uint32 Offset;
+};
+
+// Receive granularity used while assembling a frame body.
+const uint32 MeshSyncRecvChunkSize = 256 * 1024;
+
+/**
+ * Decodes primitives, arrays and strings from a fully received frame body.
+ * Every read is bounds checked, a truncated or malformed frame fails the
+ * read instead of touching the socket stream.
+ */
+class FMeshSyncFrameReader
+{
+public:
+	FMeshSyncFrameReader(const uint8* InData, uint32 InLength)
+		: Data(InData)
+		, Length(InLength)
+		, Offset(0)
+	{}
+
+	uint32 Remaining() const { return Length - Offset; }
+	const uint8* GetCurrent() const { return Data + Offset; }
+
+	bool ReadBytes(void* Dest, uint32 Count) {
+		if (Count > Remaining())
+			return false;
+		FMemory::Memcpy(Dest, Data + Offset, Count);
+		Offset += Count;
+		return true;
+	}
+
+	template <typename T>
+	bool ReadPrim(T& Prim) {
+		return ReadBytes(&Prim, sizeof(T));
+	}
+
+	template <typename T>
+	bool ReadArray(TArray<T>& Array) {
+		uint32 Num = 0;
+		if (!ReadPrim(Num))
+			return false;
+		if ((uint64)Num * sizeof(T) > Remaining())
+			return false;
+		Array.SetNumUninitialized(Num);
+		return ReadBytes(Array.GetData(), Num * sizeof(T));
+	}
+
+	// Records where an array lives in the frame and steps over it without copying.
+	bool SkipArray(uint32 ElementSize, FMeshSyncArrayView& View) {
+		if (!ReadPrim(View.Num))
+			return false;
+		const uint64 Size = (uint64)View.Num * ElementSize;
+		if (Size > Remaining())
+			return false;
+		View.Offset = Offset;
+		Offset += (uint32)Size;
+		return true;
+	}
+
+	template <typename T>
+	bool SkipArray(FMeshSyncArrayView& View) {
+		return SkipArray(sizeof(T), View);
+	}
+
+	// Grows Array once and appends a previously skipped array to it.
+	template <typename T>
+	void AppendArray(const FMeshSyncArrayView& View, TArray<T>& Array) const {
+		const int32 Start = Array.AddUninitialized(View.Num);
+		if (View.Num > 0) {
+			FMemory::Memcpy(Array.GetData() + Start, Data + View.Offset, View.Num * sizeof(T));
+		}
+	}
+
+	// Like AppendArray, for channels whose wire element has to be expanded.
+	template <typename TWire, typename T, typename FConvert>
+	void AppendConvertedArray(const FMeshSyncArrayView& View, TArray<T>& Array, FConvert Convert) const {
+		const int32 Start = Array.AddUninitialized(View.Num);
+		const uint8* Src = Data + View.Offset;
+		for (uint32 i = 0; i < View.Num; i++, Src += sizeof(TWire)) {
+			TWire Wire;
+			FMemory::Memcpy(&Wire, Src, sizeof(TWire));
+			Array[Start + i] = Convert(Wire);
+		}
+	}
+
+	template <typename T>
+	void CopyArray(const FMeshSyncArrayView& View, TArray<T>& Array) const {
+		Array.Reset();
+		AppendArray(View, Array);
+	}
+
+	bool ReadString(FString& Str) {
+		uint32 Num = 0;
+		if (!ReadPrim(Num) || Num > Remaining())
+			return false;
+		// Stop at an embedded terminator, matching clients that count the trailing zero.
+		const ANSICHAR* Src = (const ANSICHAR*)(Data + Offset);
+		int32 StrLen = 0;
+		while ((uint32)StrLen < Num && Src[StrLen]) {
+			StrLen++;
+		}
+		Str = FString(StrLen, Src);
+		Offset += Num;
+		return true;
+	}
+
+	bool ReadStringList(TArray<FString>& StrList) {
+		uint32 Count = 0;
+		if (!ReadPrim(Count))
+			return false;
+		for (uint32 i = 0; i < Count; i++) {
+			FString ReadStr;
+			if (!ReadString(ReadStr))
+				return false;
+			StrList.Add(ReadStr);
+		}
+		return true;
+	}
+
+private:
+	const uint8*	Data;
+	uint32			Length;
+	uint32			Offset;
+};
+
+/** Appends primitives to an outgoing frame body. */
+class FMeshSyncFrameWriter
+{
+public:
+	explicit FMeshSyncFrameWriter(TArray<uint8>& InBuffer)
+		: Buffer(InBuffer)
+	{}
+
+	void WriteBytes(const void* Src, uint32 Count) {
+		Buffer.Append((const uint8*)Src, Count);
+	}
+
+	template <typename T>
+	void WritePrim(const T& Prim) {
+		WriteBytes(&Prim, sizeof(T));
+	}
+
+	template <typename T>
+	void WriteArray(const TArray<T>& Array) {
+		WritePrim((uint32)Array.Num());
+		WriteBytes(Array.GetData(), Array.Num() * sizeof(T));
+	}
+
+	void WriteString(const FString& Str) {
+		auto Ansi = StringCast<ANSICHAR>(*Str);
+		WritePrim((uint32)Ansi.Length());
+		WriteBytes(Ansi.Get(), Ansi.Length());
+	}
+
+	// Frame header followed by Body, as read by FMeshSyncConnection.
+	static void AppendFrame(TArray<uint8>& Out, EMeshSyncCommand Command, const TArray<uint8>& Body) {
+		MeshSyncPayload Payload;
+		Payload.Magic = MagicNumber;
+		Payload.Length = Body.Num();
+		Payload.Command = Command;
+		Out.Append((const uint8*)&Payload, sizeof(Payload));
+		Out.Append(Body);
+	}
+
+private:
+	TArray<uint8>& Buffer;
+};
+
+struct FMeshSyncQuantizedPosition
+{
+	uint16 X, Y, Z;
+};
+
+struct FMeshSyncOctNormal
+{
+	int16 X, Y;
+};
+
+struct FMeshSyncHalfUV
+{
+	FFloat16 U, V;
+};
+
+static_assert(sizeof(FColor) == 4, "Size of FColor invalid");
+static_assert(sizeof(FMeshSyncQuantizedPosition) == 6, "Size of FMeshSyncQuantizedPosition invalid");
+static_assert(sizeof(FMeshSyncHalfUV) == 4, "Size of FMeshSyncHalfUV invalid");
+
+// Array channels of a SendMesh frame, gathered before any of them is decoded.
+struct FMeshSyncMeshLayout
+{
+	FMeshSyncArrayView Channels[(int32)EMeshSyncChannel::Num];
+	FMeshSyncArrayView InstancePositions;
+	FMeshSyncArrayView InstanceColors;
+};
@@ -0,0 +1,85 @@
+// Copyright 1998-2019 Epic Games, Inc. All Rights Reserved.
+
+#include "MeshSyncSaver.h"
+#include "MeshSync.h"
+#include "MeshSyncStats.h"
+
+#include "Editor.h"
+#include "Misc/PackageName.h"
+#include "UObject/Package.h"
+#include "UObject/UObjectGlobals.h"
+
+FMeshSyncSaver::FMeshSyncSaver()
+	: NumSaved(0)
+	, NumFailed(0)
+{
+}
+
+FMeshSyncSaver::~FMeshSyncSaver()
+{
+	// Files still being written must be complete before the packages go away.
+	UPackage::WaitForAsyncFileWrites();
+}
+
+void FMeshSyncSaver::Enqueue(UPackage* Package)
+{
+	bool bAlreadyQueued = false;
+	Queued.Add(Package, &bAlreadyQueued);
+	if (!bAlreadyQueued)
+	{
+		Queue.Add(Package);
+	}
+}
+
+void FMeshSyncSaver::Tick(double TimeBudget)
+{
+	if (Queue.Num() == 0 || GIsSavingPackage || IsGarbageCollecting() || (GEditor && GEditor->PlayWorld))
+	{
+		return;
+	}
+
+	MESHSYNC_SCOPE(STAT_MeshSync_SavePackages);
+	const double StartTime = FPlatformTime::Seconds();
+	int32 NumProcessed = 0;
+	while (NumProcessed < Queue.Num())
+	{
+		TWeakObjectPtr<UPackage> Package = Queue[NumProcessed++];
+		Queued.Remove(Package);
+		if (Package.IsValid() && Package->IsDirty())
+		{
+			if (SavePackage(Package.Get())) {
+				NumSaved++;
+			} else {
+				NumFailed++;
+			}
+		}
+
+		if (FPlatformTime::Seconds() - StartTime >= TimeBudget)
+		{
+			break;
+		}
+	}
+	Queue.RemoveAt(0, NumProcessed, false);
+
+	if (Queue.Num() == 0 && NumSaved + NumFailed > 0)
+	{
+		UE_LOG(LogMeshSync, Display, TEXT("Saved %d MeshSync packages, %d failed"), NumSaved, NumFailed);
+		NumSaved = 0;
+		NumFailed = 0;
+	}
+}
+
+bool FMeshSyncSaver::SavePackage(UPackage* Package)
+{
+	const FString PackageName = Package->GetName();
+	const FString Filename = FPackageName::LongPackageNameToFilename(PackageName, FPackageName::GetAssetPackageExtension());
+
+	// The file is written on a background thread, the package is clean once it is serialized.
+	const bool bSaved = UPackage::SavePackage(Package, nullptr, RF_Standalone, *Filename, GError, nullptr,
+		false, true, SAVE_NoError | SAVE_Async);
+	if (!bSaved)
+	{
+		UE_LOG(LogMeshSync, Warning, TEXT("Unable to save %s to %s"), *PackageName, *Filename);
+	}
+	return bSaved;
+}
@@ -0,0 +1,40 @@
+// Copyright 1998-2019 Epic Games, Inc. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "UObject/WeakObjectPtr.h"
+
+class UPackage;
+
+/**
+ * Saves packages of committed assets a few at a time, so a large sync does
+ * not end in a single blocking Save All. Packages are serialized on the game
+ * thread within a time budget per frame, their files are written in
+ * parallel by the async file writers.
+ *
+ * Game thread only.
+ */
+class FMeshSyncSaver
+{
+public:
+	FMeshSyncSaver();
+	~FMeshSyncSaver();
+
+	/** Queues a package for saving, it is skipped if nothing dirtied it by the time its turn comes. */
+	void Enqueue(UPackage* Package);
+
+	/** Saves queued packages until TimeBudget seconds have passed, at least one per call. */
+	void Tick(double TimeBudget);
+
+	int32 Num() const { return Queue.Num(); }
+
+private:
+	bool SavePackage(UPackage* Package);
+
+	TArray<TWeakObjectPtr<UPackage>> Queue;
+	TSet<TWeakObjectPtr<UPackage>> Queued;
+	// Since the queue last drained.
+	int32 NumSaved;
+	int32 NumFailed;
+};
@@ -0,0 +1,498 @@
+// Copyright 1998-2019 Epic Games, Inc. All Rights Reserved.
+
+#include "MeshSyncScene.h"
+#include "MeshSync.h"
+#include "MeshSyncSettings.h"
+#include "MeshSyncServer.h"
+
+#include "Components/HierarchicalInstancedStaticMeshComponent.h"
+#include "Engine/Level.h"
+#include "Engine/LevelStreamingDynamic.h"
+#include "Engine/StaticMesh.h"
+#include "Engine/World.h"
+#include "GameFramework/Actor.h"
+#include "Misc/PackageName.h"
+#include "Editor.h"
+#include "EditorLevelUtils.h"
+
+// Marks the actor holding a cell's synced instances, so a later session finds it again.
+static FName GetSceneActorTag(const FIntVector& Cell, bool bStreaming)
+{
+	return bStreaming ? FName(*FString::Printf(TEXT("MeshSyncCell_%d_%d_%d"), Cell.X, Cell.Y, Cell.Z)) : FName(TEXT("MeshSyncScene"));
+}
+
+// First component tag of a component whose other tags name the tile of each instance.
+static const FName InstanceTilesTag(TEXT("MeshSyncInstanceTiles"));
+
+static AActor* FindSceneActor(ULevel* Level, FName Tag)
+{
+	for (AActor* Actor : Level->Actors)
+	{
+		if (Actor && !Actor->IsPendingKill() && Actor->ActorHasTag(Tag))
+		{
+			return Actor;
+		}
+	}
+	return NULL;
+}
+
+FMeshSyncScene::FMeshSyncScene(const FString& InLevelsPath)
+	: LevelsPath(InLevelsPath)
+{
+}
+
+void FMeshSyncScene::PlaceTile(UStaticMesh* Mesh, const FSyncedMeshDesc& Desc)
+{
+	const UMeshSyncSettings* Settings = GetDefault<UMeshSyncSettings>();
+	const FVector TileOrigin = FVector(Desc.TileX, Desc.TileY, Desc.TileZ) * Settings->TileSize;
+
+	int32 TileId = INDEX_NONE;
+	if (const int32* Found = TileIds.Find(Desc.Name))
+	{
+		TileId = *Found;
+	}
+	else
+	{
+		TileId = Tiles.AddDefaulted();
+		TileIds.Add(Desc.Name, TileId);
+		Tiles[TileId].Name = FName(*Desc.Name);
+	}
+
+	FTilePlacement& Placement = Tiles[TileId];
+	Placement.Key.Mesh = Mesh;
+	Placement.Key.Cell = FIntVector::ZeroValue;
+	if (Settings->bStreamTilesByCell)
+	{
+		const int32 CellSize = FMath::Max(Settings->StreamingCellSize, 1);
+		Placement.Key.Cell = FIntVector(Desc.TileX / CellSize, Desc.TileY / CellSize, Desc.TileZ / CellSize);
+	}
+	Placement.Transforms.Reset();
+	if (Desc.InstancePositions.Num() > 0)
+	{
+		for (const FVector& Position : Desc.InstancePositions)
+		{
+			Placement.Transforms.Add(FTransform(TileOrigin + Position));
+		}
+	}
+	else
+	{
+		Placement.Transforms.Add(FTransform(TileOrigin));
+	}
+	DirtyTiles.Add(TileId);
+}
+
+void FMeshSyncScene::RemoveTile(const FString& Name)
+{
+	if (const int32* TileId = TileIds.Find(Name))
+	{
+		Tiles[*TileId].Key.Mesh = NULL;
+		DirtyTiles.Add(*TileId);
+	}
+}
+
+void FMeshSyncScene::DeferMesh(UStaticMesh* Mesh)
+{
+	DeferredMeshes.Add(Mesh);
+}
+
+void FMeshSyncScene::ResumeMesh(UStaticMesh* Mesh)
+{
+	// Its tiles stayed dirty while it was deferred.
+	DeferredMeshes.Remove(Mesh);
+}
+
+void FMeshSyncScene::Flush()
+{
+	UWorld* World = GEditor ? GEditor->GetEditorWorldContext().World() : NULL;
+	if (DirtyTiles.Num() == 0 || !World)
+	{
+		return;
+	}
+
+	// Components deleted in the editor take their instances along, their tiles are placed again.
+	TArray<FComponentKey> Deleted;
+	for (const auto& Entry : Components)
+	{
+		if (!Entry.Value.Component.IsValid())
+		{
+			Deleted.Add(Entry.Key);
+		}
+	}
+	for (const FComponentKey& Key : Deleted)
+	{
+		ResetComponent(Key);
+	}
+
+	if (GetDefault<UMeshSyncSettings>()->bStreamTilesByCell)
+	{
+		AdoptLoadedCells(World);
+	}
+
+	// Actors next, a replaced actor puts every tile of its cell back in the dirty set.
+	TSet<FIntVector> Cells;
+	for (int32 TileId : DirtyTiles)
+	{
+		Cells.Add(Tiles[TileId].Key.Cell);
+	}
+	for (const FIntVector& Cell : Cells)
+	{
+		EnsureCellActor(World, Cell);
+	}
+
+	TSet<UHierarchicalInstancedStaticMeshComponent*> Touched;
+	for (auto It = DirtyTiles.CreateIterator(); It; ++It)
+	{
+		if (ApplyTile(*It, Touched))
+		{
+			It.RemoveCurrent();
+		}
+	}
+
+	for (const auto& Entry : Components)
+	{
+		if (Touched.Contains(Entry.Value.Component.Get()))
+		{
+			WriteInstanceTiles(Entry.Value);
+		}
+	}
+
+	// One tree build per touched component for the whole batch.
+	for (UHierarchicalInstancedStaticMeshComponent* Component : Touched)
+	{
+		if (Component->GetInstanceCount() > 0)
+		{
+			Component->BuildTreeIfOutdated(true, false);
+			continue;
+		}
+		for (auto It = Components.CreateIterator(); It; ++It)
+		{
+			if (It->Value.Component.Get() == Component)
+			{
+				It.RemoveCurrent();
+				break;
+			}
+		}
+		Component->DestroyComponent();
+	}
+}
+
+bool FMeshSyncScene::ApplyTile(int32 TileId, TSet<UHierarchicalInstancedStaticMeshComponent*>& OutTouched)
+{
+	FTilePlacement& Placement = Tiles[TileId];
+	// Removed, or only known from a saved component that went away.
+	if (!Placement.Key.Mesh.IsValid() || Placement.Transforms.Num() == 0)
+	{
+		RemoveTileInstances(Placement, OutTouched);
+		return true;
+	}
+	// Registering a component would cook the collision on the game thread.
+	if (DeferredMeshes.Contains(Placement.Key.Mesh))
+	{
+		return false;
+	}
+	const TWeakObjectPtr<AActor>* Actor = CellActors.Find(Placement.Key.Cell);
+	if (!Actor || !Actor->IsValid())
+	{
+		return false;
+	}
+
+	// Same component and instance count, the instances are moved where they are.
+	if (Placement.AppliedKey == Placement.Key && Placement.Instances.Num() > 0 && Placement.Instances.Num() == Placement.Transforms.Num())
+	{
+		FComponentState* State = Components.Find(Placement.Key);
+		if (State && State->Component.IsValid())
+		{
+			UHierarchicalInstancedStaticMeshComponent* Component = State->Component.Get();
+			for (int32 Index = 0; Index < Placement.Instances.Num(); Index++)
+			{
+				Component->UpdateInstanceTransform(Placement.Instances[Index], Placement.Transforms[Index], false, false, true);
+			}
+			OutTouched.Add(Component);
+			return true;
+		}
+	}
+
+	RemoveTileInstances(Placement, OutTouched);
+	FComponentState* State = EnsureComponent(Placement.Key);
+	UHierarchicalInstancedStaticMeshComponent* Component = State->Component.Get();
+	for (const FTransform& Transform : Placement.Transforms)
+	{
+		Placement.Instances.Add(Component->AddInstance(Transform));
+		State->InstanceTiles.Add(TileId);
+	}
+	Placement.AppliedKey = Placement.Key;
+	OutTouched.Add(Component);
+	return true;
+}
+
+void FMeshSyncScene::RemoveTileInstances(FTilePlacement& Placement, TSet<UHierarchicalInstancedStaticMeshComponent*>& OutTouched)
+{
+	FComponentState* State = Placement.Instances.Num() > 0 ? Components.Find(Placement.AppliedKey) : NULL;
+	UHierarchicalInstancedStaticMeshComponent* Component = State ? State->Component.Get() : NULL;
+	if (Component)
+	{
+		// The component fills a removed slot with its last instance. Highest first, so that
+		// instance never belongs to this tile and its owner's index can be patched.
+		Placement.Instances.Sort(TGreater<int32>());
+		for (int32 Index : Placement.Instances)
+		{
+			const int32 Last = State->InstanceTiles.Num() - 1;
+			Component->RemoveInstance(Index);
+			if (Index != Last)
+			{
+				TArray<int32>& MovedInstances = Tiles[State->InstanceTiles[Last]].Instances;
+				const int32 Moved = MovedInstances.Find(Last);
+				if (ensure(Moved != INDEX_NONE))
+				{
+					MovedInstances[Moved] = Index;
+				}
+			}
+			State->InstanceTiles.RemoveAtSwap(Index, 1, false);
+		}
+		OutTouched.Add(Component);
+	}
+	Placement.Instances.Reset();
+}
+
+FMeshSyncScene::FComponentState* FMeshSyncScene::EnsureComponent(const FComponentKey& Key)
+{
+	FComponentState& State = Components.FindOrAdd(Key);
+	if (!State.Component.IsValid())
+	{
+		AActor* Actor = CellActors[Key.Cell].Get();
+		UHierarchicalInstancedStaticMeshComponent* Component = NewObject<UHierarchicalInstancedStaticMeshComponent>(Actor, NAME_None, RF_Transactional);
+		Component->SetStaticMesh(Key.Mesh.Get());
+		Component->bAutoRebuildTreeOnInstanceChanges = false;
+		Component->SetupAttachment(Actor->GetRootComponent());
+		Actor->AddInstanceComponent(Component);
+		Component->RegisterComponent();
+		State.Component = Component;
+		State.InstanceTiles.Reset();
+	}
+	return &State;
+}
+
+void FMeshSyncScene::AdoptComponent(UHierarchicalInstancedStaticMeshComponent* Component, const FComponentKey& Key)
+{
+	Component->bAutoRebuildTreeOnInstanceChanges = false;
+	FComponentState& State = Components.Add(Key);
+	State.Component = Component;
+
+	// Without tags for every instance (saved before they were written, or edited since) the instances are left as they are.
+	const TArray<FName>& Tags = Component->ComponentTags;
+	const int32 NumInstances = Component->GetInstanceCount();
+	const bool bTagged = Tags.Num() == NumInstances + 1 && Tags[0] == InstanceTilesTag;
+	int32 UntaggedId = INDEX_NONE;
+	int32 StaleId = INDEX_NONE;
+	for (int32 Instance = 0; Instance < NumInstances; Instance++)
+	{
+		const FName Name = bTagged ? Tags[Instance + 1] : NAME_None;
+		int32 TileId = INDEX_NONE;
+		if (Name.IsNone())
+		{
+			if (UntaggedId == INDEX_NONE)
+			{
+				UntaggedId = Tiles.AddDefaulted();
+				Tiles[UntaggedId].Key = Key;
+				Tiles[UntaggedId].AppliedKey = Key;
+			}
+			TileId = UntaggedId;
+		}
+		else if (const int32* Found = TileIds.Find(Name.ToString()))
+		{
+			// Already placed elsewhere this session, the saved instance is a leftover.
+			const FTilePlacement& Placement = Tiles[*Found];
+			const bool bOwned = Placement.Key == Key && (Placement.Instances.Num() == 0 || Placement.AppliedKey == Key);
+			if (!bOwned && StaleId == INDEX_NONE)
+			{
+				StaleId = Tiles.AddDefaulted();
+				Tiles[StaleId].Key.Cell = Key.Cell;
+				Tiles[StaleId].AppliedKey = Key;
+				DirtyTiles.Add(StaleId);
+			}
+			TileId = bOwned ? *Found : StaleId;
+		}
+		else
+		{
+			// Not synced this session, its instances stay until it is.
+			TileId = Tiles.AddDefaulted();
+			TileIds.Add(Name.ToString(), TileId);
+			Tiles[TileId].Name = Name;
+			Tiles[TileId].Key = Key;
+		}
+
+		FTilePlacement& Placement = Tiles[TileId];
+		Placement.AppliedKey = Key;
+		Placement.Instances.Add(Instance);
+		State.InstanceTiles.Add(TileId);
+	}
+}
+
+void FMeshSyncScene::WriteInstanceTiles(const FComponentState& State)
+{
+	UHierarchicalInstancedStaticMeshComponent* Component = State.Component.Get();
+	TArray<FName>& Tags = Component->ComponentTags;
+	Tags.Reset(State.InstanceTiles.Num() + 1);
+	Tags.Add(InstanceTilesTag);
+	for (int32 TileId : State.InstanceTiles)
+	{
+		Tags.Add(Tiles[TileId].Name);
+	}
+	Component->MarkPackageDirty();
+}
+
+void FMeshSyncScene::ResetComponent(const FComponentKey& Key)
+{
+	FComponentState* State = Components.Find(Key);
+	if (!State)
+	{
+		return;
+	}
+	for (int32 TileId : State->InstanceTiles)
+	{
+		Tiles[TileId].Instances.Reset();
+		DirtyTiles.Add(TileId);
+	}
+	Components.Remove(Key);
+}
+
+AActor* FMeshSyncScene::EnsureCellActor(UWorld* World, const FIntVector& Cell)
+{
+	TWeakObjectPtr<AActor>& CellActor = CellActors.FindOrAdd(Cell);
+	if (CellActor.IsValid())
+	{
+		return CellActor.Get();
+	}
+
+	// A new world (or a deleted actor), none of the cell's components are there any more.
+	TArray<FComponentKey> Stale;
+	for (const auto& Entry : Components)
+	{
+		if (Entry.Key.Cell == Cell)
+		{
+			Stale.Add(Entry.Key);
+		}
+	}
+	for (const FComponentKey& Key : Stale)
+	{
+		ResetComponent(Key);
+	}
+
+	const bool bStreaming = GetDefault<UMeshSyncSettings>()->bStreamTilesByCell;
+	ULevel* Level = bStreaming ? GetCellLevel(World, Cell) : World->PersistentLevel;
+	const FName Tag = GetSceneActorTag(Cell, bStreaming);
+	AActor* Actor = FindSceneActor(Level, Tag);
+	if (Actor)
+	{
+		// Saved by an earlier session, its components and their instances are taken over.
+		TArray<UHierarchicalInstancedStaticMeshComponent*> Existing;
+		Actor->GetComponents(Existing);
+		for (UHierarchicalInstancedStaticMeshComponent* Component : Existing)
+		{
+			FComponentKey Key;
+			Key.Mesh = Component->GetStaticMesh();
+			Key.Cell = Cell;
+			if (Key.Mesh.IsValid() && !Components.Contains(Key))
+			{
+				AdoptComponent(Component, Key);
+			}
+		}
+	}
+	else
+	{
+		FActorSpawnParameters SpawnParameters;
+		SpawnParameters.OverrideLevel = Level;
+		Actor = World->SpawnActor<AActor>(AActor::StaticClass(), FTransform::Identity, SpawnParameters);
+		if (!Actor)
+		{
+			return NULL;
+		}
+		USceneComponent* Root = NewObject<USceneComponent>(Actor, TEXT("Root"));
+		Actor->SetRootComponent(Root);
+		Actor->AddInstanceComponent(Root);
+		Root->RegisterComponent();
+		Actor->SetActorLabel(Tag.ToString());
+		Actor->Tags.Add(Tag);
+	}
+	CellActor = Actor;
+	return Actor;
+}
+
+void FMeshSyncScene::AdoptLoadedCells(UWorld* World)
+{
+	if (AdoptedWorld == World)
+	{
+		return;
+	}
+	AdoptedWorld = World;
+
+	TArray<FIntVector> LoadedCells;
+	for (ULevelStreaming* StreamingLevel : World->GetStreamingLevels())
+	{
+		if (!StreamingLevel || !StreamingLevel->GetLoadedLevel())
+		{
+			continue;
+		}
+		const FString PackageName = StreamingLevel->GetWorldAssetPackageName();
+		TArray<FString> Parts;
+		if (PackageName.StartsWith(LevelsPath) &&
+			PackageName.Mid(LevelsPath.Len()).ParseIntoArray(Parts, TEXT("_")) == 4 && Parts[0] == TEXT("Cell"))
+		{
+			const FIntVector Cell(FCString::Atoi(*Parts[1]), FCString::Atoi(*Parts[2]), FCString::Atoi(*Parts[3]));
+			if (FindSceneActor(StreamingLevel->GetLoadedLevel(), GetSceneActorTag(Cell, true)))
+			{
+				LoadedCells.Add(Cell);
+			}
+		}
+	}
+	for (const FIntVector& Cell : LoadedCells)
+	{
+		EnsureCellActor(World, Cell);
+	}
+}
+
+ULevel* FMeshSyncScene::GetCellLevel(UWorld* World, const FIntVector& Cell)
+{
+	const FString PackageName = FString::Printf(TEXT("%sCell_%d_%d_%d"), *LevelsPath, Cell.X, Cell.Y, Cell.Z);
+	for (ULevelStreaming* StreamingLevel : World->GetStreamingLevels())
+	{
+		if (!StreamingLevel || StreamingLevel->GetWorldAssetPackageName() != PackageName)
+		{
+			continue;
+		}
+		// Unloaded in the editor, adding it again would list the level twice.
+		if (!StreamingLevel->GetLoadedLevel())
+		{
+			StreamingLevel->SetShouldBeLoaded(true);
+			StreamingLevel->SetShouldBeVisibleInEditor(true);
+			World->FlushLevelStreaming();
+		}
+		if (!StreamingLevel->GetLoadedLevel())
+		{
+			UE_LOG(LogMeshSync, Warning, TEXT("Unable to load streaming level %s, its tiles are placed in the persistent level"), *PackageName);
+			return World->PersistentLevel;
+		}
+		return StreamingLevel->GetLoadedLevel();
+	}
+
+	// Creating a level makes it current, tiles of other cells must not follow it.
+	ULevel* CurrentLevel = World->GetCurrentLevel();
+	ULevelStreaming* StreamingLevel = NULL;
+	if (FPackageName::DoesPackageExist(PackageName))
+	{
+		StreamingLevel = EditorLevelUtils::AddLevelToWorld(World, *PackageName, ULevelStreamingDynamic::StaticClass());
+	}
+	else
+	{
+		const FString Filename = FPackageName::LongPackageNameToFilename(PackageName, FPackageName::GetMapPackageExtension());
+		StreamingLevel = EditorLevelUtils::CreateNewStreamingLevelForWorld(*World, ULevelStreamingDynamic::StaticClass(), Filename);
+	}
+	World->SetCurrentLevel(CurrentLevel);
+
+	if (!StreamingLevel || !StreamingLevel->GetLoadedLevel())
+	{
+		UE_LOG(LogMeshSync, Warning, TEXT("Unable to create streaming level %s, its tiles are placed in the persistent level"), *PackageName);
+		return World->PersistentLevel;
+	}
+	return StreamingLevel->GetLoadedLevel();
+}
@@ -0,0 +1,107 @@
+// Copyright 1998-2019 Epic Games, Inc. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "UObject/WeakObjectPtr.h"
+
+class AActor;
+class ULevel;
+class UWorld;
+class UStaticMesh;
+class UHierarchicalInstancedStaticMeshComponent;
+class FSyncedMeshDesc;
+
+/**
+ * Places committed tiles in the editor world. Every distinct mesh gets one
+ * hierarchical instanced component on a shared scene actor, so tiles that
+ * resolve to the same mesh (repeated bricks, deduplicated tiles, the
+ * instance positions a tile carries) render as instances of it.
+ *
+ * With bStreamTilesByCell the world is split into cells of StreamingCellSize
+ * tiles, each with its own streaming sub-level and scene actor, so only the
+ * cells around the player need to be loaded at runtime.
+ *
+ * Game thread only.
+ */
+class FMeshSyncScene
+{
+public:
+	/** Sub-levels are created under InLevelsPath. */
+	FMeshSyncScene(const FString& InLevelsPath);
+
+	/** Sets where a tile appears, replacing its previous placement. */
+	void PlaceTile(UStaticMesh* Mesh, const FSyncedMeshDesc& Desc);
+	/** Takes a tile's instances out of the level on the next flush. */
+	void RemoveTile(const FString& Name);
+
+	/** Keeps a mesh out of the level until ResumeMesh, while its collision cooks. */
+	void DeferMesh(UStaticMesh* Mesh);
+	void ResumeMesh(UStaticMesh* Mesh);
+
+	/** Moves the instances of tiles placed since the last flush, only the components they touch are rebuilt. */
+	void Flush();
+
+private:
+	typedef TWeakObjectPtr<UStaticMesh> FMeshKey;
+
+	// One instance component, a mesh within a cell.
+	struct FComponentKey
+	{
+		FMeshKey Mesh;
+		FIntVector Cell;
+
+		bool operator==(const FComponentKey& Other) const { return Mesh == Other.Mesh && Cell == Other.Cell; }
+		friend uint32 GetTypeHash(const FComponentKey& Key) { return HashCombine(GetTypeHash(Key.Mesh), GetTypeHash(Key.Cell)); }
+	};
+
+	struct FTilePlacement
+	{
+		// None for instances saved without a tile.
+		FName Name;
+		// Where PlaceTile wants the tile.
+		FComponentKey Key;
+		TArray<FTransform> Transforms;
+		// Where Flush last put it, indices into the instances of that component.
+		FComponentKey AppliedKey;
+		TArray<int32> Instances;
+	};
+
+	struct FComponentState
+	{
+		TWeakObjectPtr<UHierarchicalInstancedStaticMeshComponent> Component;
+		// Tile of every instance, by instance index. Saved with the component as its tags.
+		TArray<int32> InstanceTiles;
+	};
+
+	/** The cell's scene actor, found in or spawned into its level when it has none. */
+	AActor* EnsureCellActor(UWorld* World, const FIntVector& Cell);
+	/**
+	 * Takes over the scene actors of every loaded cell sub-level once per world, so the saved
+	 * instances of a tile that moved to another cell are found even when its old cell gets no tiles.
+	 */
+	void AdoptLoadedCells(UWorld* World);
+	/** The cell's sub-level, loaded, added to the world or created as needed. */
+	ULevel* GetCellLevel(UWorld* World, const FIntVector& Cell);
+	/** Moves a tile's instances to where it was last placed, false while that is not possible yet. */
+	bool ApplyTile(int32 TileId, TSet<UHierarchicalInstancedStaticMeshComponent*>& OutTouched);
+	void RemoveTileInstances(FTilePlacement& Placement, TSet<UHierarchicalInstancedStaticMeshComponent*>& OutTouched);
+	FComponentState* EnsureComponent(const FComponentKey& Key);
+	/**
+	 * Takes over a component saved by an earlier session. Its instances go back to the tiles
+	 * its tags name, tiles synced again later move only their own instances.
+	 */
+	void AdoptComponent(UHierarchicalInstancedStaticMeshComponent* Component, const FComponentKey& Key);
+	void WriteInstanceTiles(const FComponentState& State);
+	/** Forgets the instances of every tile in a component that went away, they are placed again on the next flush. */
+	void ResetComponent(const FComponentKey& Key);
+
+	FString LevelsPath;
+	TMap<FString, int32> TileIds;
+	TArray<FTilePlacement> Tiles;
+	TMap<FComponentKey, FComponentState> Components;
+	TSet<int32> DirtyTiles;
+	TSet<FMeshKey> DeferredMeshes;
+	TMap<FIntVector, TWeakObjectPtr<AActor>> CellActors;
+	TWeakObjectPtr<UWorld> AdoptedWorld;
+};
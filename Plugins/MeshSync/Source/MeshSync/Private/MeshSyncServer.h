@@ -0,0 +1,464 @@
+// Copyright 1998-2019 Epic Games, Inc. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "MeshSyncProtocol.h"
+#include "MeshSyncDescPool.h"
+#include "RawMesh.h"
+
+#include "HAL/ThreadSafeCounter.h"
+#include "HAL/ThreadSafeCounter64.h"
+#include "HAL/Runnable.h"
+#include "Misc/ScopeLock.h"
+#include "Misc/SecureHash.h"
+#include "Sockets.h"
+#include "UObject/SoftObjectPath.h"
+
+class FSocket;
+class FInternetAddr;
+class FRunnableThread;
+class FQueuedThreadPool;
+class UMaterialInterface;
+class UMaterialInstanceConstant;
+class FMeshSyncCommitQueue;
+class FMeshSyncPreprocessor;
+class FMeshSyncAssetIndex;
+class FMeshSyncCapture;
+class FMeshSyncMaterialResolver;
+class FMeshSyncPalette;
+class FMeshSyncMerger;
+struct FMeshSyncMergeBatch;
+
+class FMeshSyncServer;
+class FMeshSyncConnection;
+
+typedef TWeakPtr<FMeshSyncConnection, ESPMode::ThreadSafe> FMeshSyncConnectionWeakPtr;
+
+class FSyncedMeshDesc
+{
+public:
+	FSyncedMeshDesc()
+		: bDuplicate(false)
+		, Revision(0)
+		, bUpdateInPlace(false)
+		, bPreprocessed(false)
+		, bMerged(false)
+		, bRemoved(false)
+		, LightmapCoordinateIndex(INDEX_NONE)
+		, bInFlight(false)
+		, InFlightBytes(0)
+		, RequestId(0)
+	{}
+
+	// Back to a default descriptor, arrays keep their allocations.
+	void Reset() {
+		Name.Reset();
+		RawMesh.FaceMaterialIndices.Reset();
+		RawMesh.FaceSmoothingMasks.Reset();
+		RawMesh.VertexPositions.Reset();
+		RawMesh.WedgeIndices.Reset();
+		RawMesh.WedgeTangentX.Reset();
+		RawMesh.WedgeTangentY.Reset();
+		RawMesh.WedgeTangentZ.Reset();
+		for (int32 Channel = 0; Channel < MAX_MESH_TEXTURE_COORDS; Channel++) {
+			RawMesh.WedgeTexCoords[Channel].Reset();
+		}
+		RawMesh.WedgeColors.Reset();
+		MaterialSlots.Reset();
+		TileX = TileY = TileZ = 0;
+		InstancePositions.Reset();
+		InstanceColors.Reset();
+		SlotMaterials.Reset();
+		LODMeshes.Reset();
+		CollisionHull.Reset();
+		ContentHash = FSHAHash();
+		bDuplicate = false;
+		Revision = 0;
+		bUpdateInPlace = false;
+		bPreprocessed = false;
+		bMerged = false;
+		bRemoved = false;
+		MergeBatch.Reset();
+		LightmapCoordinateIndex = INDEX_NONE;
+		Requester.Reset();
+		RequestId = 0;
+		check(!bInFlight);
+	}
+
+	SIZE_T GetAllocatedSize() const {
+		SIZE_T Size = GetAllocatedSize(RawMesh);
+		for (const FRawMesh& LODMesh : LODMeshes) {
+			Size += GetAllocatedSize(LODMesh);
+		}
+		return Size + InstancePositions.GetAllocatedSize() + InstanceColors.GetAllocatedSize() + CollisionHull.GetAllocatedSize();
+	}
+
+	static SIZE_T GetAllocatedSize(const FRawMesh& Mesh) {
+		SIZE_T Size = Mesh.FaceMaterialIndices.GetAllocatedSize() + Mesh.FaceSmoothingMasks.GetAllocatedSize() +
+			Mesh.VertexPositions.GetAllocatedSize() + Mesh.WedgeIndices.GetAllocatedSize() +
+			Mesh.WedgeTangentX.GetAllocatedSize() + Mesh.WedgeTangentY.GetAllocatedSize() +
+			Mesh.WedgeTangentZ.GetAllocatedSize() + Mesh.WedgeColors.GetAllocatedSize();
+		for (int32 Channel = 0; Channel < MAX_MESH_TEXTURE_COORDS; Channel++) {
+			Size += Mesh.WedgeTexCoords[Channel].GetAllocatedSize();
+		}
+		return Size;
+	}
+
+	FString		Name;
+	FRawMesh	RawMesh;
+	TArray<FString>		MaterialSlots;
+	// Materials the slots resolved to while decoding, null paths are resolved at commit
+	TArray<FSoftObjectPath>	SlotMaterials;
+	// Tile ID
+	uint32		TileX;
+	uint32		TileY;
+	uint32		TileZ;
+	// Per-instance placement relative to the tile, empty for a single instance
+	TArray<FVector>		InstancePositions;
+	TArray<FColor>		InstanceColors;
+	// Hash of the geometry as received, see FMeshSyncAssetIndex::HashMesh
+	FSHAHash	ContentHash;
+	// Content already imported, the commit resolves it to the existing asset
+	bool		bDuplicate;
+	// Revision carried by SendMeshDelta
+	uint64		Revision;
+	// Rebuild the tile's existing mesh instead of skipping it
+	bool		bUpdateInPlace;
+	// Normals and tangents already computed by FMeshSyncPreprocessor
+	bool		bPreprocessed;
+	// Built by FMeshSyncMerger from the tiles of a cell
+	bool		bMerged;
+	// A merged mesh its cell no longer produces, the commit takes it out of the level and the index
+	bool		bRemoved;
+	// Merge of the cell this mesh came from, told about the commit
+	TSharedPtr<FMeshSyncMergeBatch, ESPMode::ThreadSafe>	MergeBatch;
+	// UV channel holding generated lightmap UVs, INDEX_NONE lets the build generate them
+	int32		LightmapCoordinateIndex;
+	// Reduced meshes for UMeshSyncSettings::LODs, empty leaves the reduction to the build
+	TArray<FRawMesh>	LODMeshes;
+	// Points spanning the simple collision, see FMeshSyncPreprocessor::FitCollision
+	TArray<FVector>		CollisionHull;
+	// Counted against the server's in-flight budget, and the bytes charged for it
+	bool		bInFlight;
+	int64		InFlightBytes;
+	// Connection to answer once the mesh is committed, unset when it did not ask for responses
+	FMeshSyncConnectionWeakPtr	Requester;
+	uint32		RequestId;
+};
+
+class FSyncedMaterialDesc
+{
+public:
+	FSyncedMaterialDesc() : RequestId(0) {}
+
+	FString		Name;
+	// Category in the high 16 bits, see EMaterialMS
+	uint32		MaterialId;
+	FVector		BaseColor;
+	float		Roughness;
+	float		Metallic;
+	FString		BaseColorMap;
+	FString		NormalMap;
+	// See FMeshSyncAssetIndex::HashMaterial, materials sharing it share one instance
+	FSHAHash	ParameterHash;
+	// See FSyncedMeshDesc
+	FMeshSyncConnectionWeakPtr	Requester;
+	uint32		RequestId;
+};
+
+// A fully received frame waiting to be decoded on a worker.
+struct FMeshSyncFrame
+{
+	EMeshSyncCommand Command;
+	TArray<uint8> Body;
+	// When the last byte arrived, or when a replay injected the frame.
+	uint64 ReceiveCycles;
+};
+
+/**
+ * One client connection. The server's reactor thread pumps the socket
+ * without blocking and assembles frames, which are then decoded in arrival
+ * order by at most one pool worker at a time.
+ */
+class FMeshSyncConnection : public TSharedFromThis<FMeshSyncConnection, ESPMode::ThreadSafe> {
+public:
+	// A NULL socket makes a replay connection, fed through InjectFrame instead of the network.
+	FMeshSyncConnection(FMeshSyncServer* InServer, FSocket* InSocket, FString const& InPackage, uint32 InId);
+	~FMeshSyncConnection();
+
+	// Reads what the socket has pending without blocking. Returns false when the connection should be dropped.
+	bool PumpReceive(bool& bOutProgress);
+
+	// Writes whatever outgoing frames the socket accepts without blocking, runs on the reactor.
+	bool PumpSend(bool& bOutProgress);
+
+	// Decodes queued frames until none are left, runs on a pool worker.
+	void ProcessFrames();
+
+	// Queues a copy of a recorded frame for decoding, as if it had just been received.
+	void InjectFrame(EMeshSyncCommand Command, const uint8* Data, uint32 Length);
+
+	bool IsReplay() const { return Socket == NULL; }
+	uint32 GetId() const { return Id; }
+
+	// Queues a frame for the reactor to send, callable from any thread.
+	void SendFrame(EMeshSyncCommand Command, const TArray<uint8>& Body);
+
+	// Sends a Response frame if the client negotiated them, callable from any thread.
+	void Respond(uint32 RequestId, EMeshSyncResponse Status, const FString& Detail);
+	bool WantsResponses() const { return Responses.GetValue() != 0; }
+
+	bool HasFailed() const { return Failed.GetValue() != 0; }
+
+	bool IsAlive() const {
+		return !Failed.GetValue() && Socket && 
+			Socket->GetConnectionState() == SCS_Connected;
+	}
+
+	bool HasFrameBacklog() const {
+		return NumPendingFrames.GetValue() >= MaxPendingFrames;
+	}
+
+	bool HasPendingFrames() const {
+		return NumPendingFrames.GetValue() > 0;
+	}
+
+	// Reactor only. Data is left in the socket while workers catch up, nothing signals when they do.
+	bool IsReadingPaused() const;
+	bool HasPendingSend();
+	FSocket* GetSocket() const { return Socket; }
+
+	bool Dispatch(EMeshSyncCommand Command, FMeshSyncFrameReader& Reader);
+	bool ProcessingIncomingMesh(FMeshSyncFrameReader& Reader);
+	bool ProcessingIncomingMaterial(FMeshSyncFrameReader& Reader);
+	bool ProcessingIncomingMeshDelta(FMeshSyncFrameReader& Reader);
+	bool ProcessingHello(FMeshSyncFrameReader& Reader);
+	bool ProcessingCompressed(FMeshSyncFrameReader& Reader);
+	bool ProcessingMeshBegin(FMeshSyncFrameReader& Reader);
+	bool ProcessingMeshChunk(FMeshSyncFrameReader& Reader);
+	bool ProcessingMeshEnd(FMeshSyncFrameReader& Reader);
+
+	void GetAddress(FInternetAddr& Addr)
+	{
+		Socket->GetAddress(Addr);
+	}
+
+	void GetPeerAddress(FInternetAddr& Addr)
+	{
+		Socket->GetPeerAddress(Addr);
+	}
+
+	// Frames a connection may have received but not yet decoded before the reactor stops reading it.
+	static const int32 MaxPendingFrames = 4;
+
+private:
+	// Non-blocking receive into Dest, returns false on a closed or failed socket.
+	bool ReceiveSome(uint8* Dest, uint32 Count, uint32& OutReceived);
+	bool ProcessingPayload(MeshSyncPayload& Payload);
+	FMeshSyncFrame* AllocFrame();
+	void QueueFrame(FMeshSyncFrame* Frame);
+	// Decodes a SendMesh body into Desc and hashes it.
+	bool DecodeMesh(FMeshSyncFrameReader& Reader, FSyncedMeshDesc& Desc);
+	bool AcceptsEncodings(MeshFlag Flag, const FString& Name) const;
+	// Validates and hashes a fully decoded mesh.
+	bool FinishMesh(FSyncedMeshDesc& Desc);
+	// Answers a decoded mesh and remembers where to send its commit result.
+	void AcceptMesh(FSyncedMeshDesc& Desc, uint32 RequestId);
+
+	FSocket* Socket;
+	FMeshSyncServer* Server;
+	uint32 Id;
+	typedef bool(FMeshSyncConnection::*FnProcessing)(FMeshSyncFrameReader& Reader);
+	TMap<EMeshSyncCommand, FnProcessing> DispProcs;
+	FString PathPackage;
+
+	// Frame being assembled by the reactor.
+	MeshSyncPayload Header;
+	uint32 HeaderReceived;
+	FMeshSyncFrame* Current;
+	uint32 BodyReceived;
+	uint64 FrameStartCycles;
+
+	// Frames handed over to workers, and spent frames kept for their buffers.
+	FCriticalSection FramesLock;
+	TArray<FMeshSyncFrame*> PendingFrames;
+	TArray<FMeshSyncFrame*> FreeFrames;
+	FThreadSafeCounter NumPendingFrames;
+	// Set while a worker owns ProcessFrames for this connection.
+	FThreadSafeCounter Scheduled;
+	FThreadSafeCounter Failed;
+
+	// Outgoing bytes not yet accepted by the socket.
+	FCriticalSection SendLock;
+	TArray<uint8> SendBuffer;
+
+	// Negotiated by Hello, only touched by the worker owning ProcessFrames.
+	EMeshSyncCodec Codec;
+	MeshFlag Encodings;
+	TArray<uint8> InflateBuffer;
+	// Index of the frame being dispatched, the request id of its responses.
+	uint32 FrameSequence;
+	// Read by the commit queue as well, hence the counter.
+	FThreadSafeCounter Responses;
+
+	// A mesh streamed with SendMeshBegin/Chunk/End, decoded chunk by chunk.
+	struct FMeshSyncUpload
+	{
+		FSyncedMeshDesc* Desc;
+		uint32 RequestId;
+		MeshFlag Flag;
+		FVector PositionMin;
+		FVector PositionMax;
+		uint64 Declared[(int32)EMeshSyncChannel::Num];
+		uint64 Received[(int32)EMeshSyncChannel::Num];
+
+		FMeshSyncUpload()
+			: Desc(NULL)
+			, RequestId(0)
+			, Flag(MeshFlag::NONE)
+			, PositionMin(0.0f)
+			, PositionMax(0.0f)
+		{}
+	};
+	// Open uploads by client chosen id, only touched by the worker owning ProcessFrames.
+	TMap<uint32, FMeshSyncUpload> Uploads;
+	static const int32 MaxUploads = 16;
+	// Larger inflate buffers and recycled frame bodies are freed after use.
+	static const int32 MaxRetainedInflateBytes = 16 * 1024 * 1024;
+	static const int32 MaxRetainedFrameBytes = 16 * 1024 * 1024;
+};
+
+typedef TSharedPtr<FMeshSyncConnection, ESPMode::ThreadSafe> FMeshSyncConnectionPtr;
+
+class FMeshSyncServer : public FRunnable
+{
+public:
+	FMeshSyncServer() : Socket(NULL), Thread(NULL), WorkerPool(NULL), Preprocessor(NULL), Merger(NULL), CommitQueue(NULL), AssetIndex(NULL), Capture(NULL), MaterialResolver(NULL), Palette(NULL), BenchAssetIndex(NULL), BenchMerger(NULL), NextConnectionId(0) {}
+	~FMeshSyncServer();
+
+	void Create(int InPort);
+
+	virtual bool Init() override
+	{
+		return true;
+	}
+
+	void Stop() {
+		StopRequested.Set(1);
+	}
+
+	//void AddMesh(FSyncedMeshDesc const& Desc) {
+	//	FScopeLock ScopeLock(&MeshMutex);
+	//	bool bIsAlreayExists = false;
+	//	Meshes.Add(Desc, &bIsAlreayExists);
+	//	if (bIsAlreayExists) {
+	//		UE_LOG(LogMeshSync, Display, TEXT("%s is already added !"), *Desc.Name);
+	//	}
+	//}
+
+	virtual uint32 Run() override;
+
+	// Hands a connection with queued frames to the worker pool.
+	void ScheduleFrames(FMeshSyncConnection* Connection);
+
+	FMeshSyncPreprocessor& GetPreprocessor() { return *Preprocessor; }
+	FMeshSyncMerger& GetMerger() { return IsBenchmarking() ? *BenchMerger : *Merger; }
+	FMeshSyncCommitQueue& GetCommitQueue() { return *CommitQueue; }
+	FMeshSyncAssetIndex& GetAssetIndex() { return IsBenchmarking() ? *BenchAssetIndex : *AssetIndex; }
+	FMeshSyncCapture& GetCapture() { return *Capture; }
+	FMeshSyncDescPool& GetDescPool() { return DescPool; }
+	FMeshSyncMaterialResolver& GetMaterialResolver() { return *MaterialResolver; }
+	FMeshSyncPalette& GetPalette() { return *Palette; }
+
+	// Accounts a decoded mesh until its commit, charging again re-measures it.
+	void ChargeInFlight(FSyncedMeshDesc& Desc);
+	void ReleaseInFlight(FSyncedMeshDesc& Desc);
+	// Frame bodies count from their allocation until they are decoded.
+	void ChargeInFlightBytes(int64 Bytes);
+	void ReleaseInFlightBytes(int64 Bytes);
+	// Connections stop reading while decoded meshes exceed the configured budget.
+	bool IsOverInFlightBudget() const;
+	int64 GetInFlightMemoryBudget() const;
+
+	// Reactor wait between polls of attached clients where sockets cannot be waited on natively,
+	// and how often their sockets are checked for a dropped peer.
+	static const int32 MinIdleWaitMs = 1;
+	static const int32 MaxIdleWaitMs = 50;
+	static const int32 LivenessCheckIntervalMs = 250;
+
+	// Port the server accepts clients on, 0 when it failed to listen.
+	int32 GetPort() const;
+
+	const FString& MainPackage() const { return IsBenchmarking() ? PathBenchPackage : PathPackage; }
+	const FString& MaterialsPackage() const { return IsBenchmarking() ? PathBenchMaterials : PathPackageMaterials; }
+
+	/**
+	 * Game thread. While a benchmark runs everything received is committed under
+	 * /Temp/MeshSyncBench/ into an index and merger of its own, and is neither placed nor saved.
+	 * Clients attached meanwhile count as part of it. Fails unless the pipeline is idle.
+	 */
+	bool BeginBenchmark();
+	/** Game thread, once the pipeline drained. Drops the benchmark's assets, index and merger. */
+	void EndBenchmark();
+	bool IsBenchmarking() const { return Benchmarking.GetValue() != 0; }
+
+	UMaterialInterface* FindMaterial(FString const& Name);
+	void AddMaterial(FString const& Name, UMaterialInterface* Material);
+
+private:
+	void InitMaterials();
+	void AcceptConnections();
+#if MESHSYNC_NATIVE_POLL
+	/** Blocks until the listen socket or a client socket has work for the reactor, or its timeout passes. */
+	void WaitForSockets();
+#endif
+
+	// Holds the server (listening) socket.
+	FSocket*	Socket;
+	FString		PathPackage;
+	FString		PathPackageMaterials;
+	FString		PathBenchPackage;
+	FString		PathBenchMaterials;
+	// Holds the server thread object.
+	FRunnableThread* Thread;
+	// Decodes frames for all connections.
+	FQueuedThreadPool* WorkerPool;
+	// Prepares decoded meshes on task graph workers.
+	FMeshSyncPreprocessor* Preprocessor;
+	// Merges tiles into cells for bMergeTilesIntoCells.
+	FMeshSyncMerger* Merger;
+	// Turns decoded frames into assets on the game thread.
+	FMeshSyncCommitQueue* CommitQueue;
+	// Content hashes of the meshes synced so far, persisted across sessions.
+	FMeshSyncAssetIndex* AssetIndex;
+	// Records received frames and replays recordings.
+	FMeshSyncCapture* Capture;
+	// Material names to materials, with a snapshot for the workers.
+	FMeshSyncMaterialResolver* MaterialResolver;
+	// Brick colors for bUsePaletteMaterials.
+	FMeshSyncPalette* Palette;
+	// Stand in for AssetIndex and Merger while a benchmark runs.
+	FMeshSyncAssetIndex* BenchAssetIndex;
+	FMeshSyncMerger* BenchMerger;
+	FThreadSafeCounter Benchmarking;
+	uint32 NextConnectionId;
+	FMeshSyncDescPool DescPool;
+	// Decoded meshes between decode and commit.
+	FThreadSafeCounter InFlightMeshes;
+	FThreadSafeCounter64 InFlightBytes;
+	// Holds the address that the server is bound to.
+	TSharedPtr<FInternetAddr> ListenAddr;
+	// Holds a flag indicating whether the thread should stop executing
+	FThreadSafeCounter StopRequested;
+	// Is the Listner thread up and running. 
+	FThreadSafeCounter Running;
+	// Only touched by the reactor thread.
+	TArray<FMeshSyncConnectionPtr> Connections;
+/*
+	FCriticalSection			MeshMutex;
+	TSet<FSyncedMeshDesc> Meshes;
+*/
+
+	TMap<FString, UMaterialInstanceConstant*> MaterialInstances;
+};
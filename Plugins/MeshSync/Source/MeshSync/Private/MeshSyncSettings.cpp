@@ -1,4 +1,28 @@
 #include "MeshSyncSettings.h"
 
 UMeshSyncSettings::UMeshSyncSettings(void)
+	: WorkerThreads(0)
+	, bAllowCompression(true)
+	, bAllowQuantization(true)
+	, MaxInFlightMeshes(256)
+	, MaxInFlightMemoryMB(1024)
+	, CommitTimeBudgetMs(8.0f)
+	, MaxCommitsPerFrame(64)
+	, bPreprocessOnWorkers(true)
+	, LightmapResolution(64)
+	, bCacheBuildProducts(true)
+	, Collision(EMeshSyncCollision::ComplexAsSimple)
+	, bCookCollisionAsync(true)
+	, bDeduplicateMeshes(true)
+	, bUsePaletteMaterials(false)
+	, bSaveInBackground(false)
+	, SaveTimeBudgetMs(4.0f)
+	, bMergeTilesIntoCells(false)
+	, MergeCellSize(4)
+	, MergeDelaySeconds(1.0f)
+	, MaxMergeRetainedMemoryMB(512)
+	, bPlaceTilesInLevel(false)
+	, TileSize(1000.0f)
+	, bStreamTilesByCell(false)
+	, StreamingCellSize(8)
 {}
\ No newline at end of file
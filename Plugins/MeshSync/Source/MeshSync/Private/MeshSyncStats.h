@@ -0,0 +1,45 @@
+// Copyright 1998-2019 Epic Games, Inc. All Rights Reserved.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Stats/Stats.h"
+
+DECLARE_STATS_GROUP(TEXT("MeshSync"), STATGROUP_MeshSync, STATCAT_Advanced);
+
+// Reactor thread
+DECLARE_CYCLE_STAT_EXTERN(TEXT("Receive"), STAT_MeshSync_Receive, STATGROUP_MeshSync, );
+DECLARE_CYCLE_STAT_EXTERN(TEXT("Process Payload"), STAT_MeshSync_ProcessPayload, STATGROUP_MeshSync, );
+// Frame workers
+DECLARE_CYCLE_STAT_EXTERN(TEXT("Dispatch Frame"), STAT_MeshSync_Dispatch, STATGROUP_MeshSync, );
+DECLARE_CYCLE_STAT_EXTERN(TEXT("Inflate Frame"), STAT_MeshSync_Inflate, STATGROUP_MeshSync, );
+DECLARE_CYCLE_STAT_EXTERN(TEXT("Read Array Layout"), STAT_MeshSync_ReadLayout, STATGROUP_MeshSync, );
+DECLARE_CYCLE_STAT_EXTERN(TEXT("Read Arrays"), STAT_MeshSync_ReadArrays, STATGROUP_MeshSync, );
+DECLARE_CYCLE_STAT_EXTERN(TEXT("IsValidOrFixable"), STAT_MeshSync_Validate, STATGROUP_MeshSync, );
+DECLARE_CYCLE_STAT_EXTERN(TEXT("Hash Mesh"), STAT_MeshSync_Hash, STATGROUP_MeshSync, );
+// Preprocess tasks
+DECLARE_CYCLE_STAT_EXTERN(TEXT("Preprocess Mesh"), STAT_MeshSync_Preprocess, STATGROUP_MeshSync, );
+DECLARE_CYCLE_STAT_EXTERN(TEXT("Reduce LODs"), STAT_MeshSync_ReduceLODs, STATGROUP_MeshSync, );
+DECLARE_CYCLE_STAT_EXTERN(TEXT("Merge Cell"), STAT_MeshSync_MergeCell, STATGROUP_MeshSync, );
+DECLARE_CYCLE_STAT_EXTERN(TEXT("Spill Cell"), STAT_MeshSync_SpillCell, STATGROUP_MeshSync, );
+// Game thread
+DECLARE_CYCLE_STAT_EXTERN(TEXT("Commit Batch"), STAT_MeshSync_CommitBatch, STATGROUP_MeshSync, );
+DECLARE_CYCLE_STAT_EXTERN(TEXT("CreatePackage"), STAT_MeshSync_CreatePackage, STATGROUP_MeshSync, );
+DECLARE_CYCLE_STAT_EXTERN(TEXT("CreateBodySetup"), STAT_MeshSync_CreateBodySetup, STATGROUP_MeshSync, );
+DECLARE_CYCLE_STAT_EXTERN(TEXT("PostEditChange"), STAT_MeshSync_PostEditChange, STATGROUP_MeshSync, );
+DECLARE_CYCLE_STAT_EXTERN(TEXT("Commit Material"), STAT_MeshSync_CommitMaterial, STATGROUP_MeshSync, );
+DECLARE_CYCLE_STAT_EXTERN(TEXT("Place Tiles"), STAT_MeshSync_PlaceTiles, STATGROUP_MeshSync, );
+DECLARE_CYCLE_STAT_EXTERN(TEXT("Save Packages"), STAT_MeshSync_SavePackages, STATGROUP_MeshSync, );
+
+DECLARE_DWORD_COUNTER_STAT_EXTERN(TEXT("Bytes Received"), STAT_MeshSync_BytesReceived, STATGROUP_MeshSync, );
+DECLARE_DWORD_ACCUMULATOR_STAT_EXTERN(TEXT("Frames In Flight"), STAT_MeshSync_FramesInFlight, STATGROUP_MeshSync, );
+DECLARE_DWORD_ACCUMULATOR_STAT_EXTERN(TEXT("Meshes Preprocessing"), STAT_MeshSync_PreprocessInFlight, STATGROUP_MeshSync, );
+DECLARE_DWORD_ACCUMULATOR_STAT_EXTERN(TEXT("Commit Queue Depth"), STAT_MeshSync_CommitQueueDepth, STATGROUP_MeshSync, );
+DECLARE_DWORD_ACCUMULATOR_STAT_EXTERN(TEXT("In Flight Meshes"), STAT_MeshSync_InFlightMeshes, STATGROUP_MeshSync, );
+DECLARE_MEMORY_STAT_EXTERN(TEXT("In Flight Memory"), STAT_MeshSync_InFlightMemory, STATGROUP_MeshSync, );
+DECLARE_DWORD_ACCUMULATOR_STAT_EXTERN(TEXT("Reading Paused"), STAT_MeshSync_ReadingPaused, STATGROUP_MeshSync, );
+
+// Cycle stat that also shows up as a named event in external profilers.
+#define MESHSYNC_SCOPE(Stat) \
+	SCOPE_CYCLE_COUNTER(Stat); \
+	SCOPED_NAMED_EVENT(Stat, FColor::Turquoise)
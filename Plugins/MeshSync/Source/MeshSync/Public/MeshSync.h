@@ -17,6 +17,8 @@ public:
 
 	virtual void StopMeshSyncServer();
 
+	FMeshSyncServer* GetServer() const { return Server; }
+
 private:
 	FMeshSyncServer* Server;
 };
@@ -6,6 +6,38 @@
 
 #include "MeshSyncSettings.generated.h"
 
+/** Collision given to synced meshes. */
+UENUM()
+enum class EMeshSyncCollision : uint8
+{
+	/** Per triangle collision from the render mesh. */
+	ComplexAsSimple,
+	/** One convex hull around the tile. */
+	Convex,
+	/** One box around the tile. */
+	Box,
+};
+
+/** One generated level of detail. */
+USTRUCT()
+struct FMeshSyncLODLevel
+{
+	GENERATED_BODY()
+
+	/** Screen size below which this LOD is drawn. */
+	UPROPERTY(config, EditAnywhere, meta = (ClampMin = "0.0", UIMin = "0.0"))
+	float ScreenSize;
+
+	/** Fraction of the triangles of LOD 0 to keep. */
+	UPROPERTY(config, EditAnywhere, meta = (ClampMin = "0.0", ClampMax = "1.0", UIMin = "0.0", UIMax = "1.0"))
+	float PercentTriangles;
+
+	FMeshSyncLODLevel()
+		: ScreenSize(0.3f)
+		, PercentTriangles(0.5f)
+	{}
+};
+
 UCLASS(config = Game)
 class MESHSYNC_API UMeshSyncSettings
 	: public UObject
@@ -26,4 +58,111 @@ public:
 	/** The package path specified for MeshSync assets */
 	UPROPERTY(config, EditAnywhere, Category = Server)
 	FString SyncPackageLocation;
+
+	/** Number of threads decoding incoming frames, 0 picks one per two logical cores. */
+	UPROPERTY(config, EditAnywhere, Category = Server, meta = (ClampMin = "0"))
+	int32 WorkerThreads;
+
+	/** Let clients negotiate block compression of their frames. */
+	UPROPERTY(config, EditAnywhere, Category = Server)
+	bool bAllowCompression;
+
+	/** Let clients negotiate quantized positions, octahedral normals and half float UVs. */
+	UPROPERTY(config, EditAnywhere, Category = Server)
+	bool bAllowQuantization;
+
+	/** Decoded meshes waiting to be committed before the server stops reading from clients. */
+	UPROPERTY(config, EditAnywhere, Category = Server, meta = (ClampMin = "1", UIMin = "1"))
+	int32 MaxInFlightMeshes;
+
+	/** Memory held by received frames and decoded meshes waiting to be committed before the server stops reading from clients, in megabytes. Larger frames are rejected. */
+	UPROPERTY(config, EditAnywhere, Category = Server, meta = (ClampMin = "1", UIMin = "1"))
+	int32 MaxInFlightMemoryMB;
+
+	/** Game thread time spent committing synced assets per frame, in milliseconds. */
+	UPROPERTY(config, EditAnywhere, Category = Import, meta = (ClampMin = "0.1", UIMin = "0.1"))
+	float CommitTimeBudgetMs;
+
+	/** Upper bound on synced assets committed in a single frame. */
+	UPROPERTY(config, EditAnywhere, Category = Import, meta = (ClampMin = "1", UIMin = "1"))
+	int32 MaxCommitsPerFrame;
+
+	/** Compute normals, tangents and lightmap UVs on worker threads instead of during the game thread build. */
+	UPROPERTY(config, EditAnywhere, Category = Import)
+	bool bPreprocessOnWorkers;
+
+	/** Lightmap resolution used to lay out the generated lightmap UVs. */
+	UPROPERTY(config, EditAnywhere, Category = Import, meta = (ClampMin = "4", UIMin = "4"))
+	int32 LightmapResolution;
+
+	/** Keep what the workers compute for a mesh in the derived data cache, keyed by its content and these settings. */
+	UPROPERTY(config, EditAnywhere, Category = Import, meta = (EditCondition = "bPreprocessOnWorkers"))
+	bool bCacheBuildProducts;
+
+	/** LODs added below the synced mesh, each reduced from LOD 0 on worker threads. Empty keeps a single LOD. */
+	UPROPERTY(config, EditAnywhere, Category = Import)
+	TArray<FMeshSyncLODLevel> LODs;
+
+	/** Collision of synced meshes. Simple shapes are fitted on worker threads. */
+	UPROPERTY(config, EditAnywhere, Category = Import)
+	EMeshSyncCollision Collision;
+
+	/** Cook collision in the background, tiles appear in the level once their collision is ready. */
+	UPROPERTY(config, EditAnywhere, Category = Import)
+	bool bCookCollisionAsync;
+
+	/** Resolve tiles whose geometry was already imported to the existing mesh instead of creating a new asset. */
+	UPROPERTY(config, EditAnywhere, Category = Import)
+	bool bDeduplicateMeshes;
+
+	/**
+	 * Pack brick colors into a palette texture and store each wedge's palette index in its vertex color
+	 * (red low byte, green high byte), sharing one material instance per category instead of one per color.
+	 * The parent materials must sample their PaletteTexture parameter with that index.
+	 */
+	UPROPERTY(config, EditAnywhere, Category = Import)
+	bool bUsePaletteMaterials;
+
+	/** Save the packages of committed assets a few at a time in the background instead of leaving them dirty. */
+	UPROPERTY(config, EditAnywhere, Category = Saving)
+	bool bSaveInBackground;
+
+	/** Game thread time spent saving packages per frame, in milliseconds. */
+	UPROPERTY(config, EditAnywhere, Category = Saving, meta = (ClampMin = "0.1", UIMin = "0.1", EditCondition = "bSaveInBackground"))
+	float SaveTimeBudgetMs;
+
+	/** Merge the tiles of each spatial cell into one mesh per material instead of importing every tile. */
+	UPROPERTY(config, EditAnywhere, Category = Merging)
+	bool bMergeTilesIntoCells;
+
+	/** Tiles along each side of a merged cell. */
+	UPROPERTY(config, EditAnywhere, Category = Merging, meta = (ClampMin = "1", UIMin = "1", EditCondition = "bMergeTilesIntoCells"))
+	int32 MergeCellSize;
+
+	/** A cell is merged once none of its tiles changed for this long, in seconds. */
+	UPROPERTY(config, EditAnywhere, Category = Merging, meta = (ClampMin = "0.0", UIMin = "0.0", EditCondition = "bMergeTilesIntoCells"))
+	float MergeDelaySeconds;
+
+	/**
+	 * Memory kept for the tiles of merged cells so a changed cell can be merged again, in megabytes.
+	 * Beyond it the cells that changed least recently are written to disk and read back when they change.
+	 */
+	UPROPERTY(config, EditAnywhere, Category = Merging, meta = (ClampMin = "1", UIMin = "1", EditCondition = "bMergeTilesIntoCells"))
+	int32 MaxMergeRetainedMemoryMB;
+
+	/** Place synced tiles in the editor world as hierarchical instances, one component per distinct mesh. */
+	UPROPERTY(config, EditAnywhere, Category = Placement)
+	bool bPlaceTilesInLevel;
+
+	/** World space extent of one tile, a tile is placed at its TileX/TileY/TileZ times this size. */
+	UPROPERTY(config, EditAnywhere, Category = Placement)
+	FVector TileSize;
+
+	/** Place tiles in streaming sub-levels, one per cell of StreamingCellSize tiles, instead of the persistent level. */
+	UPROPERTY(config, EditAnywhere, Category = Placement, meta = (EditCondition = "bPlaceTilesInLevel"))
+	bool bStreamTilesByCell;
+
+	/** Tiles along each side of a streaming cell. */
+	UPROPERTY(config, EditAnywhere, Category = Placement, meta = (ClampMin = "1", UIMin = "1", EditCondition = "bStreamTilesByCell"))
+	int32 StreamingCellSize;
 };
\ No newline at end of file